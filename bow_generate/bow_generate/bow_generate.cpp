@@ -20,17 +20,29 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/nonfree/nonfree.hpp"
 
+#include "../../common/stage_timer.h"
+#include "../../common/pipeline.h"
+#include "../../common/image_loader.h"
+#include "../../common/minibatch_kmeans.h"
+#include "../../common/vocabulary_tree.h"
+#include "../../common/descriptor_spool.h"
+#include "../../common/inverted_index.h"
+#include "../../common/bow_database.h"
+
 using namespace std;
 using namespace cv;
 
-typedef enum {kLongOptionIndexNone, kLongOptionIndexDirectory, kLongOptionIndexDetector, kLongOptionIndexDetectorAdapter, kLongOptionIndexExtractor, kLongOptionIndexExtractorAdapter, kLongOptionIndexMatcher, kLongOptionIndexFeaturesOutput, kLongOptionIndexDescriptorsOutput, kLongOptionIndexClusterNumber} LongOptionIndex;
+typedef enum {kLongOptionIndexNone, kLongOptionIndexDirectory, kLongOptionIndexDetector, kLongOptionIndexDetectorAdapter, kLongOptionIndexExtractor, kLongOptionIndexExtractorAdapter, kLongOptionIndexMatcher, kLongOptionIndexFeaturesOutput, kLongOptionIndexDescriptorsOutput, kLongOptionIndexClusterNumber, kLongOptionIndexReport, kLongOptionIndexDecoders, kLongOptionIndexPrefetch, kLongOptionIndexMaxSide, kLongOptionIndexScale, kLongOptionIndexTrainer, kLongOptionIndexSampleSize, kLongOptionIndexBatchSize, kLongOptionIndexThreads, kLongOptionIndexWarmStart, kLongOptionIndexCompareTrainer, kLongOptionIndexVocabularyTree, kLongOptionIndexBranching, kLongOptionIndexDepth, kLongOptionIndexMemoryBudget} LongOptionIndex;
 
 static const char* detectorAlgorithms[] = {"SURF","FAST","STAR","SIFT","ORB","BRISK","MSER","GFTT","HARRIS","Dense","SimpleBlob"};
 static const char* extractorAlgorithms[] = {"SURF","SIFT","BRIEF","BRISK","ORB","FREAK"};
 static const char* matchAlgorithms[] = {"FlannBased","BruteForce","BruteForce-L1","BruteForce-Hamming","BruteForce-Hamming(2)"};
 static const char* featuresOutputDefault = "features.yml";
-static const char* descriptorsOutputDefault = "descriptors.yml";
+static const char* descriptorsOutputDefault = "descriptors.bow";
+static const char* yamlExtensions[] = {".yml",".yaml",".xml",".yml.gz",".yaml.gz",".xml.gz"};
 static const int clusterNumberDefault = 1000;
+static const char* trainerAlgorithms[] = {"kmeans","minibatch"};
+static const int threadsDefault = 1;
 
 static const int BOW_TRAINER_RETRIES = 3;
 static const int BOW_TRAINER_FLAGS = KMEANS_PP_CENTERS;
@@ -39,12 +51,30 @@ const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *
 const Ptr<DescriptorExtractor> getExtractor(const char *extractorAdapter, const char *extractorAlgorithm);
 const BOWKMeansTrainer getBOWTrainer(int vocabularySize);
 const Ptr<DescriptorMatcher> getMatcher(const char *matchAlgorithm);
+void computeBowDescriptor(const Ptr<DescriptorMatcher> &matcher, int words, const Mat &descriptors, Mat &bowDescriptor);
+bool isYAMLOutput(const char *output);
 
 int main(int argc, char * const *argv)
 {
     const char *directoryName, *detectorAlgorithm, *detectorAdapter, *extractorAlgorithm, *extractorAdapter, *matchAlgorithm, *featuresOutput, *descriptorsOutput;
     directoryName = detectorAlgorithm = detectorAdapter = extractorAlgorithm = extractorAdapter = matchAlgorithm = featuresOutput = descriptorsOutput = NULL;
     int clusterNumber = 0;
+    const char *report = NULL;
+    int decoders = 0;
+    int prefetch = 0;
+    const char *trainer = NULL;
+    const char *warmStart = NULL;
+    int sampleSize = 0;
+    int batchSize = 0;
+    int threads = 0;
+    bool compareTrainer = false;
+    bool vocabularyTree = false;
+    int branching = 0;
+    int depth = 0;
+    int memoryBudget = 0;
+    ImageScale imageScale;
+    imageScale.maxSide = 0;
+    imageScale.scale = 0;
     
     struct option longOptions[] = {
         {"directory", required_argument, 0, kLongOptionIndexDirectory},
@@ -56,6 +86,21 @@ int main(int argc, char * const *argv)
         {"features_output", required_argument, 0, kLongOptionIndexFeaturesOutput},
         {"descriptors_output", required_argument, 0, kLongOptionIndexDescriptorsOutput},
         {"cluster_number", required_argument, 0, kLongOptionIndexClusterNumber},
+        {"report", required_argument, 0, kLongOptionIndexReport},
+        {"decoders", required_argument, 0, kLongOptionIndexDecoders},
+        {"prefetch", required_argument, 0, kLongOptionIndexPrefetch},
+        {"max_side", required_argument, 0, kLongOptionIndexMaxSide},
+        {"scale", required_argument, 0, kLongOptionIndexScale},
+        {"trainer", required_argument, 0, kLongOptionIndexTrainer},
+        {"sample_size", required_argument, 0, kLongOptionIndexSampleSize},
+        {"batch_size", required_argument, 0, kLongOptionIndexBatchSize},
+        {"threads", required_argument, 0, kLongOptionIndexThreads},
+        {"warm_start", required_argument, 0, kLongOptionIndexWarmStart},
+        {"compare_trainer", no_argument, 0, kLongOptionIndexCompareTrainer},
+        {"vocabulary_tree", no_argument, 0, kLongOptionIndexVocabularyTree},
+        {"branching", required_argument, 0, kLongOptionIndexBranching},
+        {"depth", required_argument, 0, kLongOptionIndexDepth},
+        {"memory_budget", required_argument, 0, kLongOptionIndexMemoryBudget},
         {0, 0, 0, 0}
     };
     
@@ -98,6 +143,66 @@ int main(int argc, char * const *argv)
                 clusterNumber = atoi(optarg);
                 break;
             }
+            case kLongOptionIndexReport: {
+                report = optarg;
+                break;
+            }
+            case kLongOptionIndexDecoders: {
+                decoders = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexPrefetch: {
+                prefetch = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexMaxSide: {
+                imageScale.maxSide = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexScale: {
+                imageScale.scale = atof(optarg);
+                break;
+            }
+            case kLongOptionIndexTrainer: {
+                trainer = optarg;
+                break;
+            }
+            case kLongOptionIndexSampleSize: {
+                sampleSize = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexBatchSize: {
+                batchSize = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexThreads: {
+                threads = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexWarmStart: {
+                warmStart = optarg;
+                break;
+            }
+            case kLongOptionIndexCompareTrainer: {
+                compareTrainer = true;
+                break;
+            }
+            case kLongOptionIndexVocabularyTree: {
+                vocabularyTree = true;
+                break;
+            }
+            case kLongOptionIndexBranching: {
+                branching = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexDepth: {
+                depth = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexMemoryBudget: {
+                memoryBudget = atoi(optarg);
+                break;
+            }
             default:
                 break;
         }
@@ -135,6 +240,81 @@ int main(int argc, char * const *argv)
         cout << "use " << clusterNumberDefault << " as cluster number" << endl;
         clusterNumber = clusterNumberDefault;
     }
+    if (decoders<=0) {
+        cout << "use " << PIPELINE_DECODERS_DEFAULT << " as number of decoder threads" << endl;
+        decoders = PIPELINE_DECODERS_DEFAULT;
+    }
+    if (prefetch<=0) {
+        cout << "use " << PIPELINE_PREFETCH_DEFAULT << " as number of prefetched images" << endl;
+        prefetch = PIPELINE_PREFETCH_DEFAULT;
+    }
+    
+    if (imageScale.maxSide<0 || imageScale.scale<0) {
+        cout << "max_side and scale must not be negative" << endl;
+        return -1;
+    }
+    
+    if (isImageScaled(imageScale)) {
+        cout << "shrink images to " << imageScaleString(imageScale) << endl;
+    }
+    
+    if (!trainer) {
+        cout << "use " << trainerAlgorithms[0] << " as vocabulary trainer" << endl;
+        trainer = trainerAlgorithms[0];
+    }
+    bool miniBatch = strcmp(trainer, trainerAlgorithms[1])==0;
+    if (!miniBatch && strcmp(trainer, trainerAlgorithms[0])!=0) {
+        cout << "unknown vocabulary trainer " << trainer << ", use kmeans or minibatch" << endl;
+        return -1;
+    }
+    if (miniBatch && sampleSize<=0) {
+        cout << "use " << MINIBATCH_SAMPLE_DEFAULT << " as number of sampled descriptors" << endl;
+        sampleSize = MINIBATCH_SAMPLE_DEFAULT;
+    }
+    if (miniBatch && batchSize<=0) {
+        cout << "use " << MINIBATCH_BATCH_DEFAULT << " as mini-batch size" << endl;
+        batchSize = MINIBATCH_BATCH_DEFAULT;
+    }
+    if ((miniBatch || vocabularyTree) && threads<=0) {
+        cout << "use " << threadsDefault << " as number of threads" << endl;
+        threads = threadsDefault;
+    }
+    if ((!miniBatch || vocabularyTree) && (warmStart || compareTrainer)) {
+        cout << "warm_start and compare_trainer need the minibatch trainer without a vocabulary tree" << endl;
+        return -1;
+    }
+    
+    //the tree is trained from all descriptors, or from the sample of the minibatch trainer
+    if (vocabularyTree && branching<=0) {
+        cout << "use " << VOCABULARY_TREE_BRANCHING_DEFAULT << " as branching factor of the vocabulary tree" << endl;
+        branching = VOCABULARY_TREE_BRANCHING_DEFAULT;
+    }
+    if (vocabularyTree && depth<=0) {
+        cout << "use " << VOCABULARY_TREE_DEPTH_DEFAULT << " as depth of the vocabulary tree" << endl;
+        depth = VOCABULARY_TREE_DEPTH_DEFAULT;
+    }
+    
+    //the minibatch trainer only keeps a sample, so the descriptors of all images go to a spool with a memory budget
+    if (miniBatch && memoryBudget<=0) {
+        cout << "use " << DESCRIPTOR_SPOOL_BUDGET_DEFAULT << " megabytes as memory budget for descriptors" << endl;
+        memoryBudget = DESCRIPTOR_SPOOL_BUDGET_DEFAULT;
+    }
+    
+    //the vocabulary of an earlier run, refined instead of starting from k-means++
+    Mat warmVocabulary;
+    if (warmStart) {
+        FileStorage fsWarmStart(warmStart, FileStorage::READ);
+        if (!fsWarmStart.isOpened()) {
+            cout << "could not open warm start file " << warmStart << endl;
+            return -1;
+        }
+        fsWarmStart["vocabulary"] >> warmVocabulary;
+        fsWarmStart.release();
+        if (warmVocabulary.rows!=clusterNumber) {
+            cout << "warm start file " << warmStart << " has " << warmVocabulary.rows << " words, not " << clusterNumber << endl;
+            return -1;
+        }
+    }
     
     DIR *dir;
     dir = opendir(directoryName);
@@ -142,114 +322,193 @@ int main(int argc, char * const *argv)
         cout << "could not open directory " << directoryName << endl;
         return -1;
     }
-    
-    struct dirent *ep;
-    char *filename;
-    char path[1000];
-    struct stat buf;
+    closedir(dir);
     
     int vocabularySize = 0;
     
     Ptr<FeatureDetector> detector = getDetector(detectorAdapter, detectorAlgorithm);
     Ptr<DescriptorExtractor> extractor = getExtractor(extractorAdapter, extractorAlgorithm);
     cv::vector<KeyPoint> keypoints;
-    Mat image;
+    PipelineImage item;
     Mat descriptors;
     Mat features;
+    FeatureReservoir reservoir(sampleSize);
+    DescriptorSpool spool((size_t)memoryBudget << 20);
+    cv::vector<int> featureRows(1, 0);
+    cv::vector<string> filenames;
+    StageTimer timer;
+    int64 tick;
+    
+    //images come in directory order, so the vocabulary does not depend on decoder scheduling
+    ImagePipeline vocabularyPipeline(decoders, prefetch, &timer, true);
+    vocabularyPipeline.setImageScale(imageScale);
+    vocabularyPipeline.start(directoryName);
     
     cout << "Building vocabulary..." << endl;
-    while ((ep = readdir(dir))) {
-    	filename = ep->d_name;
-        if((strchr(filename, '.')-filename)==0)
-        	continue;
-        
-        sprintf(path, "%s/%s", directoryName, filename);
-        
-        lstat(path, &buf);
-        if (S_ISREG(buf.st_mode)) {
-        	image = imread(path, CV_LOAD_IMAGE_GRAYSCALE);
-        	if (image.data) {
-                cout << "File " << filename << "...";
-        		detector->detect(image, keypoints);
-        		extractor->compute(image, keypoints, descriptors);
-             	features.push_back(descriptors);
-                cout << " done" << endl;
-             	vocabularySize++;
-                //break;
+    while (vocabularyPipeline.next(item)) {
+        if (item.image.data) {
+            cout << "File " << item.filename << "...";
+            tick = getTickCount();
+            detector->detect(item.image, keypoints);
+            timer.add("detect", elapsedMiliseconds(tick));
+            extractor->compute(item.image, keypoints, descriptors);
+            timer.add("compute", elapsedMiliseconds(tick));
+            if (miniBatch) {
+                reservoir.add(descriptors);
+                if (!spool.add(descriptors)) {
+                    cout << endl << "could not write descriptors to a temporary file" << endl;
+                    return -1;
+                }
             }
+            else {
+                features.push_back(descriptors);
+                featureRows.push_back(features.rows);
+            }
+            filenames.push_back(item.filename);
+            cout << " done" << endl;
+            vocabularySize++;
         }
     }
-    closedir(dir);
+    vocabularyPipeline.finish();
+    if (spool.bytesSpilled()) {
+        cout << "kept " << (spool.bytesInMemory() >> 20) << " megabytes of descriptors in memory, spilled " << (spool.bytesSpilled() >> 20) << " megabytes to a temporary file" << endl;
+    }
     
     if (!vocabularySize) {
         cout << "There is no image in directory" << endl;
         return -2;
     }
     
+    const Mat &sample = reservoir.sample();
+    if (miniBatch && !vocabularyTree && sample.rows<clusterNumber) {
+        cout << "need at least " << clusterNumber << " descriptors to train the vocabulary, found " << sample.rows << endl;
+        return -1;
+    }
+    if (miniBatch && warmVocabulary.cols!=0 && warmVocabulary.cols!=sample.cols) {
+        cout << "warm start file " << warmStart << " has words of size " << warmVocabulary.cols << ", descriptors have " << sample.cols << endl;
+        return -1;
+    }
+    
     cout << "cluster features...";
     
-    BOWKMeansTrainer bowTrainer = getBOWTrainer(clusterNumber);
-    Mat vocabulary = bowTrainer.cluster(features);
+    tick = getTickCount();
+    Mat vocabulary;
+    VocabularyTree tree;
+    if (vocabularyTree) {
+        Mat treeFeatures = sample;
+        if (!miniBatch)
+            features.convertTo(treeFeatures, CV_32F);
+        tree.build(treeFeatures, branching, depth, threads);
+        timer.add("cluster", elapsedMiliseconds(tick));
+        cout << "\tdone" << endl;
+        cout << "vocabulary tree has " << tree.wordCount() << " words" << endl;
+    }
+    else if (miniBatch) {
+        MiniBatchKMeans miniBatchTrainer(clusterNumber, batchSize, threads);
+        if (!warmVocabulary.empty())
+            miniBatchTrainer.setInitialCenters(warmVocabulary);
+        vocabulary = miniBatchTrainer.cluster(sample);
+        timer.add("cluster", elapsedMiliseconds(tick));
+        cout << "\tdone" << endl;
+        cout << "sampled " << sample.rows << " of " << reservoir.total() << " descriptors, " << miniBatchTrainer.iterations() << " iterations" << (miniBatchTrainer.converged() ? "" : ", stopped before convergence") << endl;
+        cout << "distortion over the sample: " << quantizationDistortion(vocabulary, sample, threads) << endl;
+    }
+    else {
+        BOWKMeansTrainer bowTrainer = getBOWTrainer(clusterNumber);
+        vocabulary = bowTrainer.cluster(features);
+        timer.add("cluster", elapsedMiliseconds(tick));
+        cout << "\tdone" << endl;
+    }
     
-    cout << "\tdone" << endl;
+    //the full k-means trainer on the same sample, to see what the mini-batches give up
+    if (compareTrainer) {
+        cout << "cluster features with kmeans for comparison...";
+        tick = getTickCount();
+        BOWKMeansTrainer bowTrainer = getBOWTrainer(clusterNumber);
+        Mat kmeansVocabulary = bowTrainer.cluster(sample);
+        double kmeansTime = elapsedMiliseconds(tick);
+        timer.add("compare", kmeansTime);
+        cout << "\tdone" << endl;
+        cout << "kmeans distortion over the sample: " << quantizationDistortion(kmeansVocabulary, sample, threads) << " in " << kmeansTime << " miliseconds" << endl;
+    }
     
     cout << "write features to file " << featuresOutput << "...";
     FileStorage fsFeatures(featuresOutput, FileStorage::WRITE);
-    fsFeatures << "vocabulary" << vocabulary;
+    if (vocabularyTree)
+        tree.write(fsFeatures);
+    else
+        fsFeatures << "vocabulary" << vocabulary;
     cout << "\tdone" << endl;
     fsFeatures.release();
+    timer.add("serialize", elapsedMiliseconds(tick));
     
     Ptr<DescriptorMatcher> matcher = getMatcher(matchAlgorithm);
-    
-    BOWImgDescriptorExtractor bowExtractor(extractor, matcher);
-    bowExtractor.setVocabulary(vocabulary);
+    if (!vocabularyTree) {
+        matcher->add(cv::vector<Mat>(1, vocabulary));
+        matcher->train();
+    }
     
     cv::vector<Mat> bowDescriptors;
     Mat bowDescriptor;
-    cv::vector<string> filenames;
     
-    dir = opendir(directoryName);
+    //the descriptors of the vocabulary pass, so no image is decoded or extracted twice
     cout << "Generate bow descriptors..." << endl;
-    while ((ep = readdir(dir))) {
-    	filename = ep->d_name;
-        if((strchr(filename, '.')-filename)==0)
-        	continue;
-        
-        sprintf(path, "%s/%s", directoryName, filename);
-        
-        lstat(path, &buf);
-        if (S_ISREG(buf.st_mode)) {
-        	image = imread(path, CV_LOAD_IMAGE_GRAYSCALE);
-        	if (image.data) {
-                cout << "File " << filename << "...";
-        		detector->detect(image, keypoints);
-        		bowExtractor.compute(image, keypoints, bowDescriptor);
-                bowDescriptors.push_back(bowDescriptor);
-                filenames.push_back(filename);
-                cout << " done" << endl;
-                //break;
+    for (int i=0; i<(int)filenames.size(); i++) {
+        cout << "File " << filenames[i] << "...";
+        tick = getTickCount();
+        if (miniBatch) {
+            if (!spool.get(i, descriptors)) {
+                cout << endl << "could not read descriptors from the temporary file" << endl;
+                return -1;
             }
         }
+        else {
+            descriptors = features.rowRange(featureRows[i], featureRows[i + 1]);
+        }
+        timer.add("reload", elapsedMiliseconds(tick));
+        if (vocabularyTree)
+            tree.bowDescriptor(descriptors, bowDescriptor);
+        else
+            computeBowDescriptor(matcher, vocabulary.rows, descriptors, bowDescriptor);
+        timer.add("bow", elapsedMiliseconds(tick));
+        bowDescriptors.push_back(bowDescriptor);
+        cout << " done" << endl;
     }
-    closedir(dir);
+    
+    //bow_match weights its inverted file with the idf of the database words
+    tick = getTickCount();
+    Mat idf;
+    computeIdf(bowDescriptors, vocabularyTree ? tree.wordCount() : vocabulary.rows, idf);
+    timer.add("idf", elapsedMiliseconds(tick));
     
     cout << "write descriptors to file " << descriptorsOutput << "...";
-    FileStorage fsDescriptors(descriptorsOutput, FileStorage::WRITE);
-    //fsDescriptors << "extractor" << bowExtractor;
-    fsDescriptors << "descriptors" << bowDescriptors;
-    fsDescriptors << "filenames" << filenames;
+    if (isYAMLOutput(descriptorsOutput)) {
+        FileStorage fsDescriptors(descriptorsOutput, FileStorage::WRITE);
+        //fsDescriptors << "extractor" << bowExtractor;
+        fsDescriptors << "descriptors" << bowDescriptors;
+        fsDescriptors << "filenames" << filenames;
+        fsDescriptors << BOW_IDF_KEY << idf;
+        fsDescriptors.release();
+    }
+    else if (!writeBowDatabase(descriptorsOutput, bowFeatureType(detectorAdapter, detectorAlgorithm), bowFeatureType(extractorAdapter, extractorAlgorithm), vocabulary, vocabularyTree ? &tree : NULL, idf.cols, idf, bowDescriptors, filenames)) {
+        cout << endl << "could not write descriptors to file " << descriptorsOutput << endl;
+        return -1;
+    }
     cout << "\tdone" << endl;
-    fsDescriptors.release();
+    timer.add("serialize", elapsedMiliseconds(tick));
+    
+    timer.report(cout);
+    vocabularyPipeline.report(cout);
+    if (report && !timer.writeJSON(report)) {
+        cout << "could not write report file " << report << endl;
+    }
     
     return 0;
 }
 
 const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *detectorAlgorithm)
 {
-    string detectorType = detectorAlgorithm;
-    if (detectorAdapter) {
-        detectorType = detectorAdapter + detectorType;
-    }
+    string detectorType = bowFeatureType(detectorAdapter, detectorAlgorithm);
     
     cout << "create feature detector with type: " << detectorType << endl;
     Ptr<FeatureDetector> result = FeatureDetector::create(detectorType);
@@ -259,10 +518,7 @@ const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *
 
 const Ptr<DescriptorExtractor> getExtractor(const char *extractorAdapter, const char *extractorAlgorithm)
 {
-    string extractorType = extractorAlgorithm;
-    if (extractorAdapter) {
-        extractorType = extractorAdapter + extractorType;
-    }
+    string extractorType = bowFeatureType(extractorAdapter, extractorAlgorithm);
     
     cout << "create descriptor extractor with type: " << extractorType << endl;
     Ptr<DescriptorExtractor> result = DescriptorExtractor::create(extractorType);
@@ -286,3 +542,39 @@ const Ptr<DescriptorMatcher> getMatcher(const char *matchAlgorithm)
     return DescriptorMatcher::create(matchAlgorithm);
 }
 
+//normalized word histogram like BOWImgDescriptorExtractor::compute, from descriptors already extracted;
+//matcher holds the vocabulary as its only train image
+void computeBowDescriptor(const Ptr<DescriptorMatcher> &matcher, int words, const Mat &descriptors, Mat &bowDescriptor)
+{
+    bowDescriptor.release();
+    if (descriptors.empty()) {
+        return;
+    }
+    
+    Mat queries = descriptors;
+    if (queries.type()!=CV_32F) {
+        descriptors.convertTo(queries, CV_32F);
+    }
+    cv::vector<DMatch> matches;
+    matcher->match(queries, matches);
+    
+    bowDescriptor = Mat::zeros(1, words, CV_32F);
+    float *histogram = bowDescriptor.ptr<float>(0);
+    float weight = 1.0f / queries.rows;
+    for (size_t i=0; i<matches.size(); i++) {
+        histogram[matches[i].trainIdx] += weight;
+    }
+}
+
+//YAML stays available as an export format, everything else is written as a binary BOW database
+bool isYAMLOutput(const char *output)
+{
+    size_t length = strlen(output);
+    for (size_t i=0; i<sizeof(yamlExtensions)/sizeof(yamlExtensions[0]); i++) {
+        size_t extensionLength = strlen(yamlExtensions[i]);
+        if (length>=extensionLength && strcasecmp(output + length - extensionLength, yamlExtensions[i])==0) {
+            return true;
+        }
+    }
+    return false;
+}
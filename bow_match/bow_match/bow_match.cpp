@@ -20,16 +20,25 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/nonfree/nonfree.hpp"
 
+#include "../../common/stage_timer.h"
+#include "../../common/ground_truth.h"
+#include "../../common/pipeline.h"
+#include "../../common/image_loader.h"
+#include "../../common/vocabulary_tree.h"
+#include "../../common/inverted_index.h"
+#include "../../common/bow_database.h"
+
 using namespace std;
 using namespace cv;
 
-typedef enum {kLongOptionIndexNone, kLongOptionIndexDirectory, kLongOptionIndexDetector, kLongOptionIndexDetectorAdapter, kLongOptionIndexExtractor, kLongOptionIndexExtractorAdapter, kLongOptionIndexMatcher, kLongOptionIndexFeaturesInput, kLongOptionIndexDescriptorsInput} LongOptionIndex;
+typedef enum {kLongOptionIndexNone, kLongOptionIndexDirectory, kLongOptionIndexDetector, kLongOptionIndexDetectorAdapter, kLongOptionIndexExtractor, kLongOptionIndexExtractorAdapter, kLongOptionIndexMatcher, kLongOptionIndexFeaturesInput, kLongOptionIndexDescriptorsInput, kLongOptionIndexReport, kLongOptionIndexGroundTruth, kLongOptionIndexDecoders, kLongOptionIndexPrefetch, kLongOptionIndexMaxSide, kLongOptionIndexScale, kLongOptionIndexTopK} LongOptionIndex;
 
 static const char* detectorAlgorithms[] = {"SURF","FAST","STAR","SIFT","ORB","BRISK","MSER","GFTT","HARRIS","Dense","SimpleBlob"};
 static const char* extractorAlgorithms[] = {"SURF","SIFT","BRIEF","BRISK","ORB","FREAK"};
 static const char* matchAlgorithms[] = {"FlannBased","BruteForce","BruteForce-L1","BruteForce-Hamming","BruteForce-Hamming(2)"};
 static const char* featuresInputDefault = "features.yml";
-static const char* descriptorsInputDefault = "descriptors.yml";
+static const char* descriptorsInputDefault = "descriptors.bow";
+static const int topKDefault = 1;
 
 const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *detectorAlgorithm);
 const Ptr<DescriptorExtractor> getExtractor(const char *extractorAdapter, const char *extractorAlgorithm);
@@ -38,7 +47,15 @@ const Ptr<DescriptorMatcher> getMatcher(const char *matchAlgorithm);
 int main(int argc, char * const *argv)
 {
     const char *directoryName, *detectorAlgorithm, *detectorAdapter, *extractorAlgorithm, *extractorAdapter, *matchAlgorithm, *featuresInput, *descriptorsInput;
-    directoryName = detectorAlgorithm = detectorAdapter = extractorAlgorithm = extractorAdapter = featuresInput = descriptorsInput = NULL;
+    directoryName = detectorAlgorithm = detectorAdapter = extractorAlgorithm = extractorAdapter = matchAlgorithm = featuresInput = descriptorsInput = NULL;
+    const char *report = NULL;
+    const char *groundTruthInput = NULL;
+    int decoders = 0;
+    int prefetch = 0;
+    int topK = 0;
+    ImageScale imageScale;
+    imageScale.maxSide = 0;
+    imageScale.scale = 0;
     
     struct option longOptions[] = {
         {"directory", required_argument, 0, kLongOptionIndexDirectory},
@@ -49,6 +66,13 @@ int main(int argc, char * const *argv)
         {"matcher", required_argument, 0, kLongOptionIndexMatcher},
         {"features_input", required_argument, 0, kLongOptionIndexFeaturesInput},
         {"descriptors_input", required_argument, 0, kLongOptionIndexDescriptorsInput},
+        {"report", required_argument, 0, kLongOptionIndexReport},
+        {"ground_truth", required_argument, 0, kLongOptionIndexGroundTruth},
+        {"decoders", required_argument, 0, kLongOptionIndexDecoders},
+        {"prefetch", required_argument, 0, kLongOptionIndexPrefetch},
+        {"max_side", required_argument, 0, kLongOptionIndexMaxSide},
+        {"scale", required_argument, 0, kLongOptionIndexScale},
+        {"top_k", required_argument, 0, kLongOptionIndexTopK},
         {0, 0, 0, 0}
     };
     
@@ -87,6 +111,34 @@ int main(int argc, char * const *argv)
                 descriptorsInput = optarg;
                 break;
             }
+            case kLongOptionIndexReport: {
+                report = optarg;
+                break;
+            }
+            case kLongOptionIndexGroundTruth: {
+                groundTruthInput = optarg;
+                break;
+            }
+            case kLongOptionIndexDecoders: {
+                decoders = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexPrefetch: {
+                prefetch = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexMaxSide: {
+                imageScale.maxSide = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexScale: {
+                imageScale.scale = atof(optarg);
+                break;
+            }
+            case kLongOptionIndexTopK: {
+                topK = atoi(optarg);
+                break;
+            }
             default:
                 break;
         }
@@ -122,53 +174,164 @@ int main(int argc, char * const *argv)
         descriptorsInput = descriptorsInputDefault;
     }
     
-    FileStorage fsFeatures(featuresInput, FileStorage::READ);
-    if (!fsFeatures.isOpened()) {
+    if (decoders<=0) {
+        cout << "use " << PIPELINE_DECODERS_DEFAULT << " as number of decoder threads" << endl;
+        decoders = PIPELINE_DECODERS_DEFAULT;
+    }
+    
+    if (prefetch<=0) {
+        cout << "use " << PIPELINE_PREFETCH_DEFAULT << " as number of prefetched images" << endl;
+        prefetch = PIPELINE_PREFETCH_DEFAULT;
+    }
+    
+    if (topK<=0) {
+        cout << "use " << topKDefault << " as number of matches per query" << endl;
+        topK = topKDefault;
+    }
+    
+    if (imageScale.maxSide<0 || imageScale.scale<0) {
+        cout << "max_side and scale must not be negative" << endl;
+        return -1;
+    }
+    
+    if (isImageScaled(imageScale)) {
+        cout << "shrink images to " << imageScaleString(imageScale) << endl;
+    }
+    
+    GroundTruth groundTruth;
+    if (groundTruthInput && !loadGroundTruth(groundTruthInput, groundTruth)) {
+        cout << "could not open ground truth file " << groundTruthInput << endl;
+        return -1;
+    }
+    
+    //a binary BOW database carries the vocabulary or the vocabulary tree, YAML descriptors and version 1 trees need the features file
+    BowDatabase database;
+    bool binary = isBowDatabase(descriptorsInput);
+    if (binary && !database.open(descriptorsInput)) {
+        cout << "could not open BOW database " << descriptorsInput << ", unsupported version or truncated file" << endl;
+        return -1;
+    }
+    
+    FileStorage fsFeatures;
+    if ((!binary || (database.tree && !database.hasTree())) && !fsFeatures.open(featuresInput, FileStorage::READ)) {
         cout << "could not open features input file " << featuresInput << endl;
         return -1;
     }
     
-    FileStorage fsDescriptors(descriptorsInput, FileStorage::READ);
-    if (!fsDescriptors.isOpened()) {
+    FileStorage fsDescriptors;
+    if (!binary && !fsDescriptors.open(descriptorsInput, FileStorage::READ)) {
         cout << "could not open descriptors input file " << descriptorsInput << endl;
         return -1;
     }
     
+    if (binary && database.detectorType!=bowFeatureType(detectorAdapter, detectorAlgorithm)) {
+        cout << "descriptors input file " << descriptorsInput << " was generated with detector " << database.detectorType << ", not " << bowFeatureType(detectorAdapter, detectorAlgorithm) << endl;
+        return -1;
+    }
+    
+    if (binary && database.extractorType!=bowFeatureType(extractorAdapter, extractorAlgorithm)) {
+        cout << "descriptors input file " << descriptorsInput << " was generated with extractor " << database.extractorType << ", not " << bowFeatureType(extractorAdapter, extractorAlgorithm) << endl;
+        return -1;
+    }
+    
     DIR *dir;
     dir = opendir(directoryName);
     if (!dir) {
         cout << "could not open directory " << directoryName << endl;
         return -1;
     }
+    closedir(dir);
     
     Mat vocabulary;
+    VocabularyTree tree;
     cv::vector<Mat> bowDescriptors;
     vector<string> filenames;
+    Mat idf;
+    StageTimer timer;
+    int64 tick = getTickCount();
     
-    fsFeatures["vocabulary"] >> vocabulary;
-    fsFeatures.release();
+    //a vocabulary tree when bow_generate wrote one, otherwise the flat vocabulary
+    bool vocabularyTree = false;
+    if (binary && !database.tree) {
+        vocabulary = database.vocabulary;
+    }
+    else if (binary && database.hasTree()) {
+        vocabularyTree = database.readTree(tree);
+        if (!vocabularyTree) {
+            cout << "invalid vocabulary tree in descriptors input file " << descriptorsInput << endl;
+            return -1;
+        }
+    }
+    else {
+        vocabularyTree = tree.read(fsFeatures);
+        if (!vocabularyTree && !fsFeatures[VOCABULARY_TREE_KEY].empty()) {
+            cout << "invalid vocabulary tree in features input file " << featuresInput << endl;
+            return -1;
+        }
+        if (!vocabularyTree)
+            fsFeatures["vocabulary"] >> vocabulary;
+        fsFeatures.release();
+    }
+    if (vocabularyTree)
+        cout << "use vocabulary tree with " << tree.wordCount() << " words" << endl;
+    
+    if (binary) {
+        filenames = database.filenames;
+        idf = database.idf;
+    }
+    else {
+        fsDescriptors["descriptors"] >> bowDescriptors;
+        fsDescriptors["filenames"] >> filenames;
+        fsDescriptors[BOW_IDF_KEY] >> idf;
+        fsDescriptors.release();
+    }
+    timer.add("load", elapsedMiliseconds(tick));
     
-    fsDescriptors["descriptors"] >> bowDescriptors;
-    fsDescriptors["filenames"] >> filenames;
-    fsDescriptors.release();
+    if (binary && database.tree!=vocabularyTree) {
+        cout << "descriptors input file " << descriptorsInput << " was generated with a vocabulary tree, features input file " << featuresInput << " has none" << endl;
+        return -1;
+    }
     
-    struct dirent *ep;
-    char *filename;
-    char path[1000];
-    struct stat buf;
+    if (binary && (vocabularyTree ? tree.wordCount() : vocabulary.rows)!=database.words) {
+        cout << "descriptors input file " << descriptorsInput << " has " << database.words << " words, the vocabulary has " << (vocabularyTree ? tree.wordCount() : vocabulary.rows) << endl;
+        return -1;
+    }
     
     Ptr<FeatureDetector> detector = getDetector(detectorAdapter, detectorAlgorithm);
     Ptr<DescriptorMatcher> bowMatcher = getMatcher(matchAlgorithm);
     Ptr<DescriptorExtractor> extractor = getExtractor(extractorAdapter, extractorAlgorithm);
+    int vocabularyCols = vocabularyTree ? tree.descriptorSize() : vocabulary.cols;
+    if (binary && extractor->descriptorSize()!=vocabularyCols) {
+        cout << "extractor " << bowFeatureType(extractorAdapter, extractorAlgorithm) << " gives descriptors of size " << extractor->descriptorSize() << ", the vocabulary has words of size " << vocabularyCols << endl;
+        return -1;
+    }
     BOWImgDescriptorExtractor bowExtractor(extractor, bowMatcher);
-    bowExtractor.setVocabulary(vocabulary);
+    if (!vocabularyTree)
+        bowExtractor.setVocabulary(vocabulary);
     
-    Ptr<DescriptorMatcher> matcher = getMatcher(matchAlgorithm);
-    matcher->add(bowDescriptors);
-    matcher->train();
+    //descriptors files with an idf are searched through an inverted file, older ones by matching every histogram
+    InvertedIndex invertedIndex;
+    Ptr<DescriptorMatcher> matcher;
+    bool inverted = !idf.empty();
+    if (binary) {
+        invertedIndex.build(database.imageCount(), database.rowStart, database.wordIndex, database.values, idf);
+        cout << "inverted file with " << invertedIndex.postingCount() << " postings over " << invertedIndex.imageCount() << " images" << endl;
+    }
+    else if (inverted) {
+        invertedIndex.build(bowDescriptors, idf);
+        cout << "inverted file with " << invertedIndex.postingCount() << " postings over " << invertedIndex.imageCount() << " images" << endl;
+    }
+    else {
+        cout << "descriptors input file " << descriptorsInput << " has no idf, match all histograms" << endl;
+        matcher = getMatcher(matchAlgorithm);
+        matcher->add(bowDescriptors);
+        matcher->train();
+    }
+    timer.add("train", elapsedMiliseconds(tick));
     
     cv::vector<KeyPoint> keypoints;
-    Mat image;
+    PipelineImage item;
+    Mat descriptors;
     Mat bowDescriptor;
     cv::vector<DMatch> matches;
     
@@ -176,55 +339,73 @@ int main(int argc, char * const *argv)
     int totalFile = 0;
     int notFound = 0;
     
+    ImagePipeline pipeline(decoders, prefetch, &timer, true);
+    pipeline.setImageScale(imageScale);
+    pipeline.start(directoryName);
+    
     cout << "Matching..." << endl;
-    while ((ep = readdir(dir))) {
-    	filename = ep->d_name;
-        if((strchr(filename, '.')-filename)==0)
-        	continue;
-        
-        sprintf(path, "%s/%s", directoryName, filename);
-        
-        lstat(path, &buf);
-        if (S_ISREG(buf.st_mode)) {
-        	image = imread(path, CV_LOAD_IMAGE_GRAYSCALE);
-        	if (image.data) {
-                totalFile++;
+    while (pipeline.next(item)) {
+        if (item.image.data) {
+            totalFile++;
+            
+            cout << "File " << item.filename << "..." << endl;
+            tick = getTickCount();
+            detector->detect(item.image, keypoints);
+            timer.add("detect", elapsedMiliseconds(tick));
+            if (vocabularyTree) {
+                extractor->compute(item.image, keypoints, descriptors);
+                timer.add("compute", elapsedMiliseconds(tick));
+                tree.bowDescriptor(descriptors, bowDescriptor);
+            }
+            else {
+                bowExtractor.compute(item.image, keypoints, bowDescriptor);
+            }
+            timer.add("bow", elapsedMiliseconds(tick));
+            if (inverted) {
+                invertedIndex.query(bowDescriptor, topK, matches);
+            }
+            else {
+                cv::vector<cv::vector<DMatch> > knnMatches;
+                matcher->knnMatch(bowDescriptor, knnMatches, topK);
+                matches = knnMatches.empty() ? cv::vector<DMatch>() : knnMatches[0];
+            }
+            timer.add("match", elapsedMiliseconds(tick));
+            bool expected = false;
+            for(int i=0;i<matches.size();i++) {
+                DMatch match = matches[i];
+                cout << "\ti = " << i << "; queryIdx = " << match.queryIdx << "; trainIdx = " << match.trainIdx << "; imgIdx = " << match.imgIdx << "; distance = " << match.distance << endl;
+                int j = match.imgIdx;
+                if (j>=0 && j<filenames.size()) {
+                    cout << "\tOriginal file " << filenames[j] << endl;
+                }
                 
-                cout << "File " << filename << "..." << endl;
-        		detector->detect(image, keypoints);
-                bowExtractor.compute(image, keypoints, bowDescriptor);
-                matcher->match(bowDescriptor, matches);
-                for(int i=0;i<matches.size();i++) {
-                    DMatch match = matches[i];
-                    cout << "\ti = " << i << "; queryIdx = " << match.queryIdx << "; trainIdx = " << match.trainIdx << "; imgIdx = " << match.imgIdx << "; distance = " << match.distance << endl;
-                    int j = match.imgIdx;
-                    if (j>=0 && j<filenames.size()) {
-                        cout << "\tOriginal file " << filenames[j] << endl;
-                    }
-                    
-                    if (filenames[j]==filename) {
-                        trueMatch++;
-                    }
+                if (j>=0 && j<filenames.size() && isExpectedMatch(groundTruth, item.filename, filenames[j])) {
+                    expected = true;
                 }
-                cout << "done" << endl;
-                //break;
             }
+            if (expected) {
+                trueMatch++;
+            }
+            cout << "done" << endl;
         }
     }
-    closedir(dir);
+    pipeline.finish();
     
     cout.precision(2);
-    cout << "true match rate: " << 100.0 * trueMatch / totalFile << endl;
+    cout << "true match rate in top " << topK << ": " << 100.0 * trueMatch / totalFile << endl;
+    
+    timer.report(cout);
+    pipeline.report(cout);
+    if (report && !timer.writeJSON(report)) {
+        cout << "could not write report file " << report << endl;
+    }
     
     return 0;
 }
 
 const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *detectorAlgorithm)
 {
-    string detectorType = detectorAlgorithm;
-    if (detectorAdapter) {
-        detectorType = detectorAdapter + detectorType;
-    }
+    string detectorType = bowFeatureType(detectorAdapter, detectorAlgorithm);
     
     cout << "create feature detector with type: " << detectorType << endl;
     Ptr<FeatureDetector> result = FeatureDetector::create(detectorType);
@@ -234,10 +415,7 @@ const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *
 
 const Ptr<DescriptorExtractor> getExtractor(const char *extractorAdapter, const char *extractorAlgorithm)
 {
-    string extractorType = extractorAlgorithm;
-    if (extractorAdapter) {
-        extractorType = extractorAdapter + extractorType;
-    }
+    string extractorType = bowFeatureType(extractorAdapter, extractorAlgorithm);
     
     cout << "create descriptor extractor with type: " << extractorType << endl;
     Ptr<DescriptorExtractor> result = DescriptorExtractor::create(extractorType);
@@ -0,0 +1,425 @@
+//
+//  bow_database.h
+//  opencv-commandline
+//
+//  Binary BOW database written by bow_generate and mapped by bow_match, in place of the YAML
+//  descriptors file. Histograms are mostly zero, so they are stored in compressed sparse row
+//  form; the vocabulary is stored raw so bow_match can use it straight from the mapping.
+//
+//  Layout (native byte order, all offsets in bytes from the start of the file):
+//      header                  BowDatabaseHeader, BOW_DATABASE_HEADER_SIZE bytes
+//      vocabulary block        rows * vocabularyCols float, starts on a BOW_DATABASE_ALIGNMENT
+//                              boundary; the words of a flat vocabulary, or the treeNodes node
+//                              centers of a vocabulary tree
+//      child table             treeNodes int32, first child of every tree node, -1 for a leaf
+//      leaf table              treeNodes int32, word of every leaf, -1 for an inner node
+//      idf table               words float
+//      row table               (imageCount + 1) uint64, first non zero entry of each image
+//      word table              nonZeros int32, word of each non zero entry
+//      value table             nonZeros float, term frequency of each non zero entry
+//      filename offsets        (imageCount + 1) uint64, offsets into the string table
+//      filename string table   filenames concatenated, no terminators
+//
+//  The header records the detector and extractor types the histograms were computed with, so
+//  bow_match rejects a database built for a different configuration.
+//
+//  Version 1 has no tree tables, its vocabulary tree stays in the features file.
+//
+
+#ifndef OPENCV_COMMANDLINE_BOW_DATABASE_H
+#define OPENCV_COMMANDLINE_BOW_DATABASE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "opencv2/core/core.hpp"
+
+#include "vocabulary_tree.h"
+
+static const char BOW_DATABASE_MAGIC[8] = {'B','O','W','D','\r','\n','\032','\n'};
+static const uint32_t BOW_DATABASE_VERSION = 2;
+static const size_t BOW_DATABASE_HEADER_SIZE = 256;
+static const size_t BOW_DATABASE_ALIGNMENT = 64;
+static const size_t BOW_DATABASE_TYPE_SIZE = 48;
+static const uint32_t BOW_DATABASE_TREE = 1;  //words come from a vocabulary tree
+
+struct BowDatabaseHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t words;
+    uint64_t vocabularyCols;
+    uint64_t vocabularyOffset;
+    uint64_t idfOffset;
+    uint64_t imageCount;
+    uint64_t nonZeros;
+    uint64_t rowOffset;
+    uint64_t wordOffset;
+    uint64_t valueOffset;
+    uint64_t filenameOffset;
+    uint64_t stringOffset;
+    uint64_t fileSize;
+    char detectorType[BOW_DATABASE_TYPE_SIZE];
+    char extractorType[BOW_DATABASE_TYPE_SIZE];
+    uint64_t treeNodes;                 //version 2
+    uint32_t treeBranching;
+    uint32_t treeDepth;
+    uint64_t childOffset;
+    uint64_t leafOffset;
+};
+
+//count elements of elementSize starting at offset end at or before limit, without overflowing on corrupt counts
+inline bool bowRangeInFile(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t limit)
+{
+    return offset<=limit && (elementSize==0 || count<=(limit - offset) / elementSize);
+}
+
+//detector or extractor type as FeatureDetector::create and DescriptorExtractor::create see it
+inline std::string bowFeatureType(const char *adapter, const char *algorithm)
+{
+    std::string type = algorithm;
+    if (adapter) {
+        type = adapter + type;
+    }
+    return type;
+}
+
+inline bool isBowDatabase(const char *path)
+{
+    char magic[sizeof(BOW_DATABASE_MAGIC)];
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    bool result = fread(magic, 1, sizeof(magic), file)==sizeof(magic) && memcmp(magic, BOW_DATABASE_MAGIC, sizeof(magic))==0;
+    fclose(file);
+    return result;
+}
+
+inline bool writeBowPadding(FILE *file, uint64_t &offset, size_t alignment)
+{
+    static const char zeros[BOW_DATABASE_ALIGNMENT] = {0};
+    size_t padding = (alignment - offset % alignment) % alignment;
+    offset += padding;
+    return fwrite(zeros, 1, padding, file)==padding;
+}
+
+//whole database at once; vocabulary is words x cols CV_32F, or tree is not NULL for a vocabulary tree.
+//histograms are 1 x words CV_32F, or empty for images without descriptors. The file is written under a
+//temporary name and renamed, so readers that have the old file mapped are not disturbed
+inline bool writeBowDatabase(const char *path, const std::string &detectorType, const std::string &extractorType, const cv::Mat &vocabulary, const VocabularyTree *tree, int words, const cv::Mat &idf, const cv::vector<cv::Mat> &histograms, const cv::vector<std::string> &filenames)
+{
+    if (histograms.size()!=filenames.size() || idf.total()!=(size_t)words || idf.type()!=CV_32F || detectorType.size()>=BOW_DATABASE_TYPE_SIZE || extractorType.size()>=BOW_DATABASE_TYPE_SIZE) {
+        return false;
+    }
+    if (tree ? tree->wordCount()!=words : (vocabulary.rows!=words || vocabulary.type()!=CV_32F)) {
+        return false;
+    }
+    const cv::Mat &centers = tree ? tree->nodeCenters() : vocabulary;
+
+    BowDatabaseHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BOW_DATABASE_MAGIC, sizeof(header.magic));
+    header.version = BOW_DATABASE_VERSION;
+    header.flags = tree ? BOW_DATABASE_TREE : 0;
+    header.words = words;
+    header.vocabularyCols = centers.cols;
+    header.imageCount = histograms.size();
+    if (tree) {
+        header.treeNodes = tree->nodeCount();
+        header.treeBranching = tree->branchingFactor();
+        header.treeDepth = tree->levels();
+    }
+    memcpy(header.detectorType, detectorType.data(), detectorType.size());
+    memcpy(header.extractorType, extractorType.data(), extractorType.size());
+
+    std::string finalPath = path;
+    std::string temporaryPath = finalPath + ".tmp";
+    FILE *file = fopen(temporaryPath.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    char headerBlock[BOW_DATABASE_HEADER_SIZE] = {0};
+    bool ok = fwrite(headerBlock, 1, sizeof(headerBlock), file)==sizeof(headerBlock);
+    uint64_t offset = BOW_DATABASE_HEADER_SIZE;
+
+    ok = ok && writeBowPadding(file, offset, BOW_DATABASE_ALIGNMENT);
+    header.vocabularyOffset = offset;
+    for (int i=0; ok && i<centers.rows; i++) {
+        ok = fwrite(centers.ptr<float>(i), sizeof(float), centers.cols, file)==(size_t)centers.cols;
+    }
+    offset += (uint64_t)centers.rows * centers.cols * sizeof(float);
+
+    //node tables of the tree, empty for a flat vocabulary
+    header.childOffset = offset;
+    if (tree && header.treeNodes) {
+        ok = ok && fwrite(&tree->nodeFirstChild()[0], sizeof(int32_t), header.treeNodes, file)==header.treeNodes;
+    }
+    offset += header.treeNodes * sizeof(int32_t);
+    header.leafOffset = offset;
+    if (tree && header.treeNodes) {
+        ok = ok && fwrite(&tree->nodeWord()[0], sizeof(int32_t), header.treeNodes, file)==header.treeNodes;
+    }
+    offset += header.treeNodes * sizeof(int32_t);
+
+    ok = ok && writeBowPadding(file, offset, BOW_DATABASE_ALIGNMENT);
+    header.idfOffset = offset;
+    cv::Mat idfRow = idf.reshape(1, 1);
+    ok = ok && (!words || fwrite(idfRow.ptr<float>(0), sizeof(float), words, file)==(size_t)words);
+    offset += words * sizeof(float);
+
+    //row table first, then the words and values of every image
+    ok = ok && writeBowPadding(file, offset, sizeof(uint64_t));
+    header.rowOffset = offset;
+    uint64_t nonZeros = 0;
+    for (size_t i=0; ok && i<=histograms.size(); i++) {
+        ok = fwrite(&nonZeros, sizeof(nonZeros), 1, file)==1;
+        if (i<histograms.size() && !histograms[i].empty()) {
+            if (histograms[i].total()!=(size_t)words || histograms[i].type()!=CV_32F) {
+                ok = false;
+                break;
+            }
+            nonZeros += cv::countNonZero(histograms[i]);
+        }
+    }
+    offset += (histograms.size() + 1) * sizeof(uint64_t);
+    header.nonZeros = nonZeros;
+
+    header.wordOffset = offset;
+    for (size_t i=0; ok && i<histograms.size(); i++) {
+        const float *histogram = histograms[i].empty() ? NULL : histograms[i].ptr<float>(0);
+        for (int32_t w=0; ok && histogram && w<words; w++) {
+            if (histogram[w]!=0)
+                ok = fwrite(&w, sizeof(w), 1, file)==1;
+        }
+    }
+    offset += nonZeros * sizeof(int32_t);
+
+    header.valueOffset = offset;
+    for (size_t i=0; ok && i<histograms.size(); i++) {
+        const float *histogram = histograms[i].empty() ? NULL : histograms[i].ptr<float>(0);
+        for (int w=0; ok && histogram && w<words; w++) {
+            if (histogram[w]!=0)
+                ok = fwrite(&histogram[w], sizeof(float), 1, file)==1;
+        }
+    }
+    offset += nonZeros * sizeof(float);
+
+    ok = ok && writeBowPadding(file, offset, sizeof(uint64_t));
+    header.filenameOffset = offset;
+    uint64_t stringSize = 0;
+    for (size_t i=0; ok && i<=filenames.size(); i++) {
+        ok = fwrite(&stringSize, sizeof(stringSize), 1, file)==1;
+        if (i<filenames.size()) {
+            stringSize += filenames[i].size();
+        }
+    }
+    offset += (filenames.size() + 1) * sizeof(uint64_t);
+
+    header.stringOffset = offset;
+    for (size_t i=0; ok && i<filenames.size(); i++) {
+        ok = fwrite(filenames[i].data(), 1, filenames[i].size(), file)==filenames[i].size();
+    }
+    offset += stringSize;
+    header.fileSize = offset;
+
+    memcpy(headerBlock, &header, sizeof(header));
+    ok = ok && fseek(file, 0, SEEK_SET)==0 && fwrite(headerBlock, 1, sizeof(headerBlock), file)==sizeof(headerBlock);
+    ok = (fclose(file)==0) && ok;
+    ok = ok && rename(temporaryPath.c_str(), finalPath.c_str())==0;
+    if (!ok) {
+        unlink(temporaryPath.c_str());
+    }
+    return ok;
+}
+
+//read-only view of a binary BOW database; vocabulary, idf and the sparse tables point straight into the mapping
+class BowDatabase {
+public:
+    cv::Mat vocabulary;                 //words x cols CV_32F, the node centers for a vocabulary tree
+    cv::Mat idf;                        //1 x words CV_32F
+    const uint64_t *rowStart;           //imageCount + 1 entries
+    const int32_t *wordIndex;
+    const float *values;
+    cv::vector<std::string> filenames;
+    std::string detectorType;
+    std::string extractorType;
+    int words;
+    bool tree;
+
+    BowDatabase() : rowStart(NULL), wordIndex(NULL), values(NULL), words(0), tree(false), treeNodes(0), treeBranching(0), treeDepth(0), childTable(NULL), leafTable(NULL), mapping(NULL), mappingSize(0) {}
+    ~BowDatabase() { close(); }
+
+    //false for a file that is not a BOW database, has an unknown version or tables that are out of order, outside
+    //the file or point outside the tables they index
+    bool open(const char *path)
+    {
+        close();
+
+        int fd = ::open(path, O_RDONLY);
+        if (fd<0) {
+            return false;
+        }
+
+        struct stat buf;
+        if (fstat(fd, &buf)!=0 || (size_t)buf.st_size<BOW_DATABASE_HEADER_SIZE) {
+            ::close(fd);
+            return false;
+        }
+
+        mappingSize = buf.st_size;
+        mapping = mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping==MAP_FAILED) {
+            mapping = NULL;
+            return false;
+        }
+
+        const char *base = (const char *)mapping;
+        BowDatabaseHeader header;
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, BOW_DATABASE_MAGIC, sizeof(header.magic))!=0 || header.version<1 || header.version>BOW_DATABASE_VERSION || header.fileSize>mappingSize) {
+            close();
+            return false;
+        }
+
+        //every table has to start after the one before it and end inside the file; version 1 has no tree tables
+        //and no vocabulary block for a tree
+        bool isTree = (header.flags & BOW_DATABASE_TREE)!=0;
+        uint64_t nodes = header.version>=2 && isTree ? header.treeNodes : 0;
+        uint64_t vocabularyRows = isTree ? nodes : header.words;
+        uint64_t vocabularyEnd = header.version>=2 ? header.childOffset : header.idfOffset;
+        if (header.vocabularyOffset<BOW_DATABASE_HEADER_SIZE || header.words==0 || header.words>INT_MAX || header.vocabularyCols>INT_MAX || nodes>INT_MAX || header.imageCount>=INT_MAX
+            || (vocabularyRows && header.vocabularyCols==0)
+            || !bowRangeInFile(header.vocabularyOffset, vocabularyRows, header.vocabularyCols * sizeof(float), vocabularyEnd)
+            || (header.version>=2 && (!bowRangeInFile(header.childOffset, nodes, sizeof(int32_t), header.leafOffset) || !bowRangeInFile(header.leafOffset, nodes, sizeof(int32_t), header.idfOffset)))
+            || !bowRangeInFile(header.idfOffset, header.words, sizeof(float), header.rowOffset)
+            || !bowRangeInFile(header.rowOffset, header.imageCount + 1, sizeof(uint64_t), header.wordOffset)
+            || !bowRangeInFile(header.wordOffset, header.nonZeros, sizeof(int32_t), header.valueOffset)
+            || !bowRangeInFile(header.valueOffset, header.nonZeros, sizeof(float), header.filenameOffset)
+            || !bowRangeInFile(header.filenameOffset, header.imageCount + 1, sizeof(uint64_t), header.stringOffset)
+            || header.stringOffset>header.fileSize
+            || header.vocabularyOffset % sizeof(float) || header.childOffset % sizeof(int32_t) || header.leafOffset % sizeof(int32_t) || header.idfOffset % sizeof(float)
+            || header.rowOffset % sizeof(uint64_t) || header.wordOffset % sizeof(int32_t) || header.valueOffset % sizeof(float) || header.filenameOffset % sizeof(uint64_t)) {
+            close();
+            return false;
+        }
+
+        //rows and filenames have to be ascending from 0 and end inside their tables, and every word inside the vocabulary
+        const uint64_t *rowTable = (const uint64_t *)(base + header.rowOffset);
+        const int32_t *wordTable = (const int32_t *)(base + header.wordOffset);
+        const uint64_t *filenameTable = (const uint64_t *)(base + header.filenameOffset);
+        bool valid = rowTable[0]==0 && rowTable[header.imageCount]==header.nonZeros && filenameTable[0]==0 && filenameTable[header.imageCount]<=header.fileSize - header.stringOffset;
+        for (uint64_t i=0; valid && i<header.imageCount; i++) {
+            valid = rowTable[i]<=rowTable[i+1] && filenameTable[i]<=filenameTable[i+1];
+        }
+        for (uint64_t k=0; valid && k<header.nonZeros; k++) {
+            valid = wordTable[k]>=0 && (uint64_t)wordTable[k]<header.words;
+        }
+        if (!valid) {
+            close();
+            return false;
+        }
+
+        words = (int)header.words;
+        tree = isTree;
+        header.detectorType[BOW_DATABASE_TYPE_SIZE - 1] = 0;
+        header.extractorType[BOW_DATABASE_TYPE_SIZE - 1] = 0;
+        detectorType = header.detectorType;
+        extractorType = header.extractorType;
+
+        if (vocabularyRows) {
+            vocabulary = cv::Mat((int)vocabularyRows, (int)header.vocabularyCols, CV_32F, (void *)(base + header.vocabularyOffset));
+        }
+        treeNodes = (int)nodes;
+        treeBranching = header.treeBranching;
+        treeDepth = header.treeDepth;
+        childTable = (const int32_t *)(base + header.childOffset);
+        leafTable = (const int32_t *)(base + header.leafOffset);
+        idf = cv::Mat(1, words, CV_32F, (void *)(base + header.idfOffset));
+        rowStart = rowTable;
+        wordIndex = wordTable;
+        values = (const float *)(base + header.valueOffset);
+
+        const char *strings = base + header.stringOffset;
+        filenames.resize(header.imageCount);
+        for (uint64_t i=0; i<header.imageCount; i++) {
+            filenames[i].assign(strings + filenameTable[i], filenameTable[i+1] - filenameTable[i]);
+        }
+
+        madvise(mapping, mappingSize, MADV_WILLNEED);
+
+        return true;
+    }
+
+    //true when the vocabulary tree is stored here, version 1 databases leave it in the features file
+    bool hasTree() const { return tree && treeNodes>0; }
+
+    //the stored vocabulary tree, its centers stay in the mapping; false when its node tables do not agree
+    bool readTree(VocabularyTree &vocabularyTree) const
+    {
+        if (!hasTree()) {
+            return false;
+        }
+        cv::vector<int> firstChild(childTable, childTable + treeNodes);
+        cv::vector<int> word(leafTable, leafTable + treeNodes);
+        return vocabularyTree.set(treeBranching, treeDepth, words, vocabulary, firstChild, word);
+    }
+
+    int imageCount() const { return (int)filenames.size(); }
+
+    //dense 1 x words CV_32F histogram of an image, empty when it has no descriptors
+    void histogram(int i, cv::Mat &result) const
+    {
+        result.release();
+        if (rowStart[i]==rowStart[i+1]) {
+            return;
+        }
+        result = cv::Mat::zeros(1, words, CV_32F);
+        for (uint64_t k=rowStart[i]; k<rowStart[i+1]; k++) {
+            result.at<float>(wordIndex[k]) = values[k];
+        }
+    }
+
+    void close()
+    {
+        vocabulary.release();
+        idf.release();
+        rowStart = NULL;
+        wordIndex = NULL;
+        values = NULL;
+        filenames.clear();
+        words = 0;
+        tree = false;
+        treeNodes = 0;
+        childTable = NULL;
+        leafTable = NULL;
+        if (mapping) {
+            munmap(mapping, mappingSize);
+            mapping = NULL;
+            mappingSize = 0;
+        }
+    }
+
+private:
+    int treeNodes;
+    int treeBranching;
+    int treeDepth;
+    const int32_t *childTable;
+    const int32_t *leafTable;
+    void *mapping;
+    size_t mappingSize;
+
+    BowDatabase(const BowDatabase &);
+    BowDatabase &operator=(const BowDatabase &);
+};
+
+#endif
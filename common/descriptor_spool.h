@@ -0,0 +1,95 @@
+//
+//  descriptor_spool.h
+//  opencv-commandline
+//
+//  Per-image descriptors kept from the vocabulary pass of bow_generate, so the BOW pass
+//  reads them back instead of decoding, detecting and extracting every image again. Images
+//  stay in memory until a byte budget is used up; the descriptors of all later images go to an
+//  anonymous temporary file, which is removed when the spool is destroyed or the process exits.
+//
+
+#ifndef OPENCV_COMMANDLINE_DESCRIPTOR_SPOOL_H
+#define OPENCV_COMMANDLINE_DESCRIPTOR_SPOOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "opencv2/core/core.hpp"
+
+static const int DESCRIPTOR_SPOOL_BUDGET_DEFAULT = 1024;  //megabytes
+
+class DescriptorSpool {
+public:
+    DescriptorSpool(size_t budgetBytes) : budget(budgetBytes), memoryBytes(0), spilledBytes(0), file(NULL) {}
+    ~DescriptorSpool()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    //false when the temporary file could not be created or written
+    bool add(const cv::Mat &descriptors)
+    {
+        Entry entry;
+        entry.rows = descriptors.rows;
+        entry.cols = descriptors.cols;
+        entry.type = descriptors.type();
+        entry.offset = -1;
+        size_t bytes = descriptors.total() * descriptors.elemSize();
+        if (!file && memoryBytes + bytes<=budget) {
+            entry.descriptors = descriptors.clone();
+            memoryBytes += bytes;
+            entries.push_back(entry);
+            return true;
+        }
+
+        if (!file && !(file = tmpfile()))
+            return false;
+        cv::Mat rows = descriptors.isContinuous() ? descriptors : descriptors.clone();
+        entry.offset = (int64_t)spilledBytes;
+        if (bytes && (fseeko(file, (off_t)spilledBytes, SEEK_SET)!=0 || fwrite(rows.data, 1, bytes, file)!=bytes))
+            return false;
+        spilledBytes += bytes;
+        entries.push_back(entry);
+        return true;
+    }
+
+    //descriptors of the i-th added image; false when the temporary file could not be read
+    bool get(int i, cv::Mat &descriptors)
+    {
+        const Entry &entry = entries[i];
+        if (entry.offset<0) {
+            descriptors = entry.descriptors;
+            return true;
+        }
+        descriptors.release();  //may share its data with an image held in memory
+        descriptors.create(entry.rows, entry.cols, entry.type);
+        size_t bytes = descriptors.total() * descriptors.elemSize();
+        return !bytes || (fseeko(file, (off_t)entry.offset, SEEK_SET)==0 && fread(descriptors.data, 1, bytes, file)==bytes);
+    }
+
+    int size() const { return (int)entries.size(); }
+    size_t bytesInMemory() const { return memoryBytes; }
+    size_t bytesSpilled() const { return spilledBytes; }
+
+private:
+    struct Entry {
+        int rows;
+        int cols;
+        int type;
+        int64_t offset;          //in the temporary file, -1 for images held in memory
+        cv::Mat descriptors;
+    };
+
+    size_t budget;
+    size_t memoryBytes;
+    size_t spilledBytes;
+    FILE *file;
+    cv::vector<Entry> entries;
+
+    DescriptorSpool(const DescriptorSpool &);
+    DescriptorSpool &operator=(const DescriptorSpool &);
+};
+
+#endif
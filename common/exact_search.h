@@ -0,0 +1,237 @@
+//
+//  exact_search.h
+//  opencv-commandline
+//
+//  Exact k nearest neighbor search over the rows of a feature database, for databases small
+//  enough that a linear scan beats building and searching a FLANN index. Float descriptors
+//  are compared under squared L2 and binary descriptors under Hamming, like the KD-tree and
+//  LSH indexes. The database is read in tiles of about EXACT_SEARCH_TILE_BYTES which every
+//  query visits before the next tile is loaded. Distance kernels use AVX-512 or AVX2 and
+//  FMA for L2, and VPOPCNTQ or POPCNT for Hamming, picked once from what the CPU supports;
+//  other platforms use the portable loops.
+//
+
+#ifndef OPENCV_COMMANDLINE_EXACT_SEARCH_H
+#define OPENCV_COMMANDLINE_EXACT_SEARCH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <algorithm>
+
+#include "opencv2/core/core.hpp"
+
+#include "feature_quantization.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define EXACT_SEARCH_X86 1
+#include <immintrin.h>
+#endif
+
+static const size_t EXACT_SEARCH_TILE_BYTES = 256 << 10;
+
+typedef float (*L2DistanceKernel)(const float *a, const float *b, int n);
+typedef int (*HammingDistanceKernel)(const uchar *a, const uchar *b, int n);
+
+inline int hammingDistance(const uchar *a, const uchar *b, int n)
+{
+    int sum = 0;
+    int i = 0;
+    for (; i + 8<=n; i+=8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        sum += __builtin_popcountll(x ^ y);
+    }
+    for (; i<n; i++)
+        sum += __builtin_popcount(a[i] ^ b[i]);
+    return sum;
+}
+
+#ifdef EXACT_SEARCH_X86
+
+__attribute__((target("avx2,fma")))
+inline float l2DistanceAVX2(const float *a, const float *b, int n)
+{
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16<=n; i+=16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+        sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+    }
+    for (; i + 8<=n; i+=8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        sum0 = _mm256_fmadd_ps(d, d, sum0);
+    }
+    sum0 = _mm256_add_ps(sum0, sum1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum0), _mm256_extractf128_ps(sum0, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    float sum = _mm_cvtss_f32(half);
+    for (; i<n; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+inline float l2DistanceAVX512(const float *a, const float *b, int n)
+{
+    __m512 sum = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16<=n; i+=16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        sum = _mm512_fmadd_ps(d, d, sum);
+    }
+    if (i<n) {
+        __mmask16 mask = (__mmask16)((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        sum = _mm512_fmadd_ps(d, d, sum);
+    }
+    float lanes[16];
+    _mm512_storeu_ps(lanes, sum);
+    float result = 0;
+    for (int j=0; j<16; j++)
+        result += lanes[j];
+    return result;
+}
+
+//the portable loop compiled with the popcnt instruction
+__attribute__((target("popcnt")))
+inline int hammingDistancePOPCNT(const uchar *a, const uchar *b, int n)
+{
+    int sum = 0;
+    int i = 0;
+    for (; i + 8<=n; i+=8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        sum += __builtin_popcountll(x ^ y);
+    }
+    for (; i<n; i++)
+        sum += __builtin_popcount(a[i] ^ b[i]);
+    return sum;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+inline int hammingDistanceVPOPCNTQ(const uchar *a, const uchar *b, int n)
+{
+    __m512i sum = _mm512_setzero_si512();
+    int i = 0;
+    for (; i + 64<=n; i+=64) {
+        __m512i x = _mm512_xor_si512(_mm512_loadu_si512((const void *)(a + i)), _mm512_loadu_si512((const void *)(b + i)));
+        sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+    }
+    uint64_t lanes[8];
+    _mm512_storeu_si512((void *)lanes, sum);
+    int result = 0;
+    for (int j=0; j<8; j++)
+        result += (int)lanes[j];
+    for (; i + 8<=n; i+=8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        result += __builtin_popcountll(x ^ y);
+    }
+    for (; i<n; i++)
+        result += __builtin_popcount(a[i] ^ b[i]);
+    return result;
+}
+
+#endif
+
+//instruction set of the kernels exactKnnSearch uses on this CPU, for log messages
+inline const char *exactSearchKernelName(bool binary)
+{
+#ifdef EXACT_SEARCH_X86
+    __builtin_cpu_init();
+    if (binary) {
+        if (__builtin_cpu_supports("avx512vpopcntdq"))
+            return "AVX-512 VPOPCNTQ";
+        if (__builtin_cpu_supports("popcnt"))
+            return "POPCNT";
+    }
+    else {
+        if (__builtin_cpu_supports("avx512f"))
+            return "AVX-512";
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return "AVX2";
+    }
+#endif
+    return "portable";
+}
+
+inline L2DistanceKernel selectL2DistanceKernel()
+{
+#ifdef EXACT_SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return l2DistanceAVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return l2DistanceAVX2;
+#endif
+    return floatSquaredDistance;
+}
+
+inline HammingDistanceKernel selectHammingDistanceKernel()
+{
+#ifdef EXACT_SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq"))
+        return hammingDistanceVPOPCNTQ;
+    if (__builtin_cpu_supports("popcnt"))
+        return hammingDistancePOPCNT;
+#endif
+    return hammingDistance;
+}
+
+//exact k nearest neighbors with the outputs of flann::Index::knnSearch: CV_32S indices, -1 when there are fewer
+//rows than knn, and squared CV_32F distances for float features or CV_32S Hamming distances for CV_8U features.
+//features and queries have the same type, CV_32F or CV_8U
+inline void exactKnnSearch(const cv::Mat &features, const cv::Mat &queries, cv::Mat &indices, cv::Mat &dists, int knn)
+{
+    static const L2DistanceKernel l2Distance = selectL2DistanceKernel();
+    static const HammingDistanceKernel hamming = selectHammingDistanceKernel();
+
+    bool binary = features.depth()==CV_8U;
+    indices.create(queries.rows, knn, CV_32S);
+    indices.setTo(cv::Scalar(-1));
+    if (binary) {
+        dists.create(queries.rows, knn, CV_32S);
+        dists.setTo(cv::Scalar(INT_MAX));
+    }
+    else {
+        dists.create(queries.rows, knn, CV_32F);
+        dists.setTo(cv::Scalar(FLT_MAX));
+    }
+
+    int cols = features.cols;
+    size_t rowSize = std::max((size_t)1, cols * features.elemSize());
+    int tileRows = (int)std::max((size_t)1, EXACT_SEARCH_TILE_BYTES / rowSize);
+
+    for (int first=0; first<features.rows; first+=tileRows) {
+        int last = std::min(features.rows, first + tileRows);
+        for (int q=0; q<queries.rows; q++) {
+            int *rowIndices = indices.ptr<int>(q);
+            if (binary) {
+                const uchar *query = queries.ptr<uchar>(q);
+                int *rowDists = dists.ptr<int>(q);
+                for (int k=first; k<last; k++)
+                    insertNeighbor(rowIndices, rowDists, knn, k, hamming(query, features.ptr<uchar>(k), cols));
+            }
+            else {
+                const float *query = queries.ptr<float>(q);
+                float *rowDists = dists.ptr<float>(q);
+                for (int k=first; k<last; k++)
+                    insertNeighbor(rowIndices, rowDists, knn, k, l2Distance(query, features.ptr<float>(k), cols));
+            }
+        }
+    }
+}
+
+#endif
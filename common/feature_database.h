@@ -0,0 +1,432 @@
+//
+//  feature_database.h
+//  opencv-commandline
+//
+//  Binary feature database shared by fd_generate and fd_match.
+//
+//  Layout (native byte order, all offsets in bytes from the start of the file):
+//      header                  FeatureDatabaseHeader, FEATURE_DATABASE_HEADER_SIZE bytes
+//      descriptor block        rows * rowSize bytes, starts on a FEATURE_DATABASE_ALIGNMENT boundary
+//      index table             imageCount int32, first descriptor row of each image
+//      filename offsets        (imageCount + 1) uint64, offsets into the string table
+//      filename string table   filenames concatenated, no terminators
+//      flag table              imageCount uint8, FEATURE_IMAGE_DELETED marks a tombstone (version 2)
+//
+//  Version 3 stores float descriptors quantized to fp16 or int8, the method and its parameters
+//  are in the header (see feature_quantization.h). Databases that are not quantized are still
+//  written as version 2.
+//
+//  Tombstoned images keep their descriptor rows so rows and indexes stay valid until the
+//  database is compacted; readers must not report them as matches.
+//
+
+#ifndef OPENCV_COMMANDLINE_FEATURE_DATABASE_H
+#define OPENCV_COMMANDLINE_FEATURE_DATABASE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+
+#include "opencv2/core/core.hpp"
+
+#include "feature_quantization.h"
+
+static const char FEATURE_DATABASE_MAGIC[8] = {'F','D','D','B','\r','\n','\032','\n'};
+static const uint32_t FEATURE_DATABASE_VERSION = 3;
+static const uint32_t FEATURE_DATABASE_VERSION_PLAIN = 2;
+static const size_t FEATURE_DATABASE_HEADER_SIZE = 128;
+static const size_t FEATURE_DATABASE_ALIGNMENT = 64;
+static const uint64_t FEATURE_CHECKSUM_SEED = 14695981039346656037ULL;
+static const unsigned char FEATURE_IMAGE_DELETED = 1;
+
+struct FeatureDatabaseHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t type;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t rowSize;
+    uint64_t descriptorOffset;
+    uint64_t imageCount;
+    uint64_t indexOffset;
+    uint64_t filenameOffset;
+    uint64_t stringOffset;
+    uint64_t fileSize;
+    uint64_t checksum;
+    uint64_t flagOffset;
+    uint32_t quantization;
+    float quantizationScale;
+    float quantizationZero;
+};
+
+//FNV-1a, chainable by passing the previous result as seed
+inline uint64_t featureChecksum(const void *data, size_t size, uint64_t seed = FEATURE_CHECKSUM_SEED)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t hash = seed;
+    for (size_t i=0; i<size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline uint64_t featureChecksum(const cv::Mat &features)
+{
+    uint64_t hash = FEATURE_CHECKSUM_SEED;
+    size_t rowSize = features.cols * features.elemSize();
+    for (int i=0; i<features.rows; i++) {
+        hash = featureChecksum(features.ptr(i), rowSize, hash);
+    }
+    return hash;
+}
+
+inline bool isFeatureDatabase(const char *path)
+{
+    char magic[sizeof(FEATURE_DATABASE_MAGIC)];
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    bool result = fread(magic, 1, sizeof(magic), file)==sizeof(magic) && memcmp(magic, FEATURE_DATABASE_MAGIC, sizeof(magic))==0;
+    fclose(file);
+    return result;
+}
+
+//true when count elements of elementSize bytes at offset fit in a file of fileSize bytes, without overflowing
+inline bool featureRangeInFile(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t fileSize)
+{
+    return offset<=fileSize && (elementSize==0 || count<=(fileSize - offset) / elementSize);
+}
+
+inline bool writeFeaturePadding(FILE *file, uint64_t &offset, size_t alignment)
+{
+    static const char zeros[FEATURE_DATABASE_ALIGNMENT] = {0};
+    size_t padding = (alignment - offset % alignment) % alignment;
+    offset += padding;
+    return fwrite(zeros, 1, padding, file)==padding;
+}
+
+//writes a database one image at a time, only the index, filename and flag tables are kept in memory;
+//the file is written under a temporary name and renamed by close, so readers that have the old file
+//mapped are not disturbed
+class FeatureDatabaseWriter {
+public:
+    FeatureDatabaseWriter() : file(NULL), ok(false), offset(0) {}
+    ~FeatureDatabaseWriter() { abort(); }
+
+    bool open(const char *path)
+    {
+        abort();
+        finalPath = path;
+        temporaryPath = finalPath + ".tmp";
+        file = fopen(temporaryPath.c_str(), "wb");
+        if (!file) {
+            return false;
+        }
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, FEATURE_DATABASE_MAGIC, sizeof(header.magic));
+        header.version = FEATURE_DATABASE_VERSION_PLAIN;
+        header.checksum = FEATURE_CHECKSUM_SEED;
+
+        char headerBlock[FEATURE_DATABASE_HEADER_SIZE] = {0};
+        ok = fwrite(headerBlock, 1, sizeof(headerBlock), file)==sizeof(headerBlock);
+        offset = FEATURE_DATABASE_HEADER_SIZE;
+        ok = ok && writeFeaturePadding(file, offset, FEATURE_DATABASE_ALIGNMENT);
+        header.descriptorOffset = offset;
+        return ok;
+    }
+
+    //descriptors of one image, every image must have the same type and width; an image without descriptors
+    //does not fix the type, like Mat::push_back
+    bool add(const std::string &filename, const cv::Mat &descriptors, unsigned char flag = 0)
+    {
+        if (!file || !ok) {
+            return false;
+        }
+        if (!descriptors.empty()) {
+            if (header.rows==0) {
+                header.type = descriptors.type();
+                header.cols = descriptors.cols;
+                header.rowSize = descriptors.cols * descriptors.elemSize();
+            }
+            else if (descriptors.type()!=header.type || (uint64_t)descriptors.cols!=header.cols) {
+                ok = false;
+                return false;
+            }
+        }
+
+        indexes.push_back((int32_t)header.rows);
+        filenames.push_back(filename);
+        flags.push_back(flag);
+        for (int i=0; ok && i<descriptors.rows; i++) {
+            ok = fwrite(descriptors.ptr(i), 1, header.rowSize, file)==header.rowSize;
+            header.checksum = featureChecksum(descriptors.ptr(i), header.rowSize, header.checksum);
+        }
+        header.rows += descriptors.rows;
+        offset += descriptors.rows * header.rowSize;
+        return ok;
+    }
+
+    //rows passed to add are already quantized this way
+    void setQuantization(const FeatureQuantization &quantization)
+    {
+        header.version = quantization.method==FEATURE_QUANTIZATION_NONE ? FEATURE_DATABASE_VERSION_PLAIN : FEATURE_DATABASE_VERSION;
+        header.quantization = quantization.method;
+        header.quantizationScale = quantization.scale;
+        header.quantizationZero = quantization.zero;
+    }
+
+    size_t imageCount() const { return indexes.size(); }
+    uint64_t rowCount() const { return header.rows; }
+    uint64_t checksum() const { return header.checksum; }
+
+    //writes the tables and the header and moves the file into place
+    bool close()
+    {
+        if (!file) {
+            return false;
+        }
+
+        header.imageCount = indexes.size();
+        ok = ok && writeFeaturePadding(file, offset, sizeof(uint64_t));
+        header.indexOffset = offset;
+        ok = ok && (indexes.empty() || fwrite(&indexes[0], sizeof(int32_t), indexes.size(), file)==indexes.size());
+        offset += indexes.size() * sizeof(int32_t);
+
+        ok = ok && writeFeaturePadding(file, offset, sizeof(uint64_t));
+        header.filenameOffset = offset;
+        uint64_t stringSize = 0;
+        for (size_t i=0; ok && i<=filenames.size(); i++) {
+            ok = fwrite(&stringSize, sizeof(stringSize), 1, file)==1;
+            if (i<filenames.size()) {
+                stringSize += filenames[i].size();
+            }
+        }
+        offset += (filenames.size() + 1) * sizeof(uint64_t);
+
+        header.stringOffset = offset;
+        for (size_t i=0; ok && i<filenames.size(); i++) {
+            ok = fwrite(filenames[i].data(), 1, filenames[i].size(), file)==filenames[i].size();
+        }
+        offset += stringSize;
+
+        header.flagOffset = offset;
+        ok = ok && (flags.empty() || fwrite(&flags[0], 1, flags.size(), file)==flags.size());
+        offset += flags.size();
+        header.fileSize = offset;
+
+        char headerBlock[FEATURE_DATABASE_HEADER_SIZE] = {0};
+        memcpy(headerBlock, &header, sizeof(header));
+        ok = ok && fseek(file, 0, SEEK_SET)==0 && fwrite(headerBlock, 1, sizeof(headerBlock), file)==sizeof(headerBlock);
+        ok = (fclose(file)==0) && ok;
+        file = NULL;
+        ok = ok && rename(temporaryPath.c_str(), finalPath.c_str())==0;
+        if (!ok) {
+            unlink(temporaryPath.c_str());
+        }
+        return ok;
+    }
+
+    //drops the temporary file, the previous database stays in place
+    void abort()
+    {
+        if (file) {
+            fclose(file);
+            file = NULL;
+            unlink(temporaryPath.c_str());
+        }
+        indexes.clear();
+        filenames.clear();
+        flags.clear();
+        ok = false;
+    }
+
+private:
+    FILE *file;
+    bool ok;
+    uint64_t offset;
+    FeatureDatabaseHeader header;
+    std::string finalPath;
+    std::string temporaryPath;
+    cv::vector<int32_t> indexes;
+    cv::vector<std::string> filenames;
+    cv::vector<unsigned char> flags;
+
+    FeatureDatabaseWriter(const FeatureDatabaseWriter &);
+    FeatureDatabaseWriter &operator=(const FeatureDatabaseWriter &);
+};
+
+//whole database at once; flags may be NULL when no image is deleted
+inline bool writeFeatureDatabase(const char *path, const cv::Mat &features, const cv::vector<int> &indexes, const cv::vector<std::string> &filenames, const cv::vector<unsigned char> *flags = NULL)
+{
+    if (indexes.size()!=filenames.size() || (flags && flags->size()!=indexes.size())) {
+        return false;
+    }
+
+    FeatureDatabaseWriter writer;
+    bool ok = writer.open(path);
+    for (size_t i=0; ok && i<indexes.size(); i++) {
+        int end = i+1<indexes.size() ? indexes[i+1] : features.rows;
+        ok = writer.add(filenames[i], features.rowRange(indexes[i], end), flags ? (*flags)[i] : 0);
+    }
+    return ok && writer.close();
+}
+
+//read-only view of a binary feature database; features points straight into the mapping
+class FeatureDatabase {
+public:
+    cv::Mat features;
+    cv::vector<int> indexes;
+    cv::vector<std::string> filenames;
+    cv::vector<unsigned char> flags;
+    uint64_t checksum;
+    size_t deletedCount;
+    FeatureQuantization quantization;  //features holds the stored rows, CV_16U or CV_8S when quantized
+
+    FeatureDatabase() : checksum(0), deletedCount(0), mapping(NULL), mappingSize(0)
+    {
+        quantization.method = FEATURE_QUANTIZATION_NONE;
+        quantization.scale = 1;
+        quantization.zero = 0;
+    }
+    ~FeatureDatabase() { close(); }
+
+    //the tables are copied out of the mapping; the descriptor block is only read ahead when readDescriptors
+    //is set, a search that never touches the raw rows (IVF-PQ) leaves it to be paged in on demand
+    bool open(const char *path, bool readDescriptors = true)
+    {
+        close();
+
+        int fd = ::open(path, O_RDONLY);
+        if (fd<0) {
+            return false;
+        }
+
+        struct stat buf;
+        if (fstat(fd, &buf)!=0 || (size_t)buf.st_size<FEATURE_DATABASE_HEADER_SIZE) {
+            ::close(fd);
+            return false;
+        }
+
+        mappingSize = buf.st_size;
+        mapping = mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping==MAP_FAILED) {
+            mapping = NULL;
+            return false;
+        }
+
+        const char *base = (const char *)mapping;
+        FeatureDatabaseHeader header;
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, FEATURE_DATABASE_MAGIC, sizeof(header.magic))!=0 || header.version<1 || header.version>FEATURE_DATABASE_VERSION || header.fileSize>mappingSize) {
+            close();
+            return false;
+        }
+
+        //every table has to start after the one before it and end inside the file, so a truncated or
+        //corrupt database is rejected here instead of reading past the mapping
+        uint64_t size = header.fileSize;
+        uint64_t stringEnd = header.version>=2 ? header.flagOffset : size;
+        if (header.descriptorOffset<FEATURE_DATABASE_HEADER_SIZE || header.rows>INT_MAX || header.cols>INT_MAX || header.imageCount>=INT_MAX
+            || (header.rows && header.rowSize<header.cols * CV_ELEM_SIZE(header.type))
+            || !featureRangeInFile(header.descriptorOffset, header.rows, header.rowSize, header.indexOffset)
+            || !featureRangeInFile(header.indexOffset, header.imageCount, sizeof(int32_t), header.filenameOffset)
+            || !featureRangeInFile(header.filenameOffset, header.imageCount + 1, sizeof(uint64_t), header.stringOffset)
+            || header.stringOffset>stringEnd
+            || (header.version>=2 && !featureRangeInFile(header.flagOffset, header.imageCount, 1, size))
+            || header.indexOffset % sizeof(int32_t) || header.filenameOffset % sizeof(uint64_t)) {
+            close();
+            return false;
+        }
+
+        const int32_t *indexTable = (const int32_t *)(base + header.indexOffset);
+        const uint64_t *filenameTable = (const uint64_t *)(base + header.filenameOffset);
+        for (uint64_t i=0; i<header.imageCount; i++) {
+            if (indexTable[i]<0 || (uint64_t)indexTable[i]>header.rows || (i && indexTable[i]<indexTable[i-1]) || filenameTable[i]>filenameTable[i+1]) {
+                close();
+                return false;
+            }
+        }
+        if (filenameTable[0]!=0 || filenameTable[header.imageCount]>stringEnd - header.stringOffset) {
+            close();
+            return false;
+        }
+
+        checksum = header.checksum;
+        features = cv::Mat((int)header.rows, (int)header.cols, header.type, (void *)(base + header.descriptorOffset), header.rowSize);
+
+        indexes.assign(indexTable, indexTable + header.imageCount);
+
+        const char *strings = base + header.stringOffset;
+        filenames.resize(header.imageCount);
+        for (uint64_t i=0; i<header.imageCount; i++) {
+            filenames[i].assign(strings + filenameTable[i], filenameTable[i+1] - filenameTable[i]);
+        }
+
+        //version 1 has no flag table, nothing is deleted
+        flags.assign(header.imageCount, 0);
+        deletedCount = 0;
+        if (header.version>=2) {
+            const unsigned char *flagTable = (const unsigned char *)(base + header.flagOffset);
+            flags.assign(flagTable, flagTable + header.imageCount);
+            for (uint64_t i=0; i<header.imageCount; i++) {
+                if (flags[i] & FEATURE_IMAGE_DELETED) {
+                    deletedCount++;
+                }
+            }
+        }
+
+        quantization.method = FEATURE_QUANTIZATION_NONE;
+        quantization.scale = 1;
+        quantization.zero = 0;
+        if (header.version>=3) {
+            if (header.quantization>FEATURE_QUANTIZATION_INT8) {
+                close();
+                return false;
+            }
+            quantization.method = header.quantization;
+            quantization.scale = header.quantizationScale;
+            quantization.zero = header.quantizationZero;
+        }
+
+        if (readDescriptors && header.rows) {
+            uint64_t page = sysconf(_SC_PAGESIZE);
+            uint64_t start = header.descriptorOffset / page * page;
+            madvise((char *)mapping + start, header.descriptorOffset + header.rows * header.rowSize - start, MADV_WILLNEED);
+        }
+
+        return true;
+    }
+
+    void close()
+    {
+        features.release();
+        indexes.clear();
+        filenames.clear();
+        flags.clear();
+        deletedCount = 0;
+        if (mapping) {
+            munmap(mapping, mappingSize);
+            mapping = NULL;
+            mappingSize = 0;
+        }
+    }
+
+private:
+    void *mapping;
+    size_t mappingSize;
+
+    FeatureDatabase(const FeatureDatabase &);
+    FeatureDatabase &operator=(const FeatureDatabase &);
+};
+
+#endif
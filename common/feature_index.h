@@ -0,0 +1,145 @@
+//
+//  feature_index.h
+//  opencv-commandline
+//
+//  Building, saving and loading the FLANN index over a feature database.
+//  Float descriptors (SURF, SIFT) get a KD-tree under L2, binary descriptors
+//  (ORB, BRISK, FREAK, BRIEF) stay CV_8U and get an LSH index under Hamming.
+//  A saved index is accompanied by a small YAML file recording the checksum of
+//  the features it was built from, so an index is never reused for other data.
+//
+
+#ifndef OPENCV_COMMANDLINE_FEATURE_INDEX_H
+#define OPENCV_COMMANDLINE_FEATURE_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string>
+#include <iostream>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/flann/flann.hpp"
+
+#include "feature_database.h"
+
+static const char* FEATURE_INDEX_SUFFIX = ".flann";
+static const char* FEATURE_INDEX_META_SUFFIX = ".yml";
+static const int FEATURE_INDEX_TREES = 5;
+static const int FEATURE_INDEX_LSH_TABLES = 12;
+static const int FEATURE_INDEX_LSH_KEY_SIZE = 20;
+static const int FEATURE_INDEX_LSH_MULTI_PROBE = 2;
+
+inline bool isBinaryFeatures(const cv::Mat &features)
+{
+    return features.depth()==CV_8U;
+}
+
+//converts descriptors to the element type the index is searched with
+inline void prepareFeatures(cv::Mat &features)
+{
+    if (!isBinaryFeatures(features) && features.type()!=CV_32F) {
+        features.convertTo(features, CV_32F);
+    }
+}
+
+//LSH tables are not serialized by flann::Index::save, they are cheap to rebuild at load instead
+inline bool isPersistentFeatureIndex(const cv::Mat &features)
+{
+    return !isBinaryFeatures(features);
+}
+
+//distances are CV_32S under Hamming and squared CV_32F under L2
+inline float featureDistance(const cv::Mat &dists, int row, int col)
+{
+    return dists.type()==CV_32S ? (float)dists.at<int>(row, col) : dists.at<float>(row, col);
+}
+
+inline std::string featureIndexPath(const char *databasePath)
+{
+    return std::string(databasePath) + FEATURE_INDEX_SUFFIX;
+}
+
+inline std::string featureChecksumString(uint64_t checksum)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)checksum);
+    return buf;
+}
+
+inline void buildFeatureIndex(cv::flann::Index &index, const cv::Mat &features)
+{
+    if (isBinaryFeatures(features)) {
+        index.build(features, cv::flann::LshIndexParams(FEATURE_INDEX_LSH_TABLES, FEATURE_INDEX_LSH_KEY_SIZE, FEATURE_INDEX_LSH_MULTI_PROBE), cvflann::FLANN_DIST_HAMMING);
+    }
+    else {
+        index.build(features, cv::flann::KDTreeIndexParams(FEATURE_INDEX_TREES));
+    }
+}
+
+//index by name, used to compare index types: "kdtree" (float only), "lsh" (binary only) or "linear";
+//trees is the number of KD-trees or LSH tables. Returns false for a combination that does not apply to the features
+inline bool buildFeatureIndex(cv::flann::Index &index, const cv::Mat &features, const std::string &indexType, int trees)
+{
+    bool binary = isBinaryFeatures(features);
+    if (indexType=="kdtree" && !binary) {
+        index.build(features, cv::flann::KDTreeIndexParams(trees));
+    }
+    else if (indexType=="lsh" && binary) {
+        index.build(features, cv::flann::LshIndexParams(trees, FEATURE_INDEX_LSH_KEY_SIZE, FEATURE_INDEX_LSH_MULTI_PROBE), cvflann::FLANN_DIST_HAMMING);
+    }
+    else if (indexType=="linear") {
+        index.build(features, cv::flann::LinearIndexParams(), binary ? cvflann::FLANN_DIST_HAMMING : cvflann::FLANN_DIST_L2);
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+inline bool saveFeatureIndex(const cv::flann::Index &index, const std::string &indexPath, const cv::Mat &features, uint64_t checksum)
+{
+    index.save(indexPath);
+
+    cv::FileStorage fsMeta(indexPath + FEATURE_INDEX_META_SUFFIX, cv::FileStorage::WRITE);
+    if (!fsMeta.isOpened()) {
+        return false;
+    }
+    fsMeta << "checksum" << featureChecksumString(checksum);
+    fsMeta << "rows" << features.rows;
+    fsMeta << "cols" << features.cols;
+    fsMeta << "trees" << FEATURE_INDEX_TREES;
+    fsMeta.release();
+
+    return true;
+}
+
+//loads the index only if it was built from exactly these features, the reason for a refusal is written to cout
+inline bool loadFeatureIndex(cv::flann::Index &index, const std::string &indexPath, const cv::Mat &features, uint64_t checksum)
+{
+    if (!isPersistentFeatureIndex(features) || access(indexPath.c_str(), R_OK)!=0) {
+        return false;
+    }
+
+    cv::FileStorage fsMeta(indexPath + FEATURE_INDEX_META_SUFFIX, cv::FileStorage::READ);
+    if (!fsMeta.isOpened()) {
+        std::cout << "index " << indexPath << " has no checksum file, ignore it" << std::endl;
+        return false;
+    }
+
+    std::string storedChecksum;
+    int rows, cols;
+    fsMeta["checksum"] >> storedChecksum;
+    fsMeta["rows"] >> rows;
+    fsMeta["cols"] >> cols;
+    fsMeta.release();
+
+    if (storedChecksum!=featureChecksumString(checksum) || rows!=features.rows || cols!=features.cols) {
+        std::cout << "index " << indexPath << " was built from different features, ignore it" << std::endl;
+        return false;
+    }
+
+    return index.load(features, indexPath);
+}
+
+#endif
@@ -0,0 +1,175 @@
+//
+//  feature_manifest.h
+//  opencv-commandline
+//
+//  Source files of a binary feature database, written next to it by fd_generate so that
+//  an incremental run only extracts new or changed files. Each entry records the file
+//  size, modification time and content hash, and the image and descriptor rows it
+//  produced. The manifest stores the checksum of the database it describes and is
+//  ignored when the two do not agree.
+//
+
+#ifndef OPENCV_COMMANDLINE_FEATURE_MANIFEST_H
+#define OPENCV_COMMANDLINE_FEATURE_MANIFEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+#include "opencv2/core/core.hpp"
+
+#include "feature_database.h"
+#include "feature_index.h"
+
+static const char* FEATURE_MANIFEST_SUFFIX = ".manifest";
+
+struct ManifestEntry {
+    std::string filename;
+    int64 size;
+    int64 mtime;
+    uint64_t hash;
+    int image;  //index into the database image table
+    int first;  //first descriptor row
+    int count;  //number of descriptor rows
+};
+
+//everything an incremental run must agree with before it reuses a database
+struct FeatureManifest {
+    cv::vector<ManifestEntry> entries;
+    std::string detectorType;
+    std::string extractorType;
+    std::string imageScale;  //imageScaleString of the --max_side/--scale setting
+    uint64_t checksum;
+};
+
+inline std::string featureManifestPath(const char *databasePath)
+{
+    return std::string(databasePath) + FEATURE_MANIFEST_SUFFIX;
+}
+
+//whole file into buffer, hashed with the database checksum function
+inline bool readFileHash(const char *path, cv::vector<uchar> &buffer, uint64_t &hash)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    bool ok = fseek(file, 0, SEEK_END)==0;
+    long size = ok ? ftell(file) : -1;
+    ok = size>=0 && fseek(file, 0, SEEK_SET)==0;
+    if (ok) {
+        buffer.resize(size);
+        ok = size==0 || fread(&buffer[0], 1, size, file)==(size_t)size;
+    }
+    fclose(file);
+    if (!ok) {
+        return false;
+    }
+    hash = featureChecksum(buffer.empty() ? NULL : &buffer[0], buffer.size());
+    return true;
+}
+
+//sizes and times are stored as doubles, FileStorage has no 64 bit integers
+inline bool writeFeatureManifest(const char *path, const FeatureManifest &manifest)
+{
+    cv::FileStorage fsManifest(path, cv::FileStorage::WRITE);
+    if (!fsManifest.isOpened()) {
+        return false;
+    }
+
+    cv::vector<std::string> filenames, hashes;
+    cv::vector<double> sizes, mtimes;
+    cv::vector<int> images, firsts, counts;
+    for (size_t i=0; i<manifest.entries.size(); i++) {
+        const ManifestEntry &entry = manifest.entries[i];
+        filenames.push_back(entry.filename);
+        sizes.push_back((double)entry.size);
+        mtimes.push_back((double)entry.mtime);
+        hashes.push_back(featureChecksumString(entry.hash));
+        images.push_back(entry.image);
+        firsts.push_back(entry.first);
+        counts.push_back(entry.count);
+    }
+
+    fsManifest << "checksum" << featureChecksumString(manifest.checksum);
+    fsManifest << "detector" << manifest.detectorType;
+    fsManifest << "extractor" << manifest.extractorType;
+    fsManifest << "image_scale" << manifest.imageScale;
+    fsManifest << "filenames" << filenames;
+    fsManifest << "sizes" << sizes;
+    fsManifest << "mtimes" << mtimes;
+    fsManifest << "hashes" << hashes;
+    fsManifest << "images" << images;
+    fsManifest << "firsts" << firsts;
+    fsManifest << "counts" << counts;
+    fsManifest.release();
+    return true;
+}
+
+inline bool loadFeatureManifest(const char *path, FeatureManifest &manifest)
+{
+    cv::FileStorage fsManifest(path, cv::FileStorage::READ);
+    if (!fsManifest.isOpened()) {
+        return false;
+    }
+
+    std::string checksum;
+    cv::vector<std::string> filenames, hashes;
+    cv::vector<double> sizes, mtimes;
+    cv::vector<int> images, firsts, counts;
+    fsManifest["checksum"] >> checksum;
+    fsManifest["detector"] >> manifest.detectorType;
+    fsManifest["extractor"] >> manifest.extractorType;
+    fsManifest["image_scale"] >> manifest.imageScale;
+    fsManifest["filenames"] >> filenames;
+    fsManifest["sizes"] >> sizes;
+    fsManifest["mtimes"] >> mtimes;
+    fsManifest["hashes"] >> hashes;
+    fsManifest["images"] >> images;
+    fsManifest["firsts"] >> firsts;
+    fsManifest["counts"] >> counts;
+    fsManifest.release();
+
+    size_t n = filenames.size();
+    if (sizes.size()!=n || mtimes.size()!=n || hashes.size()!=n || images.size()!=n || firsts.size()!=n || counts.size()!=n) {
+        return false;
+    }
+
+    manifest.checksum = strtoull(checksum.c_str(), NULL, 16);
+    manifest.entries.resize(n);
+    for (size_t i=0; i<n; i++) {
+        ManifestEntry &entry = manifest.entries[i];
+        entry.filename = filenames[i];
+        entry.size = (int64)sizes[i];
+        entry.mtime = (int64)mtimes[i];
+        entry.hash = strtoull(hashes[i].c_str(), NULL, 16);
+        entry.image = images[i];
+        entry.first = firsts[i];
+        entry.count = counts[i];
+    }
+    return true;
+}
+
+//true when the manifest was written for this database: the checksums agree and every entry names an image of it
+//with the rows it has, so an edited or damaged manifest makes the caller rebuild instead of indexing past its tables
+inline bool isFeatureManifestOf(const FeatureManifest &manifest, const FeatureDatabase &database)
+{
+    if (manifest.checksum!=database.checksum) {
+        return false;
+    }
+    int images = (int)database.indexes.size();
+    for (size_t i=0; i<manifest.entries.size(); i++) {
+        const ManifestEntry &entry = manifest.entries[i];
+        if (entry.image<0 || entry.image>=images) {
+            return false;
+        }
+        int end = entry.image + 1<images ? database.indexes[entry.image + 1] : database.features.rows;
+        if (entry.first!=database.indexes[entry.image] || entry.count!=end - entry.first) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
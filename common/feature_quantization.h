@@ -0,0 +1,417 @@
+//
+//  feature_quantization.h
+//  opencv-commandline
+//
+//  Compact storage of float descriptors (SURF, SIFT) in a binary feature database.
+//  fp16 keeps the IEEE half precision bits in CV_16U rows. int8 is a linear map
+//  q = round(v * scale) + zero into CV_8S rows; scale is a power of two taken from the
+//  known output range of the extractor (SURF is normalized to unit length, SIFT is byte
+//  valued and stays exact), or for other extractors from twice the range of the first
+//  descriptors. fd_generate fails when more than FEATURE_QUANTIZATION_CLIP_LIMIT of the
+//  values had to be clipped. Quantized databases are searched without FLANN by an exact
+//  linear scan over tiles of the database, int8 distances are computed on the integers.
+//
+
+#ifndef OPENCV_COMMANDLINE_FEATURE_QUANTIZATION_H
+#define OPENCV_COMMANDLINE_FEATURE_QUANTIZATION_H
+
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <ostream>
+#include <string>
+
+#include "opencv2/core/core.hpp"
+
+static const uint32_t FEATURE_QUANTIZATION_NONE = 0;
+static const uint32_t FEATURE_QUANTIZATION_FP16 = 1;
+static const uint32_t FEATURE_QUANTIZATION_INT8 = 2;
+static const char* FEATURE_QUANTIZATION_NAMES[] = {"none","fp16","int8"};
+static const int FEATURE_QUANTIZATION_SAMPLE_ROWS = 1000;
+static const double FEATURE_QUANTIZATION_CLIP_LIMIT = 0.001;  //fraction of all values
+static const size_t FEATURE_QUANTIZATION_CLIP_MIN = 1000;       //clipped values tolerated below the limit
+static const double FEATURE_QUANTIZATION_HEADROOM = 2;          //range of the first descriptors is widened by this
+static const size_t QUANTIZED_SEARCH_TILE_BYTES = 256 << 10;
+
+struct FeatureQuantization {
+    uint32_t method;
+    float scale;  //int8 only
+    float zero;   //int8 only
+};
+
+inline bool parseFeatureQuantization(const char *name, uint32_t &method)
+{
+    for (uint32_t i=0; i<sizeof(FEATURE_QUANTIZATION_NAMES)/sizeof(FEATURE_QUANTIZATION_NAMES[0]); i++) {
+        if (strcmp(name, FEATURE_QUANTIZATION_NAMES[i])==0) {
+            method = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline const char *featureQuantizationName(uint32_t method)
+{
+    return method<sizeof(FEATURE_QUANTIZATION_NAMES)/sizeof(FEATURE_QUANTIZATION_NAMES[0]) ? FEATURE_QUANTIZATION_NAMES[method] : "unknown";
+}
+
+inline int quantizedFeatureType(uint32_t method)
+{
+    return method==FEATURE_QUANTIZATION_FP16 ? CV_16UC1 : method==FEATURE_QUANTIZATION_INT8 ? CV_8SC1 : CV_32FC1;
+}
+
+//round to nearest even, out of range values become infinity
+inline uint16_t floatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t mantissa = bits & 0x7fffff;
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+
+    if (((bits >> 23) & 0xff)==0xff) {
+        return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    }
+    if (exponent>=31) {
+        return (uint16_t)(sign | 0x7c00);
+    }
+    if (exponent<=0) {
+        if (exponent<-10) {
+            return (uint16_t)sign;
+        }
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest>halfway || (rest==halfway && (half & 1)))
+            half++;
+        return (uint16_t)(sign | half);
+    }
+
+    //a carry out of the mantissa correctly moves into the exponent
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest>0x1000 || (rest==0x1000 && (half & 1)))
+        half++;
+    return (uint16_t)(sign | half);
+}
+
+inline float halfToFloat(uint16_t half)
+{
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+    if (exponent==0) {
+        float value = ldexpf((float)mantissa, -24);
+        return sign ? -value : value;
+    }
+    if (exponent==31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+//value range of the float extractors, false for others; adapters like Opponent keep the range of the extractor
+inline bool knownFeatureRange(const std::string &extractorType, double &minValue, double &maxValue)
+{
+    size_t length = extractorType.size();
+    if (length>=4 && extractorType.compare(length - 4, 4, "SURF")==0) {
+        minValue = -1;
+        maxValue = 1;
+        return true;
+    }
+    if (length>=4 && extractorType.compare(length - 4, 4, "SIFT")==0) {
+        minValue = 0;
+        maxValue = 255;
+        return true;
+    }
+    return false;
+}
+
+//the range rounded up to a power of two; non negative descriptors use the whole byte
+inline FeatureQuantization int8Quantization(double minValue, double maxValue)
+{
+    double range = std::max(fabs(minValue), fabs(maxValue));
+    double bound = range>0 ? pow(2.0, ceil(log(range) / log(2.0))) : 1.0;
+
+    FeatureQuantization result;
+    result.method = FEATURE_QUANTIZATION_INT8;
+    result.scale = (float)((minValue>=0 ? 256.0 : 128.0) / bound);
+    result.zero = minValue>=0 ? -128.0f : 0.0f;
+    return result;
+}
+
+inline FeatureQuantization int8Quantization(const cv::Mat &descriptors)
+{
+    double minValue = 0, maxValue = 0;
+    cv::minMaxLoc(descriptors, &minValue, &maxValue);
+    return int8Quantization(minValue, maxValue);
+}
+
+//float rows to stored rows, clipped counts the int8 values outside the range
+inline void quantizeFeatures(const cv::Mat &features, const FeatureQuantization &quantization, cv::Mat &quantized, size_t *clipped = NULL)
+{
+    quantized.create(features.rows, features.cols, quantizedFeatureType(quantization.method));
+    for (int i=0; i<features.rows; i++) {
+        const float *row = features.ptr<float>(i);
+        if (quantization.method==FEATURE_QUANTIZATION_FP16) {
+            uint16_t *out = quantized.ptr<uint16_t>(i);
+            for (int j=0; j<features.cols; j++)
+                out[j] = floatToHalf(row[j]);
+        }
+        else {
+            schar *out = quantized.ptr<schar>(i);
+            int low = quantization.zero<0 ? -128 : -127;
+            for (int j=0; j<features.cols; j++) {
+                int value = cvRound(row[j] * quantization.scale + quantization.zero);
+                if (value<low || value>127) {
+                    value = value<low ? low : 127;
+                    if (clipped)
+                        (*clipped)++;
+                }
+                out[j] = (schar)value;
+            }
+        }
+    }
+}
+
+inline void dequantizeFeatures(const cv::Mat &quantized, const FeatureQuantization &quantization, cv::Mat &features)
+{
+    features.create(quantized.rows, quantized.cols, CV_32F);
+    for (int i=0; i<quantized.rows; i++) {
+        float *out = features.ptr<float>(i);
+        if (quantization.method==FEATURE_QUANTIZATION_FP16) {
+            const uint16_t *row = quantized.ptr<uint16_t>(i);
+            for (int j=0; j<quantized.cols; j++)
+                out[j] = halfToFloat(row[j]);
+        }
+        else {
+            const schar *row = quantized.ptr<schar>(i);
+            for (int j=0; j<quantized.cols; j++)
+                out[j] = (row[j] - quantization.zero) / quantization.scale;
+        }
+    }
+}
+
+//plain loops the compiler vectorizes; int8 differences fit in 16 bits and their squares in 32
+inline int int8SquaredDistance(const schar *a, const schar *b, int n)
+{
+    int sum = 0;
+    for (int i=0; i<n; i++) {
+        int d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+inline float floatSquaredDistance(const float *a, const float *b, int n)
+{
+    float sum = 0;
+    for (int i=0; i<n; i++) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+//keeps the knn smallest distances of one query in ascending order; float under L2, int under Hamming
+template <typename T>
+inline void insertNeighbor(int *indices, T *dists, int knn, int index, T dist)
+{
+    if (dist>=dists[knn - 1])
+        return;
+    int k = knn - 1;
+    while (k>0 && dists[k - 1]>dist) {
+        indices[k] = indices[k - 1];
+        dists[k] = dists[k - 1];
+        k--;
+    }
+    indices[k] = index;
+    dists[k] = dist;
+}
+
+//exact k nearest neighbors of float queries in quantized features, with the same outputs as flann::Index::knnSearch
+//under L2: CV_32S indices, -1 when there are fewer rows than knn, and squared CV_32F distances in descriptor units.
+//The database is read in tiles that every query visits before the next one; fp16 tiles are widened to float once
+inline void quantizedKnnSearch(const cv::Mat &features, const FeatureQuantization &quantization, const cv::Mat &queries, cv::Mat &indices, cv::Mat &dists, int knn)
+{
+    indices.create(queries.rows, knn, CV_32S);
+    dists.create(queries.rows, knn, CV_32F);
+    indices.setTo(cv::Scalar(-1));
+    dists.setTo(cv::Scalar(FLT_MAX));
+
+    int cols = features.cols;
+    bool int8 = quantization.method==FEATURE_QUANTIZATION_INT8;
+    float unit = int8 ? 1.0f / (quantization.scale * quantization.scale) : 1.0f;
+    cv::Mat quantizedQueries, tile;
+    if (int8)
+        quantizeFeatures(queries, quantization, quantizedQueries);
+    int tileRows = (int)std::max((size_t)1, QUANTIZED_SEARCH_TILE_BYTES / std::max((size_t)1, cols * sizeof(float)));
+
+    for (int first=0; first<features.rows; first+=tileRows) {
+        int last = std::min(features.rows, first + tileRows);
+        if (int8) {
+            for (int q=0; q<quantizedQueries.rows; q++) {
+                const schar *query = quantizedQueries.ptr<schar>(q);
+                int *rowIndices = indices.ptr<int>(q);
+                float *rowDists = dists.ptr<float>(q);
+                for (int k=first; k<last; k++)
+                    insertNeighbor(rowIndices, rowDists, knn, k, int8SquaredDistance(query, features.ptr<schar>(k), cols) * unit);
+            }
+        }
+        else {
+            tile.create(last - first, cols, CV_32F);
+            for (int k=first; k<last; k++) {
+                const uint16_t *data = features.ptr<uint16_t>(k);
+                float *row = tile.ptr<float>(k - first);
+                for (int j=0; j<cols; j++)
+                    row[j] = halfToFloat(data[j]);
+            }
+            for (int q=0; q<queries.rows; q++) {
+                const float *query = queries.ptr<float>(q);
+                int *rowIndices = indices.ptr<int>(q);
+                float *rowDists = dists.ptr<float>(q);
+                for (int k=first; k<last; k++)
+                    insertNeighbor(rowIndices, rowDists, knn, k, floatSquaredDistance(query, tile.ptr<float>(k - first), cols));
+            }
+        }
+    }
+}
+
+//quantizes descriptors for fd_generate in commit order and measures what is lost: the rms error over every value,
+//and how often the nearest neighbor of a sampled descriptor among the other samples stays the same
+class FeatureQuantizer {
+public:
+    FeatureQuantizer(uint32_t method) : ready(method!=FEATURE_QUANTIZATION_INT8), squaredError(0), squaredValue(0), values(0), clipped(0), seen(0)
+    {
+        quantization.method = method;
+        quantization.scale = 1;
+        quantization.zero = 0;
+    }
+
+    //parameters of an existing database, which has to be extended with the same ones
+    void setParameters(const FeatureQuantization &parameters)
+    {
+        quantization = parameters;
+        ready = true;
+    }
+
+    //int8 parameters from the known output range of the extractor instead of the first descriptors
+    void setRange(double minValue, double maxValue)
+    {
+        if (quantization.method!=FEATURE_QUANTIZATION_INT8)
+            return;
+        quantization = int8Quantization(minValue, maxValue);
+        ready = true;
+    }
+
+    const FeatureQuantization &parameters() const { return quantization; }
+
+    //binary descriptors are passed through and turn quantization off; false once too many values were clipped
+    bool quantize(const cv::Mat &descriptors, cv::Mat &quantized)
+    {
+        if (descriptors.empty() || descriptors.depth()==CV_8U || quantization.method==FEATURE_QUANTIZATION_NONE) {
+            if (descriptors.depth()==CV_8U)
+                quantization.method = FEATURE_QUANTIZATION_NONE;
+            quantized = descriptors;
+            return true;
+        }
+
+        cv::Mat features = descriptors;
+        if (features.type()!=CV_32F)
+            descriptors.convertTo(features, CV_32F);
+        if (!ready) {
+            //one image does not show the range of the others
+            double minValue = 0, maxValue = 0;
+            cv::minMaxLoc(features, &minValue, &maxValue);
+            quantization = int8Quantization(minValue * FEATURE_QUANTIZATION_HEADROOM, maxValue * FEATURE_QUANTIZATION_HEADROOM);
+            ready = true;
+        }
+        quantizeFeatures(features, quantization, quantized, &clipped);
+
+        cv::Mat restored;
+        dequantizeFeatures(quantized, quantization, restored);
+        squaredError += cv::norm(features, restored, cv::NORM_L2SQR);
+        squaredValue += cv::norm(features, cv::NORM_L2SQR);
+        values += features.total();
+
+        //reservoir sample, the same descriptors are picked for the same input
+        for (int i=0; i<features.rows; i++, seen++) {
+            if (sample.rows<FEATURE_QUANTIZATION_SAMPLE_ROWS) {
+                sample.push_back(features.row(i));
+                continue;
+            }
+            uint64 k = (uint64)rng.next() % (seen + 1);
+            if (k<(uint64)sample.rows)
+                features.row(i).copyTo(sample.row((int)k));
+        }
+        return !clipLimitExceeded();
+    }
+
+    bool clipLimitExceeded() const
+    {
+        return clipped>FEATURE_QUANTIZATION_CLIP_MIN && clipped>values * FEATURE_QUANTIZATION_CLIP_LIMIT;
+    }
+
+    size_t clippedCount() const { return clipped; }
+
+    void report(std::ostream &out)
+    {
+        if (quantization.method==FEATURE_QUANTIZATION_NONE || values==0)
+            return;
+
+        cv::Mat quantized, restored;
+        quantizeFeatures(sample, quantization, quantized);
+        dequantizeFeatures(quantized, quantization, restored);
+        int agree = 0;
+        for (int i=0; i<sample.rows; i++) {
+            if (nearestSample(sample, i)==nearestSample(restored, i))
+                agree++;
+        }
+
+        double rms = sqrt(squaredError / values);
+        double valueRms = sqrt(squaredValue / values);
+        out << featureQuantizationName(quantization.method) << " descriptors: rms error " << rms << " (" << (valueRms>0 ? 100.0 * rms / valueRms : 0.0) << "% of rms value), " << clipped << " values clipped";
+        if (sample.rows>1)
+            out << ", nearest neighbor kept for " << (100.0 * agree / sample.rows) << "% of " << sample.rows << " sampled descriptors";
+        out << std::endl;
+    }
+
+private:
+    FeatureQuantization quantization;
+    bool ready;
+    double squaredError;
+    double squaredValue;
+    size_t values;
+    size_t clipped;
+    size_t seen;
+    cv::Mat sample;
+    cv::RNG rng;
+
+    static int nearestSample(const cv::Mat &samples, int i)
+    {
+        int result = -1;
+        float best = FLT_MAX;
+        for (int k=0; k<samples.rows; k++) {
+            if (k==i)
+                continue;
+            float dist = floatSquaredDistance(samples.ptr<float>(i), samples.ptr<float>(k), samples.cols);
+            if (dist<best) {
+                best = dist;
+                result = k;
+            }
+        }
+        return result;
+    }
+};
+
+#endif
@@ -0,0 +1,81 @@
+//
+//  feature_shards.h
+//  opencv-commandline
+//
+//  A feature database split into shards by fd_generate --shards. Every shard is a binary
+//  feature database written next to the list as "<output>.<shard>", and holds a contiguous
+//  range of images, so the shards concatenated in list order give the rows and images of the
+//  unsharded database. The list is a small FileStorage file whose first key is
+//  FEATURE_SHARDS_KEY; shard names are stored relative to the directory of the list.
+//
+
+#ifndef OPENCV_COMMANDLINE_FEATURE_SHARDS_H
+#define OPENCV_COMMANDLINE_FEATURE_SHARDS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "opencv2/core/core.hpp"
+
+static const char* FEATURE_SHARDS_KEY = "feature_shards";
+static const size_t FEATURE_SHARDS_PEEK_SIZE = 256;
+
+inline std::string featureShardPath(const char *path, int shard)
+{
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%d", shard);
+    return std::string(path) + suffix;
+}
+
+//only the start of the file is read, a large YAML feature file is not parsed to find out
+inline bool isFeatureShardList(const char *path)
+{
+    char head[FEATURE_SHARDS_PEEK_SIZE + 1];
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    size_t size = fread(head, 1, FEATURE_SHARDS_PEEK_SIZE, file);
+    fclose(file);
+    head[size] = 0;
+    return strstr(head, FEATURE_SHARDS_KEY)!=NULL;
+}
+
+inline bool writeFeatureShardList(const char *path, const cv::vector<std::string> &shardPaths)
+{
+    cv::FileStorage fsShards(path, cv::FileStorage::WRITE);
+    if (!fsShards.isOpened()) {
+        return false;
+    }
+    cv::vector<std::string> names;
+    for (size_t i=0; i<shardPaths.size(); i++) {
+        size_t slash = shardPaths[i].find_last_of('/');
+        names.push_back(slash==std::string::npos ? shardPaths[i] : shardPaths[i].substr(slash + 1));
+    }
+    fsShards << FEATURE_SHARDS_KEY << names;
+    fsShards.release();
+    return true;
+}
+
+inline bool loadFeatureShardList(const char *path, cv::vector<std::string> &shardPaths)
+{
+    cv::FileStorage fsShards(path, cv::FileStorage::READ);
+    if (!fsShards.isOpened()) {
+        return false;
+    }
+    cv::vector<std::string> names;
+    fsShards[FEATURE_SHARDS_KEY] >> names;
+    fsShards.release();
+
+    std::string list = path;
+    size_t slash = list.find_last_of('/');
+    std::string directory = slash==std::string::npos ? std::string() : list.substr(0, slash + 1);
+    shardPaths.clear();
+    for (size_t i=0; i<names.size(); i++) {
+        shardPaths.push_back(directory + names[i]);
+    }
+    return !shardPaths.empty();
+}
+
+#endif
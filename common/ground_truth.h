@@ -0,0 +1,60 @@
+//
+//  ground_truth.h
+//  opencv-commandline
+//
+//  Query -> reference filename mapping written by query_generate and read by
+//  the match tools. Queries missing from the mapping are expected to match a
+//  reference with the same filename, as before.
+//
+
+#ifndef OPENCV_COMMANDLINE_GROUND_TRUTH_H
+#define OPENCV_COMMANDLINE_GROUND_TRUTH_H
+
+#include <map>
+#include <string>
+
+#include "opencv2/core/core.hpp"
+
+typedef std::map<std::string, std::string> GroundTruth;
+
+inline bool writeGroundTruth(const char *path, const cv::vector<std::string> &queries, const cv::vector<std::string> &references)
+{
+    cv::FileStorage fsGroundTruth(path, cv::FileStorage::WRITE);
+    if (!fsGroundTruth.isOpened()) {
+        return false;
+    }
+    fsGroundTruth << "queries" << queries;
+    fsGroundTruth << "references" << references;
+    fsGroundTruth.release();
+    return true;
+}
+
+inline bool loadGroundTruth(const char *path, GroundTruth &groundTruth)
+{
+    cv::FileStorage fsGroundTruth(path, cv::FileStorage::READ);
+    if (!fsGroundTruth.isOpened()) {
+        return false;
+    }
+
+    cv::vector<std::string> queries, references;
+    fsGroundTruth["queries"] >> queries;
+    fsGroundTruth["references"] >> references;
+    fsGroundTruth.release();
+    if (queries.size()!=references.size()) {
+        return false;
+    }
+
+    groundTruth.clear();
+    for (size_t i=0; i<queries.size(); i++) {
+        groundTruth[queries[i]] = references[i];
+    }
+    return true;
+}
+
+inline bool isExpectedMatch(const GroundTruth &groundTruth, const std::string &query, const std::string &reference)
+{
+    GroundTruth::const_iterator iter = groundTruth.find(query);
+    return iter==groundTruth.end() ? query==reference : iter->second==reference;
+}
+
+#endif
@@ -0,0 +1,171 @@
+//
+//  image_loader.h
+//  opencv-commandline
+//
+//  Decoding with an optional size limit, shared by the generate and match tools so that
+//  reference and query images are shrunk the same way. JPEG files are decoded at reduced
+//  resolution by the DCT when OpenCV supports it (IMREAD_REDUCED_*, OpenCV 3 and later),
+//  the rest of the reduction is an area resize. The target size only depends on the
+//  original size, so both ways give images of the same size.
+//
+
+#ifndef OPENCV_COMMANDLINE_IMAGE_LOADER_H
+#define OPENCV_COMMANDLINE_IMAGE_LOADER_H
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <sstream>
+#include <string>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+//0 leaves the corresponding limit off
+struct ImageScale {
+    int maxSide;   //longest side after scaling, images are never enlarged to reach it
+    double scale;  //factor applied to every image
+};
+
+inline bool isImageScaled(const ImageScale &imageScale)
+{
+    return imageScale.maxSide>0 || (imageScale.scale>0 && imageScale.scale!=1);
+}
+
+//recorded with generated files so a match run can tell which setting was used
+inline std::string imageScaleString(const ImageScale &imageScale)
+{
+    std::ostringstream result;
+    result << "max_side=" << imageScale.maxSide << ",scale=" << (imageScale.scale>0 ? imageScale.scale : 1.0);
+    return result.str();
+}
+
+inline double imageScaleFactor(const ImageScale &imageScale, int width, int height)
+{
+    double factor = imageScale.scale>0 ? imageScale.scale : 1.0;
+    int side = std::max(width, height);
+    if (imageScale.maxSide>0 && side * factor>imageScale.maxSide) {
+        factor = (double)imageScale.maxSide / side;
+    }
+    return factor;
+}
+
+inline cv::Size imageScaledSize(const ImageScale &imageScale, int width, int height)
+{
+    double factor = imageScaleFactor(imageScale, width, height);
+    return cv::Size(std::max(1, (int)floor(width * factor + 0.5)), std::max(1, (int)floor(height * factor + 0.5)));
+}
+
+//frame size from the first SOF segment, without decoding
+inline bool jpegImageSize(const uchar *data, size_t size, int &width, int &height)
+{
+    if (size<4 || data[0]!=0xff || data[1]!=0xd8) {
+        return false;
+    }
+
+    size_t offset = 2;
+    while (offset + 4<=size) {
+        if (data[offset]!=0xff) {
+            return false;
+        }
+        uchar marker = data[offset + 1];
+        if (marker==0xff) {
+            offset++;
+            continue;
+        }
+        if (marker==0x01 || (marker>=0xd0 && marker<=0xd7)) {
+            offset += 2;
+            continue;
+        }
+
+        size_t length = (data[offset + 2] << 8) | data[offset + 3];
+        bool frame = marker>=0xc0 && marker<=0xcf && marker!=0xc4 && marker!=0xc8 && marker!=0xcc;
+        if (frame) {
+            if (offset + 9>size) {
+                return false;
+            }
+            height = (data[offset + 5] << 8) | data[offset + 6];
+            width = (data[offset + 7] << 8) | data[offset + 8];
+            return width>0 && height>0;
+        }
+        if (marker==0xd9 || marker==0xda || length<2) {
+            return false;
+        }
+        offset += 2 + length;
+    }
+    return false;
+}
+
+inline void resizeImage(cv::Mat &image, const cv::Size &size)
+{
+    if (image.cols!=size.width || image.rows!=size.height) {
+        bool shrink = size.width<image.cols || size.height<image.rows;
+        cv::resize(image, image, size, 0, 0, shrink ? cv::INTER_AREA : cv::INTER_LINEAR);
+    }
+}
+
+//like imdecode, flags are CV_LOAD_IMAGE_GRAYSCALE or CV_LOAD_IMAGE_COLOR
+inline cv::Mat decodeImage(const cv::Mat &encoded, int flags, const ImageScale &imageScale)
+{
+    if (!isImageScaled(imageScale)) {
+        return cv::imdecode(encoded, flags);
+    }
+
+    cv::Mat image;
+#if CV_MAJOR_VERSION>=3
+    int width, height;
+    if ((flags==cv::IMREAD_GRAYSCALE || flags==cv::IMREAD_COLOR) && jpegImageSize(encoded.data, encoded.total(), width, height)) {
+        cv::Size size = imageScaledSize(imageScale, width, height);
+        double factor = std::max((double)size.width / width, (double)size.height / height);
+        int reducedFlags = flags;
+        if (factor<=0.125)
+            reducedFlags = flags==cv::IMREAD_GRAYSCALE ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8;
+        else if (factor<=0.25)
+            reducedFlags = flags==cv::IMREAD_GRAYSCALE ? cv::IMREAD_REDUCED_GRAYSCALE_4 : cv::IMREAD_REDUCED_COLOR_4;
+        else if (factor<=0.5)
+            reducedFlags = flags==cv::IMREAD_GRAYSCALE ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_REDUCED_COLOR_2;
+        image = cv::imdecode(encoded, reducedFlags);
+        if (image.data) {
+            resizeImage(image, size);
+        }
+        return image;
+    }
+#endif
+    image = cv::imdecode(encoded, flags);
+    if (image.data) {
+        resizeImage(image, imageScaledSize(imageScale, image.cols, image.rows));
+    }
+    return image;
+}
+
+//whole file in one 1xN CV_8U matrix, empty when it could not be read
+inline cv::Mat readEncodedImage(const char *path)
+{
+    cv::Mat result;
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return result;
+    }
+    long size = fseek(file, 0, SEEK_END)==0 ? ftell(file) : -1;
+    if (size>0 && fseek(file, 0, SEEK_SET)==0) {
+        result.create(1, (int)size, CV_8U);
+        if (fread(result.data, 1, size, file)!=(size_t)size) {
+            result.release();
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+//like imread
+inline cv::Mat loadImage(const char *path, int flags, const ImageScale &imageScale)
+{
+    if (!isImageScaled(imageScale)) {
+        return cv::imread(path, flags);
+    }
+    cv::Mat encoded = readEncodedImage(path);
+    return encoded.empty() ? cv::Mat() : decodeImage(encoded, flags, imageScale);
+}
+
+#endif
@@ -0,0 +1,208 @@
+//
+//  inverted_index.h
+//  opencv-commandline
+//
+//  Inverted file over BOW histograms with tf-idf weighting (Sivic and Zisserman, "Video
+//  Google"). bow_generate computes the idf of every word from its database histograms and
+//  writes it next to them under BOW_IDF_KEY. bow_match weights the histograms by idf,
+//  normalizes them to unit length and keeps, per word, the list of images that contain it.
+//  A query only visits the lists of its own words, and the images it touched are ranked by
+//  cosine similarity.
+//
+
+#ifndef OPENCV_COMMANDLINE_INVERTED_INDEX_H
+#define OPENCV_COMMANDLINE_INVERTED_INDEX_H
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/features2d/features2d.hpp"
+
+static const char* BOW_IDF_KEY = "idf";
+
+//idf of every word, log(images / images with the word); empty histograms are images without descriptors
+inline void computeIdf(const cv::vector<cv::Mat> &histograms, int words, cv::Mat &idf)
+{
+    cv::vector<int> documents(words, 0);
+    int images = 0;
+    for (size_t i=0; i<histograms.size(); i++) {
+        if (histograms[i].empty())
+            continue;
+        images++;
+        const float *histogram = histograms[i].ptr<float>(0);
+        for (int w=0; w<words; w++) {
+            if (histogram[w]>0)
+                documents[w]++;
+        }
+    }
+
+    idf.create(1, words, CV_32F);
+    for (int w=0; w<words; w++)
+        idf.at<float>(w) = documents[w] ? (float)log((double)images / documents[w]) : 0.0f;
+}
+
+class InvertedIndex {
+public:
+    InvertedIndex() : images(0) {}
+
+    //histograms are 1 x words CV_32F term frequencies, idf comes from computeIdf
+    void build(const cv::vector<cv::Mat> &histograms, const cv::Mat &wordIdf)
+    {
+        idf = wordIdf;
+        int words = idf.cols;
+        images = (int)histograms.size();
+        postingStart.assign(words + 1, 0);
+        postingImage.clear();
+        postingWeight.clear();
+        scores.assign(images, 0.0f);
+        touched.clear();
+
+        //count the postings of every word, then fill them image by image
+        cv::vector<float> weights;
+        for (int i=0; i<images; i++) {
+            if (weightedHistogram(histograms[i], weights)) {
+                for (int w=0; w<words; w++) {
+                    if (weights[w]>0)
+                        postingStart[w + 1]++;
+                }
+            }
+        }
+        for (int w=0; w<words; w++)
+            postingStart[w + 1] += postingStart[w];
+        postingImage.resize(postingStart[words]);
+        postingWeight.resize(postingStart[words]);
+
+        cv::vector<int> next(postingStart.begin(), postingStart.end() - 1);
+        for (int i=0; i<images; i++) {
+            if (!weightedHistogram(histograms[i], weights))
+                continue;
+            for (int w=0; w<words; w++) {
+                if (weights[w]>0) {
+                    postingImage[next[w]] = i;
+                    postingWeight[next[w]] = weights[w];
+                    next[w]++;
+                }
+            }
+        }
+    }
+
+    //same as build, from histograms in compressed sparse rows: the entries of image i are rowStart[i] to rowStart[i + 1]
+    void build(int imageCount, const uint64_t *rowStart, const int32_t *wordIndex, const float *values, const cv::Mat &wordIdf)
+    {
+        idf = wordIdf;
+        int words = idf.cols;
+        images = imageCount;
+        postingStart.assign(words + 1, 0);
+        scores.assign(images, 0.0f);
+        touched.clear();
+
+        const float *wordWeight = idf.ptr<float>(0);
+        cv::vector<float> scales(images, 0.0f);
+        for (int i=0; i<images; i++) {
+            double norm = 0;
+            for (uint64_t k=rowStart[i]; k<rowStart[i + 1]; k++) {
+                double weight = values[k] * wordWeight[wordIndex[k]];
+                norm += weight * weight;
+            }
+            if (norm<=0)
+                continue;
+            scales[i] = (float)(1.0 / sqrt(norm));
+            for (uint64_t k=rowStart[i]; k<rowStart[i + 1]; k++) {
+                if (values[k] * wordWeight[wordIndex[k]]>0)
+                    postingStart[wordIndex[k] + 1]++;
+            }
+        }
+        for (int w=0; w<words; w++)
+            postingStart[w + 1] += postingStart[w];
+        postingImage.resize(postingStart[words]);
+        postingWeight.resize(postingStart[words]);
+
+        cv::vector<int> next(postingStart.begin(), postingStart.end() - 1);
+        for (int i=0; i<images; i++) {
+            for (uint64_t k=rowStart[i]; scales[i]>0 && k<rowStart[i + 1]; k++) {
+                float weight = values[k] * wordWeight[wordIndex[k]];
+                if (weight>0) {
+                    int w = wordIndex[k];
+                    postingImage[next[w]] = i;
+                    postingWeight[next[w]] = weight * scales[i];
+                    next[w]++;
+                }
+            }
+        }
+    }
+
+    //the topK images most similar to a query histogram, as matches with imgIdx the image and distance 1 - cosine similarity
+    void query(const cv::Mat &histogram, int topK, cv::vector<cv::DMatch> &matches)
+    {
+        matches.clear();
+        cv::vector<float> weights;
+        if (!weightedHistogram(histogram, weights))
+            return;
+
+        for (int w=0; w<idf.cols; w++) {
+            if (weights[w]<=0)
+                continue;
+            for (int p=postingStart[w]; p<postingStart[w + 1]; p++) {
+                int image = postingImage[p];
+                if (scores[image]==0)
+                    touched.push_back(image);
+                scores[image] += weights[w] * postingWeight[p];
+            }
+        }
+
+        int count = std::min(topK, (int)touched.size());
+        std::partial_sort(touched.begin(), touched.begin() + count, touched.end(), ScoreGreater(scores));
+        for (int i=0; i<count; i++)
+            matches.push_back(cv::DMatch(0, touched[i], touched[i], 1.0f - scores[touched[i]]));
+
+        for (size_t i=0; i<touched.size(); i++)
+            scores[touched[i]] = 0;
+        touched.clear();
+    }
+
+    int imageCount() const { return images; }
+    int wordCount() const { return idf.cols; }
+    int postingCount() const { return (int)postingImage.size(); }
+
+private:
+    struct ScoreGreater {
+        ScoreGreater(const cv::vector<float> &scores) : scores(scores) {}
+        bool operator()(int a, int b) const
+        {
+            return scores[a]>scores[b] || (scores[a]==scores[b] && a<b);
+        }
+        const cv::vector<float> &scores;
+    };
+
+    //unit length tf-idf weights of a histogram; false for an empty histogram or one without weighted words
+    bool weightedHistogram(const cv::Mat &histogram, cv::vector<float> &weights) const
+    {
+        if (histogram.empty() || histogram.total()!=(size_t)idf.cols)
+            return false;
+        weights.resize(idf.cols);
+        const float *tf = histogram.ptr<float>(0);
+        double norm = 0;
+        for (int w=0; w<idf.cols; w++) {
+            weights[w] = tf[w] * idf.at<float>(w);
+            norm += (double)weights[w] * weights[w];
+        }
+        if (norm<=0)
+            return false;
+        float scale = (float)(1.0 / sqrt(norm));
+        for (int w=0; w<idf.cols; w++)
+            weights[w] *= scale;
+        return true;
+    }
+
+    int images;
+    cv::Mat idf;
+    cv::vector<int> postingStart;       //per word, its first posting; words + 1 entries
+    cv::vector<int> postingImage;
+    cv::vector<float> postingWeight;
+    cv::vector<float> scores;           //per image, accumulated by a query and reset after it
+    cv::vector<int> touched;            //images with a non zero score in the current query
+};
+
+#endif
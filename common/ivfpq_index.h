@@ -0,0 +1,451 @@
+//
+//  ivfpq_index.h
+//  opencv-commandline
+//
+//  Inverted file with product quantization (IVF-PQ) over the float descriptors of a feature
+//  database, for collections whose raw descriptors do not fit in memory. A coarse k-means
+//  splits the space into lists; every descriptor is stored in the list of its nearest coarse
+//  centroid as one byte per subvector, the nearest of IVFPQ_CENTROIDS codewords for that part
+//  of its residual. A query visits the nprobe nearest lists and estimates distances from a
+//  table of query residual to codeword distances (asymmetric distance computation).
+//
+//  Layout (native byte order, offsets in bytes from the start of the file):
+//      header              IvfPqHeader, IVFPQ_HEADER_SIZE bytes
+//      coarse centroids    lists * dim float
+//      codebooks           subquantizers * IVFPQ_CENTROIDS * (dim / subquantizers) float
+//      list offsets        (lists + 1) uint64, first entry of each list
+//      ids                 rows int32, database row of each entry, grouped by list
+//      codes               rows * subquantizers uint8, in the order of ids
+//
+//  The header records the checksum of the feature database the codes were computed from.
+//
+
+#ifndef OPENCV_COMMANDLINE_IVFPQ_INDEX_H
+#define OPENCV_COMMANDLINE_IVFPQ_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#include "opencv2/core/core.hpp"
+
+#include "feature_database.h"
+#include "feature_quantization.h"
+
+static const char IVFPQ_INDEX_MAGIC[8] = {'I','V','P','Q','\r','\n','\032','\n'};
+static const uint32_t IVFPQ_INDEX_VERSION = 1;
+static const size_t IVFPQ_HEADER_SIZE = 128;
+static const char* IVFPQ_INDEX_SUFFIX = ".ivfpq";
+static const int IVFPQ_CENTROIDS = 256;
+static const int IVFPQ_LISTS_DEFAULT = 1024;
+static const int IVFPQ_CODE_SIZE_DEFAULT = 16;
+static const int IVFPQ_TRAIN_SAMPLE_DEFAULT = 100000;
+static const int IVFPQ_NPROBE_DEFAULT = 8;
+static const int IVFPQ_KMEANS_ITERATIONS = 20;
+static const double IVFPQ_KMEANS_EPSILON = 1e-4;
+static const int IVFPQ_ADD_BATCH = 65536;
+
+struct IvfPqHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint32_t lists;
+    uint32_t subquantizers;
+    uint64_t rows;
+    uint64_t checksum;
+    uint64_t coarseOffset;
+    uint64_t codebookOffset;
+    uint64_t listOffset;
+    uint64_t idOffset;
+    uint64_t codeOffset;
+    uint64_t fileSize;
+};
+
+inline std::string featureIvfPqPath(const char *databasePath)
+{
+    return std::string(databasePath) + IVFPQ_INDEX_SUFFIX;
+}
+
+//stored rows [first, last) of a database as CV_32F, quantized rows are restored
+inline void ivfPqFloatRows(const cv::Mat &features, const FeatureQuantization &quantization, int first, int last, cv::Mat &rows)
+{
+    cv::Mat stored = features.rowRange(first, last);
+    if (quantization.method!=FEATURE_QUANTIZATION_NONE)
+        dequantizeFeatures(stored, quantization, rows);
+    else if (stored.type()!=CV_32F)
+        stored.convertTo(rows, CV_32F);
+    else
+        rows = stored;
+}
+
+//evenly spaced rows, so the sample covers every part of the directory
+inline void ivfPqTrainingSample(const cv::Mat &features, const FeatureQuantization &quantization, int count, cv::Mat &sample)
+{
+    count = std::min(count, features.rows);
+    sample.create(count, features.cols, CV_32F);
+    cv::Mat row;
+    for (int i=0; i<count; i++) {
+        int k = (int)((int64)i * features.rows / count);
+        ivfPqFloatRows(features, quantization, k, k + 1, row);
+        row.copyTo(sample.row(i));
+    }
+}
+
+class IvfPqIndex {
+public:
+    IvfPqIndex() : dim(0), subquantizers(0), rowCount(0), starts(NULL), ids(NULL), codes(NULL), mapping(NULL), mappingSize(0) {}
+    ~IvfPqIndex() { close(); }
+
+    int dimension() const { return dim; }
+    int listCount() const { return coarse.rows; }
+    int codeSize() const { return subquantizers; }
+    uint64_t size() const { return rowCount; }
+    size_t byteSize() const { return mappingSize; }
+
+    //coarse centroids and one codebook per subvector of the residuals; the descriptor size has to be a multiple of
+    //subquantizerCount. Returns false when the sample does not allow it
+    bool train(const cv::Mat &sample, int lists, int subquantizerCount)
+    {
+        close();
+        if (sample.type()!=CV_32F || sample.rows==0 || subquantizerCount<=0 || sample.cols % subquantizerCount!=0) {
+            return false;
+        }
+        dim = sample.cols;
+        subquantizers = subquantizerCount;
+        lists = std::max(1, std::min(lists, sample.rows));
+        cv::TermCriteria criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, IVFPQ_KMEANS_ITERATIONS, IVFPQ_KMEANS_EPSILON);
+
+        cv::Mat labels;
+        cv::kmeans(sample, lists, labels, criteria, 1, cv::KMEANS_PP_CENTERS, coarse);
+
+        cv::Mat residuals(sample.rows, dim, CV_32F);
+        for (int i=0; i<sample.rows; i++) {
+            const float *row = sample.ptr<float>(i);
+            const float *centroid = coarse.ptr<float>(labels.at<int>(i));
+            float *residual = residuals.ptr<float>(i);
+            for (int j=0; j<dim; j++)
+                residual[j] = row[j] - centroid[j];
+        }
+
+        //with fewer samples than codewords the codebook repeats itself, the first copy is always the one chosen
+        int sub = dim / subquantizers;
+        int centroids = std::min(IVFPQ_CENTROIDS, sample.rows);
+        codebooks.create(subquantizers * IVFPQ_CENTROIDS, sub, CV_32F);
+        for (int m=0; m<subquantizers; m++) {
+            cv::Mat part = residuals.colRange(m * sub, (m + 1) * sub).clone();
+            cv::Mat partLabels, centers;
+            cv::kmeans(part, centroids, partLabels, criteria, 1, cv::KMEANS_PP_CENTERS, centers);
+            for (int j=0; j<IVFPQ_CENTROIDS; j++)
+                centers.row(j % centroids).copyTo(codebooks.row(m * IVFPQ_CENTROIDS + j));
+        }
+
+        listIds.assign(lists, cv::vector<int32_t>());
+        listCodes.assign(lists, cv::vector<uchar>());
+        return true;
+    }
+
+    //encodes float rows numbered from firstRow into the lists of a trained index, on the given number of threads
+    void add(const cv::Mat &rows, int firstRow, int threads)
+    {
+        cv::vector<int> assign(rows.rows);
+        cv::vector<uchar> rowCodes((size_t)rows.rows * subquantizers);
+        threads = std::max(1, std::min(threads, rows.rows));
+
+        cv::vector<EncodeTask> tasks(threads);
+        cv::vector<pthread_t> threadIds(threads);
+        for (int i=0; i<threads; i++) {
+            tasks[i].index = this;
+            tasks[i].rows = &rows;
+            tasks[i].first = (int)((int64)i * rows.rows / threads);
+            tasks[i].last = (int)((int64)(i + 1) * rows.rows / threads);
+            tasks[i].assign = assign.empty() ? NULL : &assign[0];
+            tasks[i].codes = rowCodes.empty() ? NULL : &rowCodes[0];
+        }
+        for (int i=1; i<threads; i++) {
+            pthread_create(&threadIds[i], NULL, encode, &tasks[i]);
+        }
+        if (rows.rows>0)
+            encode(&tasks[0]);
+        for (int i=1; i<threads; i++) {
+            pthread_join(threadIds[i], NULL);
+        }
+
+        for (int i=0; i<rows.rows; i++) {
+            listIds[assign[i]].push_back(firstRow + i);
+            listCodes[assign[i]].insert(listCodes[assign[i]].end(), rowCodes.begin() + (size_t)i * subquantizers, rowCodes.begin() + (size_t)(i + 1) * subquantizers);
+        }
+        rowCount += rows.rows;
+    }
+
+    //written under a temporary name and renamed, like the feature database
+    bool save(const char *path, uint64_t checksum) const
+    {
+        std::string temporaryPath = std::string(path) + ".tmp";
+        FILE *file = fopen(temporaryPath.c_str(), "wb");
+        if (!file) {
+            return false;
+        }
+
+        int lists = coarse.rows;
+        IvfPqHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, IVFPQ_INDEX_MAGIC, sizeof(header.magic));
+        header.version = IVFPQ_INDEX_VERSION;
+        header.dim = dim;
+        header.lists = lists;
+        header.subquantizers = subquantizers;
+        header.rows = rowCount;
+        header.checksum = checksum;
+        header.coarseOffset = IVFPQ_HEADER_SIZE;
+        header.codebookOffset = header.coarseOffset + (uint64_t)lists * dim * sizeof(float);
+        header.listOffset = header.codebookOffset + (uint64_t)codebooks.rows * codebooks.cols * sizeof(float);
+        header.listOffset += (sizeof(uint64_t) - header.listOffset % sizeof(uint64_t)) % sizeof(uint64_t);
+        header.idOffset = header.listOffset + (lists + 1) * sizeof(uint64_t);
+        header.codeOffset = header.idOffset + rowCount * sizeof(int32_t);
+        header.fileSize = header.codeOffset + rowCount * subquantizers;
+
+        char headerBlock[IVFPQ_HEADER_SIZE] = {0};
+        memcpy(headerBlock, &header, sizeof(header));
+        bool ok = fwrite(headerBlock, 1, sizeof(headerBlock), file)==sizeof(headerBlock);
+        for (int i=0; ok && i<lists; i++) {
+            ok = fwrite(coarse.ptr<float>(i), sizeof(float), dim, file)==(size_t)dim;
+        }
+        for (int i=0; ok && i<codebooks.rows; i++) {
+            ok = fwrite(codebooks.ptr<float>(i), sizeof(float), codebooks.cols, file)==(size_t)codebooks.cols;
+        }
+        static const char zeros[sizeof(uint64_t)] = {0};
+        size_t padding = header.listOffset - header.codebookOffset - (uint64_t)codebooks.rows * codebooks.cols * sizeof(float);
+        ok = ok && fwrite(zeros, 1, padding, file)==padding;
+
+        uint64_t start = 0;
+        for (int i=0; ok && i<=lists; i++) {
+            ok = fwrite(&start, sizeof(start), 1, file)==1;
+            if (i<lists)
+                start += listIds[i].size();
+        }
+        for (int i=0; ok && i<lists; i++) {
+            ok = listIds[i].empty() || fwrite(&listIds[i][0], sizeof(int32_t), listIds[i].size(), file)==listIds[i].size();
+        }
+        for (int i=0; ok && i<lists; i++) {
+            ok = listCodes[i].empty() || fwrite(&listCodes[i][0], 1, listCodes[i].size(), file)==listCodes[i].size();
+        }
+
+        ok = (fclose(file)==0) && ok;
+        ok = ok && rename(temporaryPath.c_str(), path)==0;
+        if (!ok) {
+            unlink(temporaryPath.c_str());
+        }
+        return ok;
+    }
+
+    //maps an index file; fails when it was not built from the database with this checksum
+    bool load(const char *path, uint64_t checksum)
+    {
+        close();
+
+        int fd = ::open(path, O_RDONLY);
+        if (fd<0) {
+            return false;
+        }
+        struct stat buf;
+        if (fstat(fd, &buf)!=0 || (size_t)buf.st_size<IVFPQ_HEADER_SIZE) {
+            ::close(fd);
+            return false;
+        }
+        mappingSize = buf.st_size;
+        mapping = mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping==MAP_FAILED) {
+            mapping = NULL;
+            mappingSize = 0;
+            return false;
+        }
+
+        const char *base = (const char *)mapping;
+        IvfPqHeader header;
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, IVFPQ_INDEX_MAGIC, sizeof(header.magic))!=0 || header.version!=IVFPQ_INDEX_VERSION || header.fileSize>mappingSize || header.checksum!=checksum || header.subquantizers==0 || header.dim % header.subquantizers!=0) {
+            close();
+            return false;
+        }
+
+        //the tables follow each other and end inside the file, like in FeatureDatabase::open
+        uint64_t size = header.fileSize;
+        uint64_t sub = header.dim / header.subquantizers;
+        if (header.lists==0 || header.dim>INT_MAX / IVFPQ_CENTROIDS || header.rows>INT_MAX || header.coarseOffset<IVFPQ_HEADER_SIZE
+            || !featureRangeInFile(header.coarseOffset, (uint64_t)header.lists * header.dim, sizeof(float), header.codebookOffset)
+            || !featureRangeInFile(header.codebookOffset, (uint64_t)header.subquantizers * IVFPQ_CENTROIDS * sub, sizeof(float), header.listOffset)
+            || !featureRangeInFile(header.listOffset, (uint64_t)header.lists + 1, sizeof(uint64_t), header.idOffset)
+            || !featureRangeInFile(header.idOffset, header.rows, sizeof(int32_t), header.codeOffset)
+            || !featureRangeInFile(header.codeOffset, header.rows, header.subquantizers, size)
+            || header.listOffset % sizeof(uint64_t) || header.idOffset % sizeof(int32_t)) {
+            close();
+            return false;
+        }
+        const uint64_t *listStarts = (const uint64_t *)(base + header.listOffset);
+        for (uint32_t i=0; i<header.lists; i++) {
+            if (listStarts[i]>listStarts[i + 1]) {
+                close();
+                return false;
+            }
+        }
+        if (listStarts[0]!=0 || listStarts[header.lists]!=header.rows) {
+            close();
+            return false;
+        }
+        //ids are database rows, which the index covers all of; searches hand them on as they are
+        const int32_t *idTable = (const int32_t *)(base + header.idOffset);
+        for (uint64_t e=0; e<header.rows; e++) {
+            if (idTable[e]<0 || (uint64_t)idTable[e]>=header.rows) {
+                close();
+                return false;
+            }
+        }
+
+        dim = header.dim;
+        subquantizers = header.subquantizers;
+        rowCount = header.rows;
+        coarse = cv::Mat(header.lists, dim, CV_32F, (void *)(base + header.coarseOffset));
+        codebooks = cv::Mat(subquantizers * IVFPQ_CENTROIDS, dim / subquantizers, CV_32F, (void *)(base + header.codebookOffset));
+        starts = (const uint64_t *)(base + header.listOffset);
+        ids = (const int32_t *)(base + header.idOffset);
+        codes = (const uchar *)(base + header.codeOffset);
+        return true;
+    }
+
+    void close()
+    {
+        coarse.release();
+        codebooks.release();
+        listIds.clear();
+        listCodes.clear();
+        dim = subquantizers = 0;
+        rowCount = 0;
+        starts = NULL;
+        ids = NULL;
+        codes = NULL;
+        if (mapping) {
+            munmap(mapping, mappingSize);
+            mapping = NULL;
+            mappingSize = 0;
+        }
+    }
+
+    //same outputs as flann::Index::knnSearch under L2, the distances are estimated from the codes;
+    //only a loaded index can be searched
+    void knnSearch(const cv::Mat &queries, cv::Mat &indices, cv::Mat &dists, int knn, int nprobe) const
+    {
+        indices.create(queries.rows, knn, CV_32S);
+        dists.create(queries.rows, knn, CV_32F);
+        indices.setTo(cv::Scalar(-1));
+        dists.setTo(cv::Scalar(FLT_MAX));
+
+        int lists = coarse.rows;
+        int sub = dim / subquantizers;
+        nprobe = std::max(1, std::min(nprobe, lists));
+        cv::vector<std::pair<float, int> > nearest(lists);
+        cv::vector<float> residual(dim);
+        cv::vector<float> table((size_t)subquantizers * IVFPQ_CENTROIDS);
+
+        for (int i=0; i<queries.rows; i++) {
+            const float *query = queries.ptr<float>(i);
+            int *rowIndices = indices.ptr<int>(i);
+            float *rowDists = dists.ptr<float>(i);
+            for (int c=0; c<lists; c++) {
+                nearest[c] = std::make_pair(floatSquaredDistance(query, coarse.ptr<float>(c), dim), c);
+            }
+            std::partial_sort(nearest.begin(), nearest.begin() + nprobe, nearest.end());
+
+            for (int p=0; p<nprobe; p++) {
+                int c = nearest[p].second;
+                const float *centroid = coarse.ptr<float>(c);
+                for (int j=0; j<dim; j++)
+                    residual[j] = query[j] - centroid[j];
+                for (int m=0; m<subquantizers; m++) {
+                    for (int j=0; j<IVFPQ_CENTROIDS; j++)
+                        table[m * IVFPQ_CENTROIDS + j] = floatSquaredDistance(&residual[m * sub], codebooks.ptr<float>(m * IVFPQ_CENTROIDS + j), sub);
+                }
+
+                for (uint64_t e=starts[c]; e<starts[c + 1]; e++) {
+                    const uchar *code = codes + e * subquantizers;
+                    float dist = 0;
+                    for (int m=0; m<subquantizers; m++)
+                        dist += table[m * IVFPQ_CENTROIDS + code[m]];
+                    insertNeighbor(rowIndices, rowDists, knn, ids[e], dist);
+                }
+            }
+        }
+    }
+
+private:
+    struct EncodeTask {
+        const IvfPqIndex *index;
+        const cv::Mat *rows;
+        int first;
+        int last;
+        int *assign;
+        uchar *codes;
+    };
+
+    int dim;
+    int subquantizers;
+    uint64_t rowCount;
+    cv::Mat coarse;
+    cv::Mat codebooks;
+    cv::vector<cv::vector<int32_t> > listIds;   //lists being built
+    cv::vector<cv::vector<uchar> > listCodes;
+    const uint64_t *starts;                     //lists of a loaded index
+    const int32_t *ids;
+    const uchar *codes;
+    void *mapping;
+    size_t mappingSize;
+
+    static int nearestRow(const cv::Mat &centers, int first, int count, const float *row, int size)
+    {
+        int result = 0;
+        float best = FLT_MAX;
+        for (int k=0; k<count; k++) {
+            float dist = floatSquaredDistance(row, centers.ptr<float>(first + k), size);
+            if (dist<best) {
+                best = dist;
+                result = k;
+            }
+        }
+        return result;
+    }
+
+    static void *encode(void *arg)
+    {
+        EncodeTask *task = (EncodeTask *)arg;
+        const IvfPqIndex *index = task->index;
+        int dim = index->dim;
+        int sub = dim / index->subquantizers;
+        cv::vector<float> residual(dim);
+        for (int i=task->first; i<task->last; i++) {
+            const float *row = task->rows->ptr<float>(i);
+            int list = nearestRow(index->coarse, 0, index->coarse.rows, row, dim);
+            const float *centroid = index->coarse.ptr<float>(list);
+            for (int j=0; j<dim; j++)
+                residual[j] = row[j] - centroid[j];
+            task->assign[i] = list;
+            for (int m=0; m<index->subquantizers; m++)
+                task->codes[(size_t)i * index->subquantizers + m] = (uchar)nearestRow(index->codebooks, m * IVFPQ_CENTROIDS, IVFPQ_CENTROIDS, &residual[m * sub], sub);
+        }
+        return NULL;
+    }
+
+    IvfPqIndex(const IvfPqIndex &);
+    IvfPqIndex &operator=(const IvfPqIndex &);
+};
+
+#endif
@@ -0,0 +1,190 @@
+//
+//  minibatch_kmeans.h
+//  opencv-commandline
+//
+//  Mini-batch k-means (Sculley, "Web-scale k-means clustering") for vocabularies too large
+//  to train with BOWKMeansTrainer. Descriptors are kept in a fixed size reservoir sample of
+//  the feature stream; every iteration assigns a random batch of the sample to its nearest
+//  centers on several threads and moves each center towards its descriptors with a per
+//  center learning rate. Training stops when the smoothed batch distortion has not improved
+//  for MINIBATCH_PATIENCE iterations. Centers start from k-means++ on a subset of the sample,
+//  or from an existing vocabulary.
+//
+
+#ifndef OPENCV_COMMANDLINE_MINIBATCH_KMEANS_H
+#define OPENCV_COMMANDLINE_MINIBATCH_KMEANS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <algorithm>
+
+#include "opencv2/core/core.hpp"
+
+#include "exact_search.h"
+
+static const int MINIBATCH_SAMPLE_DEFAULT = 1000000;
+static const int MINIBATCH_BATCH_DEFAULT = 10000;
+static const int MINIBATCH_MAX_ITERATIONS = 1000;
+static const int MINIBATCH_PATIENCE = 10;
+static const int MINIBATCH_INIT_ROWS_PER_CLUSTER = 3;
+static const uint64 MINIBATCH_SEED = 0x12345678;
+
+//uniform sample of a stream of descriptor rows, converted to CV_32F; the same rows are kept for the same stream
+class FeatureReservoir {
+public:
+    FeatureReservoir(int capacity) : capacity(capacity), seen(0), rng(MINIBATCH_SEED) {}
+
+    void add(const cv::Mat &descriptors)
+    {
+        cv::Mat rows = descriptors;
+        if (rows.type()!=CV_32F)
+            descriptors.convertTo(rows, CV_32F);
+        for (int i=0; i<rows.rows; i++, seen++) {
+            if (samples.rows<capacity) {
+                samples.push_back(rows.row(i));
+                continue;
+            }
+            uint64 k = (((uint64)rng.next() << 32) | rng.next()) % (seen + 1);
+            if (k<(uint64)capacity)
+                rows.row(i).copyTo(samples.row((int)k));
+        }
+    }
+
+    const cv::Mat &sample() const { return samples; }
+    uint64 total() const { return seen; }
+
+private:
+    int capacity;
+    uint64 seen;
+    cv::Mat samples;
+    cv::RNG rng;
+};
+
+struct NearestCenterTask {
+    const cv::Mat *centers;
+    cv::Mat samples;
+    cv::Mat labels;
+    cv::Mat dists;
+};
+
+inline void *assignNearestCenters(void *arg)
+{
+    NearestCenterTask *task = (NearestCenterTask *)arg;
+    exactKnnSearch(*task->centers, task->samples, task->labels, task->dists, 1);
+    return NULL;
+}
+
+//nearest center and squared distance of every CV_32F sample, split over threads
+inline void nearestCenters(const cv::Mat &centers, const cv::Mat &samples, cv::Mat &labels, cv::Mat &dists, int threads)
+{
+    labels.create(samples.rows, 1, CV_32S);
+    dists.create(samples.rows, 1, CV_32F);
+    threads = std::max(1, std::min(threads, samples.rows));
+
+    cv::vector<NearestCenterTask> tasks(threads);
+    cv::vector<pthread_t> threadIds(threads);
+    for (int i=0; i<threads; i++) {
+        int first = (int)((int64)i * samples.rows / threads);
+        int last = (int)((int64)(i + 1) * samples.rows / threads);
+        tasks[i].centers = &centers;
+        tasks[i].samples = samples.rowRange(first, last);
+        tasks[i].labels = labels.rowRange(first, last);
+        tasks[i].dists = dists.rowRange(first, last);
+    }
+    for (int i=1; i<threads; i++) {
+        pthread_create(&threadIds[i], NULL, assignNearestCenters, &tasks[i]);
+    }
+    if (samples.rows>0)
+        assignNearestCenters(&tasks[0]);
+    for (int i=1; i<threads; i++) {
+        pthread_join(threadIds[i], NULL);
+    }
+}
+
+//mean squared distance of the samples to their nearest center, the measure both trainers minimize
+inline double quantizationDistortion(const cv::Mat &centers, const cv::Mat &samples, int threads)
+{
+    if (samples.empty())
+        return 0;
+    cv::Mat labels, dists;
+    nearestCenters(centers, samples, labels, dists, threads);
+    return cv::sum(dists)[0] / samples.rows;
+}
+
+class MiniBatchKMeans {
+public:
+    MiniBatchKMeans(int clusters, int batchSize, int threads) : clusters(clusters), batchSize(batchSize), threads(threads), iterationCount(0), convergedFlag(false), rng(MINIBATCH_SEED) {}
+
+    //warm start, a vocabulary with clusters rows of the descriptor size
+    void setInitialCenters(const cv::Mat &centers)
+    {
+        centers.convertTo(initialCenters, CV_32F);
+    }
+
+    //centers of CV_32F samples; the sample needs at least as many rows as there are clusters
+    cv::Mat cluster(const cv::Mat &samples)
+    {
+        cv::Mat centers;
+        if (!initialCenters.empty()) {
+            centers = initialCenters.clone();
+        }
+        else {
+            int initRows = std::min(samples.rows, std::max(clusters, clusters * MINIBATCH_INIT_ROWS_PER_CLUSTER));
+            cv::Mat subset(initRows, samples.cols, CV_32F), labels;
+            for (int i=0; i<initRows; i++)
+                samples.row(rng.uniform(0, samples.rows)).copyTo(subset.row(i));
+            cv::kmeans(subset, clusters, labels, cv::TermCriteria(cv::TermCriteria::COUNT, 1, 0), 1, cv::KMEANS_PP_CENTERS, centers);
+        }
+
+        cv::vector<int> counts(clusters, 0);
+        cv::Mat batch(std::min(batchSize, samples.rows), samples.cols, CV_32F);
+        cv::Mat labels, dists;
+        double smoothed = 0, best = 0;
+        double alpha = std::min(1.0, 2.0 * batch.rows / (samples.rows + 1));
+        int stale = 0;
+        convergedFlag = false;
+
+        for (iterationCount=0; iterationCount<MINIBATCH_MAX_ITERATIONS; ) {
+            for (int i=0; i<batch.rows; i++)
+                samples.row(rng.uniform(0, samples.rows)).copyTo(batch.row(i));
+            nearestCenters(centers, batch, labels, dists, threads);
+
+            //each center moves towards its descriptors with step 1 / (descriptors it has seen)
+            for (int i=0; i<batch.rows; i++) {
+                int c = labels.at<int>(i);
+                float eta = 1.0f / ++counts[c];
+                float *center = centers.ptr<float>(c);
+                const float *row = batch.ptr<float>(i);
+                for (int j=0; j<batch.cols; j++)
+                    center[j] += eta * (row[j] - center[j]);
+            }
+            iterationCount++;
+
+            double distortion = cv::sum(dists)[0] / batch.rows;
+            smoothed = iterationCount==1 ? distortion : smoothed * (1 - alpha) + distortion * alpha;
+            if (iterationCount==1 || smoothed<best) {
+                best = smoothed;
+                stale = 0;
+            }
+            else if (++stale>=MINIBATCH_PATIENCE) {
+                convergedFlag = true;
+                break;
+            }
+        }
+        return centers;
+    }
+
+    int iterations() const { return iterationCount; }
+    bool converged() const { return convergedFlag; }
+
+private:
+    int clusters;
+    int batchSize;
+    int threads;
+    int iterationCount;
+    bool convergedFlag;
+    cv::Mat initialCenters;
+    cv::RNG rng;
+};
+
+#endif
@@ -0,0 +1,396 @@
+//
+//  pipeline.h
+//  opencv-commandline
+//
+//  Staged image input shared by all tools: a scanner thread lists the directory, decoder
+//  threads read and decode files ahead of the workers, and the workers take decoded images
+//  with next(). Stages are connected by bounded queues, so a slow stage blocks the ones
+//  before it instead of letting them buffer the whole directory. Time spent blocked on a
+//  full or empty queue is added to the stage timer as "<queue> full" / "<queue> empty".
+//  An ordered pipeline also keeps decoders from running more than prefetch files ahead of the
+//  next one to return, so the images waiting to be reordered are bounded too ("reorder full").
+//
+
+#ifndef OPENCV_COMMANDLINE_PIPELINE_H
+#define OPENCV_COMMANDLINE_PIPELINE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <deque>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "stage_timer.h"
+#include "image_loader.h"
+
+static const int PIPELINE_DECODERS_DEFAULT = 2;
+static const int PIPELINE_PREFETCH_DEFAULT = 16;
+
+template <typename T>
+class BoundedQueue {
+public:
+    BoundedQueue(const char *name, size_t capacity, StageTimer *timer = NULL) : name(name), capacity(capacity ? capacity : 1), timer(timer), closed(false), pushes(0), depthSum(0), maxDepth(0), fullStalls(0), emptyStalls(0)
+    {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&notFull, NULL);
+        pthread_cond_init(&notEmpty, NULL);
+        fullStage = this->name + " full";
+        emptyStage = this->name + " empty";
+    }
+
+    ~BoundedQueue()
+    {
+        pthread_cond_destroy(&notEmpty);
+        pthread_cond_destroy(&notFull);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    //blocks while the queue is full, false once it is closed
+    bool push(const T &item)
+    {
+        pthread_mutex_lock(&mutex);
+        if (items.size()>=capacity && !closed) {
+            int64 tick = cv::getTickCount();
+            while (items.size()>=capacity && !closed)
+                pthread_cond_wait(&notFull, &mutex);
+            fullStalls++;
+            if (timer)
+                timer->add(fullStage.c_str(), elapsedMiliseconds(tick));
+        }
+        bool result = !closed;
+        if (result) {
+            items.push_back(item);
+            pushes++;
+            depthSum += items.size();
+            maxDepth = std::max(maxDepth, items.size());
+            pthread_cond_signal(&notEmpty);
+        }
+        pthread_mutex_unlock(&mutex);
+        return result;
+    }
+
+    //blocks while the queue is empty, false once it is closed and drained
+    bool pop(T &item)
+    {
+        pthread_mutex_lock(&mutex);
+        if (items.empty() && !closed) {
+            int64 tick = cv::getTickCount();
+            while (items.empty() && !closed)
+                pthread_cond_wait(&notEmpty, &mutex);
+            emptyStalls++;
+            if (timer)
+                timer->add(emptyStage.c_str(), elapsedMiliseconds(tick));
+        }
+        bool result = !items.empty();
+        if (result) {
+            item = items.front();
+            items.pop_front();
+            pthread_cond_signal(&notFull);
+        }
+        pthread_mutex_unlock(&mutex);
+        return result;
+    }
+
+    //no more pushes; waiting consumers drain what is left
+    void close()
+    {
+        pthread_mutex_lock(&mutex);
+        closed = true;
+        pthread_cond_broadcast(&notFull);
+        pthread_cond_broadcast(&notEmpty);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    //depth is sampled after every push
+    void report(std::ostream &out)
+    {
+        pthread_mutex_lock(&mutex);
+        out << std::left << std::setw(12) << name << std::right << std::setw(10) << capacity << std::setw(10) << pushes << std::setw(11) << (pushes ? (double)depthSum / pushes : 0.0) << std::setw(11) << maxDepth << std::setw(13) << fullStalls << std::setw(13) << emptyStalls << std::endl;
+        pthread_mutex_unlock(&mutex);
+    }
+
+private:
+    std::string name;
+    std::string fullStage;
+    std::string emptyStage;
+    size_t capacity;
+    StageTimer *timer;
+    std::deque<T> items;
+    bool closed;
+    size_t pushes;
+    size_t depthSum;
+    size_t maxDepth;
+    size_t fullStalls;
+    size_t emptyStalls;
+    pthread_mutex_t mutex;
+    pthread_cond_t notFull;
+    pthread_cond_t notEmpty;
+
+    BoundedQueue(const BoundedQueue &);
+    BoundedQueue &operator=(const BoundedQueue &);
+};
+
+//one file of the directory; index is its position in scan order, image is empty when it could not be decoded
+struct PipelineImage {
+    size_t index;
+    std::string filename;
+    cv::Mat encoded;  //file content, only kept when asked for
+    cv::Mat image;
+};
+
+class ImagePipeline {
+public:
+    //ordered makes next() return images in scan order, otherwise in the order they are decoded
+    ImagePipeline(int decoders, int prefetch, StageTimer *timer, bool ordered = false, bool keepEncoded = false, int flags = CV_LOAD_IMAGE_GRAYSCALE) :
+        paths("paths", prefetch, timer), images("images", prefetch, timer), decoderCount(decoders>0 ? decoders : 1), timer(timer), ordered(ordered), keepEncoded(keepEncoded), flags(flags), directoryName(NULL), listed(false), activeDecoders(0), scannedCount(0), nextIndex(0), window(prefetch>0 ? prefetch : 1), returned(0), stopping(false), started(false)
+    {
+        imageScale.maxSide = 0;
+        imageScale.scale = 0;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_mutex_init(&orderMutex, NULL);
+        pthread_cond_init(&windowMoved, NULL);
+    }
+
+    //size limit applied by the decoders, set before start
+    void setImageScale(const ImageScale &scale)
+    {
+        imageScale = scale;
+    }
+
+    ~ImagePipeline()
+    {
+        finish();
+        pthread_cond_destroy(&windowMoved);
+        pthread_mutex_destroy(&orderMutex);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    //regular files of the directory in readdir order, hidden files are skipped
+    void start(const char *directory)
+    {
+        directoryName = directory;
+        run();
+    }
+
+    //the given files instead of a directory scan
+    void start(const char *directory, const cv::vector<std::string> &files)
+    {
+        directoryName = directory;
+        filenames = files;
+        listed = true;
+        run();
+    }
+
+    //false when every file has been returned
+    bool next(PipelineImage &item)
+    {
+        if (!ordered) {
+            return images.pop(item);
+        }
+
+        pthread_mutex_lock(&orderMutex);
+        bool result = true;
+        std::map<size_t, PipelineImage>::iterator iter;
+        while ((iter = early.find(nextIndex))==early.end()) {
+            PipelineImage popped;
+            if (!images.pop(popped)) {
+                result = false;
+                break;
+            }
+            early[popped.index] = popped;
+        }
+        if (result) {
+            item = iter->second;
+            early.erase(iter);
+            nextIndex++;
+            pthread_mutex_lock(&mutex);
+            returned = nextIndex;
+            pthread_cond_broadcast(&windowMoved);
+            pthread_mutex_unlock(&mutex);
+        }
+        pthread_mutex_unlock(&orderMutex);
+        return result;
+    }
+
+    //waits for the scanner and the decoders, stops them early if the workers did not drain the pipeline
+    void finish()
+    {
+        if (!started)
+            return;
+        pthread_mutex_lock(&mutex);
+        stopping = true;
+        pthread_cond_broadcast(&windowMoved);
+        pthread_mutex_unlock(&mutex);
+        paths.close();
+        images.close();
+        pthread_join(scanner, NULL);
+        for (size_t i=0; i<decoders.size(); i++) {
+            pthread_join(decoders[i], NULL);
+        }
+        decoders.clear();
+        started = false;
+        stopping = false;
+    }
+
+    size_t scanned()
+    {
+        pthread_mutex_lock(&mutex);
+        size_t result = scannedCount;
+        pthread_mutex_unlock(&mutex);
+        return result;
+    }
+
+    void report(std::ostream &out)
+    {
+        out << std::endl << std::left << std::setw(12) << "queue" << std::right << std::setw(10) << "capacity" << std::setw(10) << "items" << std::setw(11) << "avg depth" << std::setw(11) << "max depth" << std::setw(13) << "full stalls" << std::setw(13) << "empty stalls" << std::endl;
+        std::streamsize precision = out.precision(2);
+        std::ios_base::fmtflags flags = out.setf(std::ios_base::fixed, std::ios_base::floatfield);
+        paths.report(out);
+        images.report(out);
+        out.precision(precision);
+        out.flags(flags);
+    }
+
+private:
+    BoundedQueue<std::pair<size_t, std::string> > paths;
+    BoundedQueue<PipelineImage> images;
+    int decoderCount;
+    StageTimer *timer;
+    bool ordered;
+    bool keepEncoded;
+    int flags;
+    ImageScale imageScale;
+    const char *directoryName;
+    cv::vector<std::string> filenames;
+    bool listed;
+    pthread_t scanner;
+    cv::vector<pthread_t> decoders;
+    int activeDecoders;
+    size_t scannedCount;
+    size_t nextIndex;
+    std::map<size_t, PipelineImage> early;
+    size_t window;
+    size_t returned;             //nextIndex as the decoders see it, guarded by mutex
+    bool stopping;
+    bool started;
+    pthread_mutex_t mutex;
+    pthread_mutex_t orderMutex;  //held by the consumer reordering, so it must not be taken by scanner or decoders
+    pthread_cond_t windowMoved;  //signaled with mutex when returned moves or the pipeline stops
+
+    void run()
+    {
+        started = true;
+        activeDecoders = decoderCount;
+        pthread_create(&scanner, NULL, scan, this);
+        decoders.resize(decoderCount);
+        for (int i=0; i<decoderCount; i++) {
+            pthread_create(&decoders[i], NULL, decode, this);
+        }
+    }
+
+    static void *scan(void *arg)
+    {
+        ImagePipeline *pipeline = (ImagePipeline *)arg;
+        size_t index = 0;
+        if (pipeline->listed) {
+            for (size_t i=0; i<pipeline->filenames.size(); i++) {
+                if (!pipeline->paths.push(std::make_pair(index++, pipeline->filenames[i])))
+                    break;
+            }
+        }
+        else {
+            DIR *dir = opendir(pipeline->directoryName);
+            struct dirent *ep;
+            char path[1000];
+            struct stat buf;
+            int64 tick = cv::getTickCount();
+            while (dir && (ep = readdir(dir))) {
+                if (strlen(ep->d_name)==0 || ep->d_name[0]=='.')
+                    continue;
+                snprintf(path, sizeof(path), "%s/%s", pipeline->directoryName, ep->d_name);
+                bool regular = lstat(path, &buf)==0 && S_ISREG(buf.st_mode);
+                if (pipeline->timer)
+                    pipeline->timer->add("scan", elapsedMiliseconds(tick));
+                if (regular && !pipeline->paths.push(std::make_pair(index++, std::string(ep->d_name))))
+                    break;
+                tick = cv::getTickCount();
+            }
+            if (dir)
+                closedir(dir);
+        }
+
+        pthread_mutex_lock(&pipeline->mutex);
+        pipeline->scannedCount = index;
+        pthread_mutex_unlock(&pipeline->mutex);
+        pipeline->paths.close();
+        return NULL;
+    }
+
+    //the file is read in one piece and decoded from memory, so the read is the only I/O of a decoder
+    static void *decode(void *arg)
+    {
+        ImagePipeline *pipeline = (ImagePipeline *)arg;
+        std::pair<size_t, std::string> path;
+        char fullPath[1000];
+        while (pipeline->paths.pop(path)) {
+            //ordered: the file that holds up the window is always decoded by a decoder that is not waiting here
+            if (pipeline->ordered && !pipeline->waitForWindow(path.first))
+                break;
+            PipelineImage item;
+            item.index = path.first;
+            item.filename = path.second;
+            snprintf(fullPath, sizeof(fullPath), "%s/%s", pipeline->directoryName, item.filename.c_str());
+
+            int64 tick = cv::getTickCount();
+            cv::Mat encoded = readEncodedImage(fullPath);
+            if (!encoded.empty()) {
+                item.image = decodeImage(encoded, pipeline->flags, pipeline->imageScale);
+            }
+            if (pipeline->keepEncoded) {
+                item.encoded = encoded;
+            }
+            if (pipeline->timer)
+                pipeline->timer->add("decode", elapsedMiliseconds(tick));
+
+            if (!pipeline->images.push(item))
+                break;
+        }
+
+        pthread_mutex_lock(&pipeline->mutex);
+        bool last = --pipeline->activeDecoders==0;
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (last)
+            pipeline->images.close();
+        return NULL;
+    }
+
+    //blocks while index is window or more files ahead of the next one returned, false once the pipeline stops
+    bool waitForWindow(size_t index)
+    {
+        pthread_mutex_lock(&mutex);
+        if (index>=returned + window && !stopping) {
+            int64 tick = cv::getTickCount();
+            while (index>=returned + window && !stopping)
+                pthread_cond_wait(&windowMoved, &mutex);
+            if (timer)
+                timer->add("reorder full", elapsedMiliseconds(tick));
+        }
+        bool result = !stopping;
+        pthread_mutex_unlock(&mutex);
+        return result;
+    }
+
+    ImagePipeline(const ImagePipeline &);
+    ImagePipeline &operator=(const ImagePipeline &);
+};
+
+#endif
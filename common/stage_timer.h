@@ -0,0 +1,149 @@
+//
+//  stage_timer.h
+//  opencv-commandline
+//
+//  Per-stage latency samples with percentile reporting, shared by all tools.
+//  Samples can be added from several threads. A timer with a window keeps only the last
+//  window samples of every stage for its percentiles, so a long running server does not grow
+//  without bound; count, total and max still cover every sample.
+//
+
+#ifndef OPENCV_COMMANDLINE_STAGE_TIMER_H
+#define OPENCV_COMMANDLINE_STAGE_TIMER_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+static const size_t STAGE_TIMER_WINDOW_DEFAULT = 100000;
+
+//miliseconds since tick, tick is moved to now so consecutive stages can be timed with one variable
+inline double elapsedMiliseconds(int64 &tick)
+{
+    int64 now = cv::getTickCount();
+    double result = 1000.0 * (now - tick) / cv::getTickFrequency();
+    tick = now;
+    return result;
+}
+
+class StageTimer {
+public:
+    //window 0 keeps every sample
+    StageTimer(size_t window = 0) : window(window) { pthread_mutex_init(&mutex, NULL); }
+    ~StageTimer() { pthread_mutex_destroy(&mutex); }
+
+    void add(const char *stage, double miliseconds)
+    {
+        pthread_mutex_lock(&mutex);
+        Stage &current = stages[stageIndex(stage)];
+        if (!window || current.samples.size()<window)
+            current.samples.push_back(miliseconds);
+        else
+            current.samples[current.count % window] = miliseconds;
+        current.count++;
+        current.total += miliseconds;
+        current.max = std::max(current.max, miliseconds);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    //stages are reported in the order they were first timed
+    void report(std::ostream &out)
+    {
+        pthread_mutex_lock(&mutex);
+        out << std::endl << std::left << std::setw(12) << "stage" << std::right << std::setw(10) << "count" << std::setw(14) << "total ms" << std::setw(11) << "p50 ms" << std::setw(11) << "p95 ms" << std::setw(11) << "p99 ms" << std::setw(11) << "max ms" << std::endl;
+        std::streamsize precision = out.precision(3);
+        std::ios_base::fmtflags flags = out.setf(std::ios_base::fixed, std::ios_base::floatfield);
+        for (size_t i=0; i<stages.size(); i++) {
+            Summary summary = summarize(stages[i]);
+            out << std::left << std::setw(12) << stages[i].name << std::right << std::setw(10) << summary.count << std::setw(14) << summary.total << std::setw(11) << summary.p50 << std::setw(11) << summary.p95 << std::setw(11) << summary.p99 << std::setw(11) << summary.max << std::endl;
+        }
+        out.precision(precision);
+        out.flags(flags);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    bool writeJSON(const char *path)
+    {
+        FILE *file = fopen(path, "w");
+        if (!file) {
+            return false;
+        }
+
+        pthread_mutex_lock(&mutex);
+        fprintf(file, "{\n  \"stages\": [");
+        for (size_t i=0; i<stages.size(); i++) {
+            Summary summary = summarize(stages[i]);
+            fprintf(file, "%s\n    {\"name\": \"%s\", \"count\": %zu, \"total_ms\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}", i ? "," : "", stages[i].name.c_str(), summary.count, summary.total, summary.p50, summary.p95, summary.p99, summary.max);
+        }
+        fprintf(file, "\n  ]\n}\n");
+        pthread_mutex_unlock(&mutex);
+
+        return fclose(file)==0;
+    }
+
+private:
+    struct Summary {
+        size_t count;
+        double total, p50, p95, p99, max;
+    };
+
+    struct Stage {
+        std::string name;
+        std::vector<double> samples;    //the last window samples, the oldest is overwritten first
+        size_t count;
+        double total;
+        double max;
+    };
+
+    size_t window;
+    std::vector<Stage> stages;
+    pthread_mutex_t mutex;
+
+    size_t stageIndex(const char *stage)
+    {
+        for (size_t i=0; i<stages.size(); i++) {
+            if (stages[i].name==stage) {
+                return i;
+            }
+        }
+        Stage added;
+        added.name = stage;
+        added.count = 0;
+        added.total = 0;
+        added.max = 0;
+        stages.push_back(added);
+        return stages.size() - 1;
+    }
+
+    //nearest-rank percentiles over the kept samples
+    static Summary summarize(const Stage &stage)
+    {
+        Summary summary = {stage.count, stage.total, 0, 0, 0, stage.max};
+        if (stage.samples.empty()) {
+            return summary;
+        }
+        std::vector<double> values(stage.samples);
+        std::sort(values.begin(), values.end());
+        summary.p50 = percentile(values, 50);
+        summary.p95 = percentile(values, 95);
+        summary.p99 = percentile(values, 99);
+        return summary;
+    }
+
+    static double percentile(const std::vector<double> &sorted, int percent)
+    {
+        size_t rank = (sorted.size() * percent + 99) / 100;
+        return sorted[rank ? rank - 1 : 0];
+    }
+
+    StageTimer(const StageTimer &);
+    StageTimer &operator=(const StageTimer &);
+};
+
+#endif
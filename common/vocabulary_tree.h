@@ -0,0 +1,210 @@
+//
+//  vocabulary_tree.h
+//  opencv-commandline
+//
+//  Hierarchical k-means vocabulary (Nister and Stewenius, "Scalable recognition with a
+//  vocabulary tree"). Every node splits its descriptors into branching children by k-means,
+//  down to depth levels; the leaves are the visual words. A descriptor is quantized by
+//  walking down from the root to the nearest child at every level, which costs
+//  branching * depth distances instead of one per word. Nodes with fewer descriptors than
+//  branching become leaves early, so a tree has at most branching^depth words.
+//
+//  Nodes are stored breadth first with the children of a node next to each other. The tree
+//  is written to the features file under VOCABULARY_TREE_KEY, in place of the flat
+//  "vocabulary" matrix, and its node tables to the binary BOW database (see bow_database.h).
+//
+
+#ifndef OPENCV_COMMANDLINE_VOCABULARY_TREE_H
+#define OPENCV_COMMANDLINE_VOCABULARY_TREE_H
+
+#include <float.h>
+#include <algorithm>
+#include <deque>
+
+#include "opencv2/core/core.hpp"
+
+#include "exact_search.h"
+#include "minibatch_kmeans.h"
+
+static const char* VOCABULARY_TREE_KEY = "vocabulary_tree";
+static const int VOCABULARY_TREE_BRANCHING_DEFAULT = 10;
+static const int VOCABULARY_TREE_DEPTH_DEFAULT = 5;
+static const int VOCABULARY_TREE_NODE_SAMPLE = 100;  //descriptors per child that k-means sees at a node
+static const int VOCABULARY_TREE_ITERATIONS = 10;
+
+class VocabularyTree {
+public:
+    VocabularyTree() : branching(0), depth(0), words(0), l2Distance(selectL2DistanceKernel()) {}
+
+    int wordCount() const { return words; }
+    int branchingFactor() const { return branching; }
+    int levels() const { return depth; }
+    int descriptorSize() const { return centers.cols; }
+    int nodeCount() const { return centers.rows; }
+    const cv::Mat &nodeCenters() const { return centers; }
+    const cv::vector<int> &nodeFirstChild() const { return firstChild; }
+    const cv::vector<int> &nodeWord() const { return word; }
+
+    //tree over CV_32F samples; children are assigned all descriptors of their parent on threads threads
+    void build(const cv::Mat &samples, int branchingFactor, int levels, int threads)
+    {
+        branching = branchingFactor;
+        depth = levels;
+        words = 0;
+        centers = cv::Mat::zeros(1, samples.cols, CV_32F);
+        firstChild.assign(1, -1);
+        word.assign(1, -1);
+
+        struct Pending {
+            int node;
+            int level;
+            cv::vector<int> rows;
+        };
+        std::deque<Pending> pending(1);
+        pending[0].node = 0;
+        pending[0].level = 0;
+        pending[0].rows.resize(samples.rows);
+        for (int i=0; i<samples.rows; i++)
+            pending[0].rows[i] = i;
+
+        cv::RNG rng(MINIBATCH_SEED);
+        cv::TermCriteria criteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, VOCABULARY_TREE_ITERATIONS, 1e-3);
+        while (!pending.empty()) {
+            Pending current;
+            std::swap(current, pending.front());
+            pending.pop_front();
+            int count = (int)current.rows.size();
+            if (current.level>=depth || count<branching) {
+                word[current.node] = words++;
+                continue;
+            }
+
+            //centers from a random subset, then every descriptor of the node goes to its nearest child
+            int subsetRows = std::min(count, branching * VOCABULARY_TREE_NODE_SAMPLE);
+            cv::Mat subset(subsetRows, samples.cols, CV_32F), labels, childCenters;
+            for (int i=0; i<subsetRows; i++) {
+                int k = subsetRows==count ? i : rng.uniform(0, count);
+                samples.row(current.rows[k]).copyTo(subset.row(i));
+            }
+            cv::kmeans(subset, branching, labels, criteria, 1, cv::KMEANS_PP_CENTERS, childCenters);
+
+            cv::Mat rows(count, samples.cols, CV_32F), dists;
+            for (int i=0; i<count; i++)
+                samples.row(current.rows[i]).copyTo(rows.row(i));
+            nearestCenters(childCenters, rows, labels, dists, threads);
+            rows.release();
+
+            int first = centers.rows;
+            firstChild[current.node] = first;
+            centers.push_back(childCenters);
+            firstChild.resize(centers.rows, -1);
+            word.resize(centers.rows, -1);
+
+            size_t start = pending.size();
+            pending.resize(start + branching);
+            for (int c=0; c<branching; c++) {
+                pending[start + c].node = first + c;
+                pending[start + c].level = current.level + 1;
+            }
+            for (int i=0; i<count; i++)
+                pending[start + labels.at<int>(i)].rows.push_back(current.rows[i]);
+        }
+    }
+
+    //word of one CV_32F descriptor
+    int quantize(const float *descriptor) const
+    {
+        int node = 0;
+        while (firstChild[node]>=0) {
+            int first = firstChild[node];
+            int best = first;
+            float bestDistance = FLT_MAX;
+            for (int c=first; c<first + branching; c++) {
+                float distance = l2Distance(descriptor, centers.ptr<float>(c), centers.cols);
+                if (distance<bestDistance) {
+                    bestDistance = distance;
+                    best = c;
+                }
+            }
+            node = best;
+        }
+        return word[node];
+    }
+
+    //normalized word histogram of an image like BOWImgDescriptorExtractor::compute, 1 x words CV_32F
+    void bowDescriptor(const cv::Mat &descriptors, cv::Mat &bow) const
+    {
+        bow = cv::Mat::zeros(1, words, CV_32F);
+        if (descriptors.empty())
+            return;
+        cv::Mat rows = descriptors;
+        if (rows.type()!=CV_32F)
+            descriptors.convertTo(rows, CV_32F);
+        float *histogram = bow.ptr<float>(0);
+        float weight = 1.0f / rows.rows;
+        for (int i=0; i<rows.rows; i++)
+            histogram[quantize(rows.ptr<float>(i))] += weight;
+    }
+
+    void write(cv::FileStorage &fs) const
+    {
+        fs << VOCABULARY_TREE_KEY << "{";
+        fs << "branching" << branching;
+        fs << "depth" << depth;
+        fs << "words" << words;
+        fs << "centers" << centers;
+        fs << "first_child" << firstChild;
+        fs << "word" << word;
+        fs << "}";
+    }
+
+    //false when the file holds no tree, or one whose node tables do not agree
+    bool read(const cv::FileStorage &fs)
+    {
+        cv::FileNode node = fs[VOCABULARY_TREE_KEY];
+        if (node.empty()) {
+            return false;
+        }
+        int treeBranching, treeDepth, treeWords;
+        cv::Mat treeCenters;
+        cv::vector<int> treeFirstChild, treeWord;
+        node["branching"] >> treeBranching;
+        node["depth"] >> treeDepth;
+        node["words"] >> treeWords;
+        node["centers"] >> treeCenters;
+        node["first_child"] >> treeFirstChild;
+        node["word"] >> treeWord;
+        return set(treeBranching, treeDepth, treeWords, treeCenters, treeFirstChild, treeWord);
+    }
+
+    //tree from the node tables of another store, like a BOW database; centers may point into a mapping. False
+    //when the tables do not agree: children come after their parent, so quantize always reaches a leaf
+    bool set(int treeBranching, int treeDepth, int treeWords, const cv::Mat &treeCenters, const cv::vector<int> &treeFirstChild, const cv::vector<int> &treeWord)
+    {
+        branching = treeBranching;
+        depth = treeDepth;
+        words = treeWords;
+        centers = treeCenters;
+        firstChild = treeFirstChild;
+        word = treeWord;
+        if (centers.type()!=CV_32F || centers.rows==0 || firstChild.size()!=(size_t)centers.rows || word.size()!=(size_t)centers.rows || branching<=0 || words<=0) {
+            return false;
+        }
+        for (size_t i=0; i<firstChild.size(); i++) {
+            if (firstChild[i]>=0 ? (firstChild[i]<=(int)i || firstChild[i]>centers.rows - branching) : (word[i]<0 || word[i]>=words))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    int branching;
+    int depth;
+    int words;
+    cv::Mat centers;                //one row per node, the row of the root is unused
+    cv::vector<int> firstChild;     //per node, the first of its branching children, -1 for a leaf
+    cv::vector<int> word;           //per leaf, its word; -1 for inner nodes
+    L2DistanceKernel l2Distance;
+};
+
+#endif
@@ -13,6 +13,8 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <map>
 
 #include "opencv2/opencv.hpp"
 #include "opencv2/core/core.hpp"
@@ -20,22 +22,91 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/nonfree/nonfree.hpp"
 
+#include "../../common/feature_database.h"
+#include "../../common/feature_index.h"
+#include "../../common/feature_manifest.h"
+#include "../../common/feature_quantization.h"
+#include "../../common/feature_shards.h"
+#include "../../common/ivfpq_index.h"
+#include "../../common/stage_timer.h"
+#include "../../common/pipeline.h"
+#include "../../common/image_loader.h"
+
 using namespace std;
 using namespace cv;
 
-typedef enum {kLongOptionIndexNone, kLongOptionIndexDirectory, kLongOptionIndexDetector, kLongOptionIndexDetectorAdapter, kLongOptionIndexExtractor, kLongOptionIndexExtractorAdapter, kLongOptionIndexOutput} LongOptionIndex;
+typedef enum {kLongOptionIndexNone, kLongOptionIndexDirectory, kLongOptionIndexDetector, kLongOptionIndexDetectorAdapter, kLongOptionIndexExtractor, kLongOptionIndexExtractorAdapter, kLongOptionIndexOutput, kLongOptionIndexThreads, kLongOptionIndexBuildIndex, kLongOptionIndexIndex, kLongOptionIndexReport, kLongOptionIndexIncremental, kLongOptionIndexCompact, kLongOptionIndexMemoryBudget, kLongOptionIndexDecoders, kLongOptionIndexPrefetch, kLongOptionIndexMaxSide, kLongOptionIndexScale, kLongOptionIndexQuantize, kLongOptionIndexShards, kLongOptionIndexIvfPq, kLongOptionIndexIvfLists, kLongOptionIndexPqBytes, kLongOptionIndexTrainSample} LongOptionIndex;
 
 static const char* DETECTOR_ALGORITHMS[] = {"SURF","FAST","STAR","SIFT","ORB","BRISK","MSER","GFTT","HARRIS","Dense","SimpleBlob"};
 static const char* EXTRACTOR_ALGORITHMS[] = {"SURF","SIFT","BRIEF","BRISK","ORB","FREAK"};
-static const char* OUTPUT_DEFAULT = "output.yml";
+static const char* OUTPUT_DEFAULT = "output.fdb";
+static const char* YAML_EXTENSIONS[] = {".yml",".yaml",".xml",".yml.gz",".yaml.gz",".xml.gz"};
+static const int THREADS_DEFAULT = 1;
+static const int MEMORY_BUDGET_DEFAULT = 512;
+
+//work shared by all extraction threads; results are committed in directory order so the output does not depend
+//on scheduling, files finished ahead of that order wait in descriptors. pendingBytes counts those descriptors and
+//the decoded and encoded images the workers are extracting against memoryBudget; images still queued in the
+//pipeline are not counted, they are bounded by --prefetch instead
+struct ExtractionContext {
+    ImagePipeline *pipeline;
+    cv::vector<string> candidates;
+    cv::vector<ManifestEntry> entries;
+    cv::vector<Mat> descriptors;
+    cv::vector<bool> taken;
+    cv::vector<bool> loaded;
+    cv::vector<bool> done;
+    size_t committed;
+    size_t pendingBytes;
+    size_t memoryBudget;
+    bool failed;
+    cv::vector<Ptr<FeatureDatabaseWriter> > *writers;  //binary output, one per shard; NULL for YAML output
+    FeatureQuantizer *quantizer;    //binary output only
+    Mat *features;                  //YAML output is collected in memory
+    cv::vector<int> *indexes;
+    cv::vector<string> *filenames;
+    cv::vector<FeatureManifest> *manifests;  //one per shard
+    StageTimer *timer;
+    pthread_mutex_t mutex;
+    pthread_mutex_t commitMutex;    //held by the thread writing, so files reach the output one at a time
+    pthread_cond_t condition;       //signaled when a file is committed
+};
+
+struct ExtractionWorker {
+    ExtractionContext *context;
+    Ptr<FeatureDetector> detector;
+    Ptr<DescriptorExtractor> extractor;
+};
 
 const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *detectorAlgorithm);
 const Ptr<DescriptorExtractor> getExtractor(const char *extractorAdapter, const char *extractorAlgorithm);
+string algorithmType(const char *adapter, const char *algorithm);
+void *extractFeatures(void *arg);
+void commitFeatures(ExtractionContext *context);
+bool isYAMLOutput(const char *output);
 
 int main(int argc, char * const *argv)
 {
     const char *directoryName, *detectorAlgorithm, *detectorAdapter, *extractorAlgorithm, *extractorAdapter, *output;
+    const char *indexOutput = NULL;
+    const char *report = NULL;
+    const char *quantize = NULL;
     directoryName = detectorAlgorithm = detectorAdapter = extractorAlgorithm = extractorAdapter = output = NULL;
+    int threads = 0;
+    int memoryBudget = 0;
+    int decoders = 0;
+    int prefetch = 0;
+    int shards = 0;
+    int ivfLists = 0;
+    int pqBytes = 0;
+    int trainSample = 0;
+    ImageScale imageScale;
+    imageScale.maxSide = 0;
+    imageScale.scale = 0;
+    bool buildIndex = false;
+    bool incremental = false;
+    bool compact = false;
+    bool ivfpq = false;
     
     struct option longOptions[] = {
         {"directory", required_argument, 0, kLongOptionIndexDirectory},
@@ -44,6 +115,23 @@ int main(int argc, char * const *argv)
         {"extractor", required_argument, 0, kLongOptionIndexExtractor},
         {"extractor_adapter", required_argument, 0, kLongOptionIndexExtractorAdapter},
         {"output", required_argument, 0, kLongOptionIndexOutput},
+        {"threads", required_argument, 0, kLongOptionIndexThreads},
+        {"build_index", no_argument, 0, kLongOptionIndexBuildIndex},
+        {"index", required_argument, 0, kLongOptionIndexIndex},
+        {"report", required_argument, 0, kLongOptionIndexReport},
+        {"incremental", no_argument, 0, kLongOptionIndexIncremental},
+        {"compact", no_argument, 0, kLongOptionIndexCompact},
+        {"memory_budget", required_argument, 0, kLongOptionIndexMemoryBudget},
+        {"decoders", required_argument, 0, kLongOptionIndexDecoders},
+        {"prefetch", required_argument, 0, kLongOptionIndexPrefetch},
+        {"max_side", required_argument, 0, kLongOptionIndexMaxSide},
+        {"scale", required_argument, 0, kLongOptionIndexScale},
+        {"quantize", required_argument, 0, kLongOptionIndexQuantize},
+        {"shards", required_argument, 0, kLongOptionIndexShards},
+        {"ivfpq", no_argument, 0, kLongOptionIndexIvfPq},
+        {"ivf_lists", required_argument, 0, kLongOptionIndexIvfLists},
+        {"pq_bytes", required_argument, 0, kLongOptionIndexPqBytes},
+        {"train_sample", required_argument, 0, kLongOptionIndexTrainSample},
         {0, 0, 0, 0}
     };
     
@@ -74,12 +162,83 @@ int main(int argc, char * const *argv)
                 output = optarg;
                 break;
             }
+            case kLongOptionIndexThreads: {
+                threads = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexBuildIndex: {
+                buildIndex = true;
+                break;
+            }
+            case kLongOptionIndexIndex: {
+                indexOutput = optarg;
+                buildIndex = true;
+                break;
+            }
+            case kLongOptionIndexReport: {
+                report = optarg;
+                break;
+            }
+            case kLongOptionIndexIncremental: {
+                incremental = true;
+                break;
+            }
+            case kLongOptionIndexCompact: {
+                compact = true;
+                break;
+            }
+            case kLongOptionIndexMemoryBudget: {
+                memoryBudget = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexDecoders: {
+                decoders = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexPrefetch: {
+                prefetch = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexMaxSide: {
+                imageScale.maxSide = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexScale: {
+                imageScale.scale = atof(optarg);
+                break;
+            }
+            case kLongOptionIndexQuantize: {
+                quantize = optarg;
+                break;
+            }
+            case kLongOptionIndexShards: {
+                shards = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexIvfPq: {
+                ivfpq = true;
+                break;
+            }
+            case kLongOptionIndexIvfLists: {
+                ivfLists = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexPqBytes: {
+                pqBytes = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexTrainSample: {
+                trainSample = atoi(optarg);
+                break;
+            }
             default:
                 break;
         }
     }
     
-    if (!directoryName) {
+    //compact alone rewrites the existing database without looking at the images
+    bool compactOnly = compact && !incremental && !directoryName;
+    if (!directoryName && !compactOnly) {
         cout << "need input directory" << endl;
         return -1;
     }
@@ -99,78 +258,617 @@ int main(int argc, char * const *argv)
         output = OUTPUT_DEFAULT;
     }
     
-    DIR *dir;
-    dir = opendir(directoryName);
-    if (!dir) {
-        cout << "could not open image directory " << directoryName << endl;
+    if (threads<=0) {
+        cout << "use " << THREADS_DEFAULT << " as number of threads" << endl;
+        threads = THREADS_DEFAULT;
+    }
+    
+    if (memoryBudget<=0) {
+        cout << "use " << MEMORY_BUDGET_DEFAULT << " as memory budget in megabytes" << endl;
+        memoryBudget = MEMORY_BUDGET_DEFAULT;
+    }
+    
+    if (decoders<=0) {
+        cout << "use " << PIPELINE_DECODERS_DEFAULT << " as number of decoder threads" << endl;
+        decoders = PIPELINE_DECODERS_DEFAULT;
+    }
+    
+    if (prefetch<=0) {
+        cout << "use " << PIPELINE_PREFETCH_DEFAULT << " as number of prefetched images" << endl;
+        prefetch = PIPELINE_PREFETCH_DEFAULT;
+    }
+    
+    if (imageScale.maxSide<0 || imageScale.scale<0) {
+        cout << "max_side and scale must not be negative" << endl;
+        return -1;
+    }
+    
+    if (isImageScaled(imageScale)) {
+        cout << "shrink images to " << imageScaleString(imageScale) << endl;
+    }
+    
+    uint32_t quantization = FEATURE_QUANTIZATION_NONE;
+    if (quantize && !parseFeatureQuantization(quantize, quantization)) {
+        cout << "unknown quantization " << quantize << ", use none, fp16 or int8" << endl;
+        return -1;
+    }
+    
+    string indexPath = indexOutput ? string(indexOutput) : featureIndexPath(output);
+    string manifestPath = featureManifestPath(output);
+    bool yaml = isYAMLOutput(output);
+    
+    if (yaml && quantization!=FEATURE_QUANTIZATION_NONE) {
+        cout << "quantized descriptors need a binary output file" << endl;
+        return -1;
+    }
+    FeatureQuantizer quantizer(quantization);
+    
+    if (shards<=0) {
+        shards = 1;
+    }
+    if (shards>1 && yaml) {
+        cout << "sharded output needs a binary output file" << endl;
+        return -1;
+    }
+    if (shards>1 && (incremental || compact)) {
+        cout << "incremental update and compaction do not support sharded output" << endl;
         return -1;
     }
     
-    struct dirent *ep;
-    char *filename;
+    if (ivfpq && yaml) {
+        cout << "IVF-PQ index needs a binary output file" << endl;
+        return -1;
+    }
+    if (ivfpq && ivfLists<=0) {
+        cout << "use " << IVFPQ_LISTS_DEFAULT << " as number of IVF lists" << endl;
+        ivfLists = IVFPQ_LISTS_DEFAULT;
+    }
+    if (ivfpq && pqBytes<=0) {
+        cout << "use " << IVFPQ_CODE_SIZE_DEFAULT << " as PQ code size in bytes" << endl;
+        pqBytes = IVFPQ_CODE_SIZE_DEFAULT;
+    }
+    if (ivfpq && trainSample<=0) {
+        cout << "use " << IVFPQ_TRAIN_SAMPLE_DEFAULT << " as number of IVF-PQ training descriptors" << endl;
+        trainSample = IVFPQ_TRAIN_SAMPLE_DEFAULT;
+    }
+    
+    FeatureManifest manifest;
+    manifest.detectorType = algorithmType(detectorAdapter, detectorAlgorithm);
+    manifest.extractorType = algorithmType(extractorAdapter, extractorAlgorithm);
+    manifest.imageScale = imageScaleString(imageScale);
+    
+    //int8 scale from the range the extractor produces, so later images are not clipped to the range of the first
+    double lowestValue = 0, highestValue = 0;
+    if (quantization==FEATURE_QUANTIZATION_INT8 && knownFeatureRange(manifest.extractorType, lowestValue, highestValue)) {
+        quantizer.setRange(lowestValue, highestValue);
+    }
+    
+    //the previous database stays mapped while the new one is written next to it
+    FeatureDatabase previous;
+    FeatureManifest previousManifest;
+    cv::vector<unsigned char> previousFlags;
+    bool update = false;
+    
+    StageTimer timer;
+    int64 tick = getTickCount();
+    
+    if ((incremental || compactOnly) && yaml) {
+        cout << "incremental update and compaction need a binary output file" << endl;
+        if (compactOnly)
+            return -1;
+    }
+    else if (incremental || compactOnly) {
+        if (!previous.open(output)) {
+            cout << "could not open output file " << output << ", rebuild everything" << endl;
+        }
+        else if (!loadFeatureManifest(manifestPath.c_str(), previousManifest) || !isFeatureManifestOf(previousManifest, previous)) {
+            cout << "manifest " << manifestPath << " does not match output file, rebuild everything" << endl;
+            previous.close();
+        }
+        else if (!compactOnly && (previousManifest.detectorType!=manifest.detectorType || previousManifest.extractorType!=manifest.extractorType || previousManifest.imageScale!=manifest.imageScale)) {
+            cout << "output file was built with " << previousManifest.detectorType << "/" << previousManifest.extractorType << " " << previousManifest.imageScale << ", rebuild everything" << endl;
+            previous.close();
+        }
+        else if (!compactOnly && previous.quantization.method!=quantization) {
+            cout << "output file stores " << featureQuantizationName(previous.quantization.method) << " descriptors, rebuild everything" << endl;
+            previous.close();
+        }
+        else {
+            //previous rows are copied as they are stored, new ones have to be quantized the same way
+            quantizer.setParameters(previous.quantization);
+            previousFlags = previous.flags;
+            if (compactOnly) {
+                manifest.detectorType = previousManifest.detectorType;
+                manifest.extractorType = previousManifest.extractorType;
+                manifest.imageScale = previousManifest.imageScale;
+            }
+            update = true;
+        }
+        if (compactOnly && !update)
+            return -1;
+        timer.add("load", elapsedMiliseconds(tick));
+    }
+    
     char path[1000];
-    struct stat buf;
+    cv::vector<ManifestEntry> scanned;
+    if (directoryName) {
+        DIR *dir;
+        dir = opendir(directoryName);
+        if (!dir) {
+            cout << "could not open image directory " << directoryName << endl;
+            return -1;
+        }
+        
+        struct dirent *ep;
+        char *filename;
+        struct stat buf;
+        
+        while ((ep = readdir(dir))) {
+            filename = ep->d_name;
+            if(strlen(filename)==0 || filename[0]=='.')
+                continue;
+            
+            sprintf(path, "%s/%s", directoryName, filename);
+            
+            lstat(path, &buf);
+            if (S_ISREG(buf.st_mode)) {
+                ManifestEntry entry = {filename, (int64)buf.st_size, (int64)buf.st_mtime, 0, -1, 0, 0};
+                scanned.push_back(entry);
+            }
+            timer.add("scan", elapsedMiliseconds(tick));
+        }
+        closedir(dir);
+    }
     
-    Ptr<FeatureDetector> detector = getDetector(detectorAdapter, detectorAlgorithm);
-    Ptr<DescriptorExtractor> extractor = getExtractor(extractorAdapter, extractorAlgorithm);
-    cv::vector<KeyPoint> keypoints;
-    Mat image;
-    Mat descriptors;
     Mat features;
     cv::vector<int> indexes;
     cv::vector<string> filenames;
-    int k = 0;
-    KeyPoint keypoint;
-    keypoint.
     
-    cout << "building..." << endl;
+    //shard files are named after the output file, which becomes the list of shards
+    cv::vector<string> shardPaths;
+    cv::vector<Ptr<FeatureDatabaseWriter> > writers;
+    for (int i=0; i<shards; i++) {
+        shardPaths.push_back(shards>1 ? featureShardPath(output, i) : string(output));
+        if (!yaml)
+            writers.push_back(Ptr<FeatureDatabaseWriter>(new FeatureDatabaseWriter()));
+    }
     
-    double t = (double)getTickCount();
+    ExtractionContext context;
+    context.pipeline = NULL;
+    context.committed = 0;
+    context.pendingBytes = 0;
+    context.memoryBudget = (size_t)memoryBudget << 20;
+    context.failed = false;
+    context.writers = yaml ? NULL : &writers;
+    context.quantizer = yaml ? NULL : &quantizer;
+    context.features = &features;
+    context.indexes = &indexes;
+    context.filenames = &filenames;
+    context.timer = &timer;
     
-    while ((ep = readdir(dir))) {
-    	filename = ep->d_name;
-        if(strlen(filename)==0 || filename[0]=='.')
-        	continue;
+    size_t unchanged = 0, changed = 0, removed = 0;
+    if (update && !compactOnly) {
+        //an unchanged file keeps its rows; a changed or deleted one becomes a tombstone and changed files are extracted again
+        std::map<string, size_t> known;
+        for (size_t j=0; j<previousManifest.entries.size(); j++) {
+            known[previousManifest.entries[j].filename] = j;
+        }
         
-        sprintf(path, "%s/%s", directoryName, filename);
+        cv::vector<bool> seen(previousManifest.entries.size(), false);
+        cv::vector<uchar> buffer;
+        for (size_t i=0; i<scanned.size(); i++) {
+            std::map<string, size_t>::const_iterator iter = known.find(scanned[i].filename);
+            if (iter!=known.end()) {
+                ManifestEntry entry = previousManifest.entries[iter->second];
+                seen[iter->second] = true;
+                
+                //only a touched file is read, its content decides
+                bool same = entry.size==scanned[i].size && entry.mtime==scanned[i].mtime;
+                if (!same && entry.size==scanned[i].size) {
+                    sprintf(path, "%s/%s", directoryName, scanned[i].filename.c_str());
+                    uint64_t hash;
+                    same = readFileHash(path, buffer, hash) && hash==entry.hash;
+                }
+                if (same) {
+                    entry.mtime = scanned[i].mtime;
+                    manifest.entries.push_back(entry);
+                    unchanged++;
+                    continue;
+                }
+                previousFlags[entry.image] |= FEATURE_IMAGE_DELETED;
+                changed++;
+            }
+            context.candidates.push_back(scanned[i].filename);
+            context.entries.push_back(scanned[i]);
+        }
         
-        lstat(path, &buf);
-        if (S_ISREG(buf.st_mode)) {
-        	image = imread(path, CV_LOAD_IMAGE_GRAYSCALE);
-        	if (image.data) {
-                cout << "File " << filename << "...";
-        		detector->detect(image, keypoints);
-        		extractor->compute(image, keypoints, descriptors);
-             	features.push_back(descriptors);
-                filenames.push_back(filename);
-                indexes.push_back(k);
-                k += descriptors.rows;
-                cout << " done" << endl;
+        for (size_t j=0; j<seen.size(); j++) {
+            if (!seen[j]) {
+                previousFlags[previousManifest.entries[j].image] |= FEATURE_IMAGE_DELETED;
+                removed++;
+            }
+        }
+        timer.add("scan", elapsedMiliseconds(tick));
+    }
+    else if (compactOnly) {
+        manifest.entries = previousManifest.entries;
+    }
+    else {
+        for (size_t i=0; i<scanned.size(); i++) {
+            context.candidates.push_back(scanned[i].filename);
+            context.entries.push_back(scanned[i]);
+        }
+    }
+    
+    for (size_t i=0; i<writers.size(); i++) {
+        if (!writers[i]->open(shardPaths[i].c_str())) {
+            cout << "could not write output file " << shardPaths[i] << endl;
+            return -1;
+        }
+    }
+    
+    cout << "building..." << endl;
+    
+    double t = (double)getTickCount();
+    
+    size_t dropped = 0;
+    if (update) {
+        //rows of the previous database are copied from its mapping, deleted images are left out when compacting
+        tick = getTickCount();
+        cv::vector<int> images(previous.indexes.size(), -1);
+        cv::vector<int> firsts(previous.indexes.size(), 0);
+        for (size_t i=0; i<previous.indexes.size(); i++) {
+            if (compact && (previousFlags[i] & FEATURE_IMAGE_DELETED)) {
+                dropped++;
+                continue;
             }
+            int end = i+1<previous.indexes.size() ? previous.indexes[i+1] : previous.features.rows;
+            images[i] = (int)writers[0]->imageCount();
+            firsts[i] = (int)writers[0]->rowCount();
+            if (!writers[0]->add(previous.filenames[i], previous.features.rowRange(previous.indexes[i], end), previousFlags[i])) {
+                cout << "could not write output file " << output << endl;
+                return -1;
+            }
+        }
+        
+        //only images still present are in the manifest, none of them was dropped
+        for (size_t j=0; j<manifest.entries.size(); j++) {
+            ManifestEntry &entry = manifest.entries[j];
+            entry.first = firsts[entry.image];
+            entry.image = images[entry.image];
         }
+        timer.add("serialize", elapsedMiliseconds(tick));
+    }
+    
+    //an update is never sharded, so the entries kept from the previous manifest belong to the only shard
+    cv::vector<FeatureManifest> manifests(shards, manifest);
+    for (int i=1; i<shards; i++) {
+        manifests[i].entries.clear();
+    }
+    context.manifests = &manifests;
+    
+    cv::vector<ExtractionWorker> workers(compactOnly ? 0 : threads);
+    for (size_t i=0; i<workers.size(); i++) {
+        workers[i].context = &context;
+        workers[i].detector = getDetector(detectorAdapter, detectorAlgorithm);
+        workers[i].extractor = getExtractor(extractorAdapter, extractorAlgorithm);
+    }
+    
+    context.descriptors.resize(context.candidates.size());
+    context.taken.resize(context.candidates.size(), false);
+    context.loaded.resize(context.candidates.size(), false);
+    context.done.resize(context.candidates.size(), false);
+    pthread_mutex_init(&context.mutex, NULL);
+    pthread_mutex_init(&context.commitMutex, NULL);
+    pthread_cond_init(&context.condition, NULL);
+    
+    //the file content is kept for the manifest hash
+    ImagePipeline pipeline(decoders, prefetch, &timer, false, true);
+    context.pipeline = &pipeline;
+    pipeline.setImageScale(imageScale);
+    if (!workers.empty())
+        pipeline.start(directoryName, context.candidates);
+    
+    cv::vector<pthread_t> threadIds(workers.size());
+    for (size_t i=1; i<workers.size(); i++) {
+        pthread_create(&threadIds[i], NULL, extractFeatures, &workers[i]);
+    }
+    if (!workers.empty())
+        extractFeatures(&workers[0]);
+    for (size_t i=1; i<workers.size(); i++) {
+        pthread_join(threadIds[i], NULL);
+    }
+    pipeline.finish();
+    pthread_cond_destroy(&context.condition);
+    pthread_mutex_destroy(&context.commitMutex);
+    pthread_mutex_destroy(&context.mutex);
+    
+    if (context.failed && quantizer.clipLimitExceeded()) {
+        cout << "int8 quantization clipped " << quantizer.clippedCount() << " values, the descriptors exceed the range of the first image; use fp16" << endl;
+        return -1;
+    }
+    if (context.failed) {
+        cout << "could not write output file " << output << endl;
+        return -1;
+    }
+    
+    if (update && !compactOnly) {
+        cout << unchanged << " unchanged, " << manifests[0].entries.size() - unchanged << " extracted, " << changed << " changed, " << removed << " removed" << endl;
+    }
+    if (update && compact) {
+        cout << "compacted " << dropped << " deleted images" << endl;
     }
-    closedir(dir);
     
     t = 1000 * (((double)getTickCount() - t) / getTickFrequency());
 	cout << endl << "Time passed in miliseconds: " << t << endl;
     
     cout << "write to output file " << output << "...";
-    FileStorage fsOutput(output, FileStorage::WRITE);
-    fsOutput << "features" << features;
-    fsOutput << "filenames" << filenames;
-    fsOutput << "indexes" << indexes;
+    tick = getTickCount();
+    cv::vector<uint64_t> checksums(shards);
+    if (yaml) {
+        checksums[0] = featureChecksum(features);
+        FileStorage fsOutput(output, FileStorage::WRITE);
+        fsOutput << "features" << features;
+        fsOutput << "filenames" << filenames;
+        fsOutput << "indexes" << indexes;
+        fsOutput.release();
+    }
+    else {
+        //every shard gets its own manifest, all of them share the quantization of the first descriptors
+        for (int i=0; i<shards; i++) {
+            string shardManifestPath = featureManifestPath(shardPaths[i].c_str());
+            checksums[i] = writers[i]->checksum();
+            manifests[i].checksum = checksums[i];
+            writers[i]->setQuantization(quantizer.parameters());
+            if (!writers[i]->close()) {
+                cout << endl << "could not write output file " << shardPaths[i] << endl;
+                return -1;
+            }
+            if (!writeFeatureManifest(shardManifestPath.c_str(), manifests[i])) {
+                cout << endl << "could not write manifest file " << shardManifestPath << endl;
+                return -1;
+            }
+        }
+        if (shards>1 && !writeFeatureShardList(output, shardPaths)) {
+            cout << endl << "could not write output file " << output << endl;
+            return -1;
+        }
+    }
+    previous.close();
+    timer.add("serialize", elapsedMiliseconds(tick));
     cout << "\tdone" << endl;
-    fsOutput.release();
+    
+    if (!yaml)
+        quantizer.report(cout);
+    
+    if (buildIndex && quantizer.parameters().method!=FEATURE_QUANTIZATION_NONE) {
+        cout << "quantized descriptors are searched without an index, skip index" << endl;
+        buildIndex = false;
+    }
+    
+    //written files are mapped back for the index instead of keeping every descriptor in memory
+    for (int i=0; buildIndex && i<shards; i++) {
+        FeatureDatabase written;
+        if (!yaml && !written.open(shardPaths[i].c_str())) {
+            cout << "could not open output file " << shardPaths[i] << endl;
+            return -1;
+        }
+        Mat shardFeatures = yaml ? features : written.features;
+        if (!isPersistentFeatureIndex(shardFeatures)) {
+            cout << "binary descriptors use an LSH index that is built at load time, skip index" << endl;
+            break;
+        }
+        
+        string shardIndexPath = indexPath;
+        if (shards>1)
+            shardIndexPath = indexOutput ? featureShardPath(indexOutput, i) : featureIndexPath(shardPaths[i].c_str());
+        cout << "build index " << shardIndexPath << "...";
+        prepareFeatures(shardFeatures);
+        tick = getTickCount();
+        flann::Index index;
+        buildFeatureIndex(index, shardFeatures);
+        timer.add("index", elapsedMiliseconds(tick));
+        if (!saveFeatureIndex(index, shardIndexPath, shardFeatures, checksums[i])) {
+            cout << endl << "could not write index file " << shardIndexPath << endl;
+            return -1;
+        }
+        timer.add("serialize", elapsedMiliseconds(tick));
+        cout << "\tdone" << endl;
+    }
+    
+    //codes are computed from the written descriptors, quantized ones are restored to float first
+    for (int i=0; ivfpq && i<shards; i++) {
+        FeatureDatabase written;
+        if (!written.open(shardPaths[i].c_str())) {
+            cout << "could not open output file " << shardPaths[i] << endl;
+            return -1;
+        }
+        if (isBinaryFeatures(written.features)) {
+            cout << "IVF-PQ needs float descriptors, skip IVF-PQ index" << endl;
+            break;
+        }
+        if (written.features.rows==0) {
+            continue;
+        }
+        if (written.features.cols % pqBytes!=0) {
+            cout << "descriptor size " << written.features.cols << " is not a multiple of pq_bytes " << pqBytes << endl;
+            return -1;
+        }
+        
+        string ivfPqPath = featureIvfPqPath(shardPaths[i].c_str());
+        cout << "build IVF-PQ index " << ivfPqPath << "...";
+        tick = getTickCount();
+        Mat sample;
+        ivfPqTrainingSample(written.features, written.quantization, trainSample, sample);
+        IvfPqIndex index;
+        if (!index.train(sample, ivfLists, pqBytes)) {
+            cout << endl << "could not train IVF-PQ index from " << sample.rows << " sample descriptors" << endl;
+            return -1;
+        }
+        timer.add("train", elapsedMiliseconds(tick));
+        
+        tick = getTickCount();
+        for (int first=0; first<written.features.rows; first+=IVFPQ_ADD_BATCH) {
+            Mat rows;
+            ivfPqFloatRows(written.features, written.quantization, first, std::min(first + IVFPQ_ADD_BATCH, written.features.rows), rows);
+            index.add(rows, first, threads);
+        }
+        timer.add("index", elapsedMiliseconds(tick));
+        
+        tick = getTickCount();
+        if (!index.save(ivfPqPath.c_str(), checksums[i])) {
+            cout << endl << "could not write index file " << ivfPqPath << endl;
+            return -1;
+        }
+        timer.add("serialize", elapsedMiliseconds(tick));
+        cout << "\tdone" << endl;
+    }
+    
+    timer.report(cout);
+    if (!workers.empty())
+        pipeline.report(cout);
+    if (report && !timer.writeJSON(report)) {
+        cout << "could not write report file " << report << endl;
+    }
     
     return 0;
 }
 
-const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *detectorAlgorithm)
+void *extractFeatures(void *arg)
+{
+    ExtractionWorker *worker = (ExtractionWorker *)arg;
+    ExtractionContext *context = worker->context;
+    
+    cv::vector<KeyPoint> keypoints;
+    PipelineImage item;
+    Mat descriptors;
+    
+    while (true) {
+        //backpressure: over budget, wait while the next file to write is being extracted by another worker;
+        //when it is still in the pipeline this worker has to go and take it
+        pthread_mutex_lock(&context->mutex);
+        while (context->pendingBytes>context->memoryBudget && context->committed<context->candidates.size() && context->taken[context->committed] && !context->done[context->committed])
+            pthread_cond_wait(&context->condition, &context->mutex);
+        pthread_mutex_unlock(&context->mutex);
+        
+        if (!context->pipeline->next(item))
+            break;
+        size_t i = item.index;
+        const string &filename = item.filename;
+        const Mat &image = item.image;
+        size_t imageBytes = image.total() * image.elemSize() + item.encoded.total() * item.encoded.elemSize();
+        pthread_mutex_lock(&context->mutex);
+        context->taken[i] = true;
+        context->pendingBytes += imageBytes;
+        pthread_mutex_unlock(&context->mutex);
+        
+        int64 tick = getTickCount();
+        uint64_t hash = 0;
+        if (image.data) {
+            worker->detector->detect(image, keypoints);
+            context->timer->add("detect", elapsedMiliseconds(tick));
+            worker->extractor->compute(image, keypoints, descriptors);
+            context->timer->add("compute", elapsedMiliseconds(tick));
+            hash = featureChecksum(item.encoded.data, item.encoded.total());
+        }
+        
+        //the descriptors are handed over instead of copied, so the worker holds nothing that is not counted
+        pthread_mutex_lock(&context->mutex);
+        if (image.data) {
+            context->descriptors[i] = descriptors;
+            context->pendingBytes += descriptors.total() * descriptors.elemSize();
+            context->entries[i].hash = hash;
+            context->loaded[i] = true;
+            cout << "File " << filename << "... done" << endl;
+        }
+        context->pendingBytes -= imageBytes;
+        context->done[i] = true;
+        pthread_mutex_unlock(&context->mutex);
+        descriptors.release();
+        item.image.release();
+        item.encoded.release();
+        
+        commitFeatures(context);
+    }
+    
+    return NULL;
+}
+
+//writes finished files in directory order, called by every worker after each file; whoever holds commitMutex
+//also writes the files other workers finished meanwhile
+void commitFeatures(ExtractionContext *context)
+{
+    pthread_mutex_lock(&context->commitMutex);
+    while (true) {
+        pthread_mutex_lock(&context->mutex);
+        size_t i = context->committed;
+        bool ready = i<context->candidates.size() && context->done[i];
+        bool loaded = ready && context->loaded[i];
+        pthread_mutex_unlock(&context->mutex);
+        if (!ready)
+            break;
+        
+        Mat &descriptors = context->descriptors[i];
+        if (loaded && !context->failed) {
+            int64 tick = getTickCount();
+            ManifestEntry entry = context->entries[i];
+            //shards take contiguous ranges of files, in order
+            size_t shard = 0;
+            if (context->writers) {
+                shard = i * context->writers->size() / context->candidates.size();
+                FeatureDatabaseWriter *writer = (*context->writers)[shard];
+                entry.image = (int)writer->imageCount();
+                entry.first = (int)writer->rowCount();
+                Mat stored;
+                context->failed = !context->quantizer->quantize(descriptors, stored) || !writer->add(context->candidates[i], stored);
+            }
+            else {
+                entry.image = (int)context->filenames->size();
+                entry.first = context->features->rows;
+                context->features->push_back(descriptors);
+                context->filenames->push_back(context->candidates[i]);
+                context->indexes->push_back(entry.first);
+            }
+            entry.count = descriptors.rows;
+            (*context->manifests)[shard].entries.push_back(entry);
+            context->timer->add("serialize", elapsedMiliseconds(tick));
+        }
+        
+        pthread_mutex_lock(&context->mutex);
+        context->pendingBytes -= descriptors.total() * descriptors.elemSize();
+        descriptors.release();
+        context->committed++;
+        pthread_cond_broadcast(&context->condition);
+        pthread_mutex_unlock(&context->mutex);
+    }
+    pthread_mutex_unlock(&context->commitMutex);
+}
+
+//YAML stays available as an export format, everything else is written as a binary feature database
+bool isYAMLOutput(const char *output)
+{
+    size_t length = strlen(output);
+    for (size_t i=0; i<sizeof(YAML_EXTENSIONS)/sizeof(YAML_EXTENSIONS[0]); i++) {
+        size_t extensionLength = strlen(YAML_EXTENSIONS[i]);
+        if (length>=extensionLength && strcasecmp(output + length - extensionLength, YAML_EXTENSIONS[i])==0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+string algorithmType(const char *adapter, const char *algorithm)
 {
-    string detectorType = detectorAlgorithm;
-    if (detectorAdapter) {
-        detectorType = detectorAdapter + detectorType;
+    string type = algorithm;
+    if (adapter) {
+        type = adapter + type;
     }
+    return type;
+}
+
+const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *detectorAlgorithm)
+{
+    string detectorType = algorithmType(detectorAdapter, detectorAlgorithm);
     
     cout << "create feature detector with type: " << detectorType << endl;
     Ptr<FeatureDetector> result = FeatureDetector::create(detectorType);
@@ -180,10 +878,7 @@ const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *
 
 const Ptr<DescriptorExtractor> getExtractor(const char *extractorAdapter, const char *extractorAlgorithm)
 {
-    string extractorType = extractorAlgorithm;
-    if (extractorAdapter) {
-        extractorType = extractorAdapter + extractorType;
-    }
+    string extractorType = algorithmType(extractorAdapter, extractorAlgorithm);
     
     cout << "create descriptor extractor with type: " << extractorType << endl;
     Ptr<DescriptorExtractor> result = DescriptorExtractor::create(extractorType);
@@ -13,6 +13,20 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#include <sstream>
 
 #include "opencv2/opencv.hpp"
 #include "opencv2/core/core.hpp"
@@ -20,29 +34,304 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/nonfree/nonfree.hpp"
 
+#include "../../common/feature_database.h"
+#include "../../common/feature_index.h"
+#include "../../common/feature_quantization.h"
+#include "../../common/feature_shards.h"
+#include "../../common/ivfpq_index.h"
+#include "../../common/exact_search.h"
+#include "../../common/stage_timer.h"
+#include "../../common/ground_truth.h"
+#include "../../common/pipeline.h"
+#include "../../common/image_loader.h"
+#include "../../common/feature_manifest.h"
+
 using namespace std;
 using namespace cv;
 
-typedef enum {kLongOptionIndexNone, kLongOptionIndexDirectory, kLongOptionIndexDetector, kLongOptionIndexDetectorAdapter, kLongOptionIndexExtractor, kLongOptionIndexExtractorAdapter, kLongOptionIndexMatcher, kLongOptionIndexInput, kLongOptionIndexDistanceRatio, kLongOptionIndexMinimunMatchedPoints} LongOptionIndex;
+typedef enum {kLongOptionIndexNone, kLongOptionIndexDirectory, kLongOptionIndexDetector, kLongOptionIndexDetectorAdapter, kLongOptionIndexExtractor, kLongOptionIndexExtractorAdapter, kLongOptionIndexMatcher, kLongOptionIndexInput, kLongOptionIndexDistanceRatio, kLongOptionIndexMinimunMatchedPoints, kLongOptionIndexIndex, kLongOptionIndexThreads, kLongOptionIndexTopK, kLongOptionIndexServe, kLongOptionIndexSocket, kLongOptionIndexReport, kLongOptionIndexBenchmark, kLongOptionIndexBenchIndex, kLongOptionIndexBenchTrees, kLongOptionIndexBenchChecks, kLongOptionIndexBenchRatio, kLongOptionIndexBenchMinPoint, kLongOptionIndexGroundTruth, kLongOptionIndexDecoders, kLongOptionIndexPrefetch, kLongOptionIndexMaxSide, kLongOptionIndexScale, kLongOptionIndexNprobe, kLongOptionIndexBatchSize, kLongOptionIndexBatchLatency, kLongOptionIndexAdaptive, kLongOptionIndexConfidence, kLongOptionIndexMinDescriptors} LongOptionIndex;
+typedef enum {kSearchBackendFlann, kSearchBackendQuantizedScan, kSearchBackendIvfPq, kSearchBackendExact} SearchBackend;
 
 static const char* DETECTOR_ALGORITHMS[] = {"SURF","FAST","STAR","SIFT","ORB","BRISK","MSER","GFTT","HARRIS","Dense","SimpleBlob"};
 static const char* EXTRACTOR_ALGORITHMS[] = {"SURF","SIFT","BRIEF","BRISK","ORB","FREAK"};
-static const char* MATCH_ALGORITHMS[] = {"FlannBased","BruteForce","BruteForce-L1","BruteForce-Hamming","BruteForce-Hamming(2)"};
-static const char* INPUT_DEFAULT = "input.yml";
+static const char* MATCH_ALGORITHMS[] = {"FlannBased","BruteForce","BruteForce-L1","BruteForce-Hamming","BruteForce-Hamming(2)","IVFPQ"};
+static const char* INPUT_DEFAULT = "input.fdb";
 static const float DISTANCE_RATIO_DEFAULT = 0.6f;
 static const int MINIMUN_MATCHED_POINTS_DEFAULT = 5;
+static const int THREADS_DEFAULT = 1;
+static const int TOP_K_DEFAULT = 1;
+static const int SEARCH_CHECKS_DEFAULT = 64;
+static const int SEARCH_NEIGHBORS = 2;
+static const int SEARCH_NEIGHBORS_DELETED = 4;
+static const uint32_t DELETED_IMAGE = 0xffffffff;
+static const int BATCH_SIZE_DEFAULT = 1;
+static const double BATCH_LATENCY_DEFAULT = 5;
+static const double CONFIDENCE_DEFAULT = 0.99;
+static const int MIN_DESCRIPTORS_DEFAULT = 64;
+static const int ADAPTIVE_BLOCK = 32;
+static const int SERVER_BACKLOG = 64;
+static const size_t SERVER_MAX_REQUEST_SIZE = 256 << 20;
+static const size_t SERVER_MAX_LINE = 4096;
+
+//votes per database image; only images that received a vote are touched when ranking and clearing
+struct VoteAccumulator {
+    cv::vector<int> votes;
+    cv::vector<uint32_t> voted;
+    
+    void reset(size_t imageCount)
+    {
+        votes.assign(imageCount, 0);
+        voted.clear();
+    }
+    
+    void add(uint32_t image)
+    {
+        if (votes[image]++==0) {
+            voted.push_back(image);
+        }
+    }
+    
+    //best first, ties broken by database order
+    void rank(int topK, cv::vector<pair<int, uint32_t> > &ranking) const
+    {
+        ranking.clear();
+        for (size_t i=0; i<voted.size(); i++) {
+            ranking.push_back(make_pair(-votes[voted[i]], voted[i]));
+        }
+        size_t k = std::min(ranking.size(), (size_t)topK);
+        std::partial_sort(ranking.begin(), ranking.begin() + k, ranking.end());
+        ranking.resize(k);
+        for (size_t i=0; i<k; i++) {
+            ranking[i].first = -ranking[i].first;
+        }
+    }
+    
+    void clear()
+    {
+        for (size_t i=0; i<voted.size(); i++) {
+            votes[voted[i]] = 0;
+        }
+        voted.clear();
+    }
+};
+
+//one shard of the database with its own index; its rows are numbered from rowOffset in the whole database
+struct SearchShard {
+    Mat features;               //prepared for the index, or the stored rows when quantized
+    flann::Index *flannIndex;   //NULL unless searched with FLANN
+    IvfPqIndex *ivfpq;          //NULL unless searched with IVF-PQ
+    int rowOffset;
+};
+
+struct ShardSearchers;
+
+//read-only database and matching parameters shared by all threads
+struct MatchDatabase {
+    const cv::vector<SearchShard> *shards;
+    ShardSearchers *searchers;  //threads of the shards after the first
+    SearchBackend backend;
+    FeatureQuantization quantization;
+    int nprobe;                 //IVF lists visited per descriptor
+    int featureType;
+    const cv::vector<uint32_t> *descriptorImages;
+    int neighbors;
+    const cv::vector<string> *filenames;
+    const GroundTruth *groundTruth;
+    int topK;
+    float distanceRatio;
+    int minimunMatchedPoints;
+    ImageScale imageScale;
+    bool adaptive;              //search the strongest descriptors first and stop once the leading image is decided
+    double leadThreshold;       //normal quantile of the confidence, for the lead over the runner-up
+    int minDescriptors;
+};
+
+//ranked candidates of one query, times are in miliseconds
+struct MatchResult {
+    cv::vector<pair<int, uint32_t> > ranking;
+    bool found;
+    string error;
+    double decodeTime;
+    double detectTime;
+    double extractTime;
+    double searchTime;
+    double voteTime;
+    int descriptors;
+    int searchedDescriptors;    //less than descriptors when the adaptive search stopped early
+};
+
+//query images shared by the directory matching threads; counters are guarded by mutex
+struct MatchContext {
+    ImagePipeline *pipeline;
+    int trueMatch;
+    int totalFile;
+    int notFound;
+    pthread_mutex_t mutex;
+};
+
+//client connections accepted by the server; there are never more than workers of them, a client beyond that is
+//refused instead of waiting for a worker that only frees up when another client disconnects
+struct ServerContext {
+    cv::vector<int> connections;    //waiting for a worker
+    cv::vector<int> served;         //being served, shut down when the server stops
+    size_t workers;
+    bool stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+};
+
+//descriptors of concurrent queries searched with one call; offsets holds the first row of every query in the
+//concatenated descriptors and results
+struct SearchBatch {
+    cv::vector<Mat> descriptors;
+    cv::vector<int> offsets;
+    Mat indices;
+    Mat dists;
+    bool closed;    //takes no more queries
+    bool done;      //results are ready
+};
+
+//gathers the queries of the matching threads into batches; a batch is searched by the thread that fills it, or by
+//its first query once that has waited latency miliseconds
+struct SearchBatcher {
+    int batchSize;
+    double latency;
+    Ptr<SearchBatch> open;
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+};
+
+//parameter lists swept by the benchmark, comma separated
+struct BenchmarkOptions {
+    const char *output;
+    const char *indexTypes;
+    const char *trees;
+    const char *checks;
+    const char *ratios;
+    const char *minPoints;
+};
+
+//per-thread detector, extractor and scratch buffers
+struct MatchWorker {
+    const MatchDatabase *database;
+    MatchContext *context;
+    ServerContext *server;
+    SearchBatcher *batcher;     //NULL when every query is searched on its own
+    StageTimer *timer;
+    Ptr<FeatureDetector> detector;
+    Ptr<DescriptorExtractor> extractor;
+    cv::vector<KeyPoint> keypoints;
+    Mat descriptors;
+    Mat orderedDescriptors;
+    cv::vector<pair<float, int> > order;
+    Mat indices;
+    Mat dists;
+    cv::vector<Mat> shardIndices;
+    cv::vector<Mat> shardDists;
+    VoteAccumulator votes;
+};
+
+//shard searches of one searchDatabase call; remaining counts those the shard threads have not finished
+struct ShardSearchGroup {
+    int remaining;
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+};
+
+//search of one shard by a shard thread
+struct ShardSearch {
+    const MatchDatabase *database;
+    const SearchShard *shard;
+    const Mat *descriptors;
+    Mat *indices;
+    Mat *dists;
+    ShardSearchGroup *group;
+};
+
+void *runShardSearches(void *arg);
+
+//one thread per shard after the first, started once and fed by the query threads through its queue; the first
+//shard is searched by the query thread itself. The threads stop when the searchers go out of scope
+struct ShardSearchers {
+    cv::vector<BoundedQueue<ShardSearch *> *> queues;   //per shard, NULL for the first
+    cv::vector<pthread_t> threadIds;
+    
+    void start(size_t shardCount, int queryThreads)
+    {
+        queues.assign(shardCount, NULL);
+        threadIds.resize(shardCount);
+        for (size_t i=1; i<shardCount; i++) {
+            queues[i] = new BoundedQueue<ShardSearch *>("shard", queryThreads);
+            pthread_create(&threadIds[i], NULL, runShardSearches, queues[i]);
+        }
+    }
+    
+    void finish()
+    {
+        for (size_t i=1; i<queues.size(); i++) {
+            queues[i]->close();
+            pthread_join(threadIds[i], NULL);
+            delete queues[i];
+        }
+        queues.clear();
+    }
+    
+    ~ShardSearchers()
+    {
+        finish();
+    }
+};
 
 const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *detectorAlgorithm);
 const Ptr<DescriptorExtractor> getExtractor(const char *extractorAdapter, const char *extractorAlgorithm);
 const Ptr<DescriptorMatcher> getMatcher(const char *matchAlgorithm);
+void *matchFeatures(void *arg);
+bool matchImage(MatchWorker &worker, const Mat &image, MatchResult &result);
+void searchDatabase(MatchWorker &worker, const Mat &descriptors);
+void batchSearch(MatchWorker &worker, const Mat &descriptors);
+void adaptiveSearch(MatchWorker &worker, MatchResult &result, int64 &tick);
+bool isLeadDecided(const MatchDatabase *database, const cv::vector<pair<int, uint32_t> > &ranking, int searched, int remaining);
+double normalQuantile(double probability);
+void searchShard(const MatchDatabase *database, const SearchShard &shard, const Mat &descriptors, Mat &indices, Mat &dists);
+void mergeShardNeighbors(const MatchDatabase *database, const cv::vector<Mat> &shardIndices, const cv::vector<Mat> &shardDists, Mat &indices, Mat &dists);
+bool readRequestLine(FILE *in, string &line, bool &tooLong);
+bool serveRequests(MatchWorker &worker, FILE *in, FILE *out);
+void *serveConnections(void *arg);
+void stopServer(int signal);
+int runServer(const char *socketPath, cv::vector<MatchWorker> &workers, const char *report);
+int runBenchmark(const BenchmarkOptions &options, MatchWorker &worker, const Mat &features, const Mat &quantizedFeatures, const char *directoryName);
+cv::vector<string> splitList(const char *list);
+size_t residentMemory();
+void mapDescriptorImages(const cv::vector<int> &indexes, const cv::vector<unsigned char> &flags, int rows, cv::vector<uint32_t> &descriptorImages);
+void voteDescriptors(VoteAccumulator &votes, const Mat &indices, const Mat &dists, const cv::vector<uint32_t> &descriptorImages, float distanceRatio);
 
 int main(int argc, char * const *argv)
 {
     const char *directoryName, *detectorAlgorithm, *detectorAdapter, *extractorAlgorithm, *extractorAdapter, *matchAlgorithm, *input;
+    const char *indexInput = NULL;
     directoryName = detectorAlgorithm = detectorAdapter = extractorAlgorithm = extractorAdapter = matchAlgorithm = input = NULL;
     
     float distanceRatio = DISTANCE_RATIO_DEFAULT; //if distance from this point is less than distance from next point, that point is considered as matched point
     int minimunMatchedPoints = MINIMUN_MATCHED_POINTS_DEFAULT;   //minimum number of matched points that one image need to have to make it as matched image
+    int threads = 0;
+    int topK = 0;
+    bool serve = false;
+    const char *socketPath = NULL;
+    const char *report = NULL;
+    const char *groundTruthInput = NULL;
+    int decoders = 0;
+    int prefetch = 0;
+    int nprobe = 0;
+    int batchSize = 0;
+    double batchLatency = -1;
+    bool adaptive = false;
+    double confidence = 0;
+    int minDescriptors = 0;
+    ImageScale imageScale;
+    imageScale.maxSide = 0;
+    imageScale.scale = 0;
+    BenchmarkOptions benchmark;
+    memset(&benchmark, 0, sizeof(benchmark));
     
     struct option longOptions[] = {
         {"directory", required_argument, 0, kLongOptionIndexDirectory},
@@ -54,6 +343,29 @@ int main(int argc, char * const *argv)
         {"input", required_argument, 0, kLongOptionIndexInput},
         {"distance_ratio", required_argument, 0, kLongOptionIndexDistanceRatio},
         {"min_point", required_argument, 0, kLongOptionIndexMinimunMatchedPoints},
+        {"index", required_argument, 0, kLongOptionIndexIndex},
+        {"threads", required_argument, 0, kLongOptionIndexThreads},
+        {"top_k", required_argument, 0, kLongOptionIndexTopK},
+        {"serve", no_argument, 0, kLongOptionIndexServe},
+        {"socket", required_argument, 0, kLongOptionIndexSocket},
+        {"report", required_argument, 0, kLongOptionIndexReport},
+        {"benchmark", required_argument, 0, kLongOptionIndexBenchmark},
+        {"bench_index", required_argument, 0, kLongOptionIndexBenchIndex},
+        {"bench_trees", required_argument, 0, kLongOptionIndexBenchTrees},
+        {"bench_checks", required_argument, 0, kLongOptionIndexBenchChecks},
+        {"bench_ratio", required_argument, 0, kLongOptionIndexBenchRatio},
+        {"bench_min_point", required_argument, 0, kLongOptionIndexBenchMinPoint},
+        {"ground_truth", required_argument, 0, kLongOptionIndexGroundTruth},
+        {"decoders", required_argument, 0, kLongOptionIndexDecoders},
+        {"prefetch", required_argument, 0, kLongOptionIndexPrefetch},
+        {"max_side", required_argument, 0, kLongOptionIndexMaxSide},
+        {"scale", required_argument, 0, kLongOptionIndexScale},
+        {"nprobe", required_argument, 0, kLongOptionIndexNprobe},
+        {"batch_size", required_argument, 0, kLongOptionIndexBatchSize},
+        {"batch_latency", required_argument, 0, kLongOptionIndexBatchLatency},
+        {"adaptive", no_argument, 0, kLongOptionIndexAdaptive},
+        {"confidence", required_argument, 0, kLongOptionIndexConfidence},
+        {"min_descriptors", required_argument, 0, kLongOptionIndexMinDescriptors},
         {0, 0, 0, 0}
     };
     
@@ -96,12 +408,110 @@ int main(int argc, char * const *argv)
                 minimunMatchedPoints = atoi(optarg);
                 break;
             }
+            case kLongOptionIndexIndex: {
+                indexInput = optarg;
+                break;
+            }
+            case kLongOptionIndexThreads: {
+                threads = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexTopK: {
+                topK = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexServe: {
+                serve = true;
+                break;
+            }
+            case kLongOptionIndexSocket: {
+                socketPath = optarg;
+                serve = true;
+                break;
+            }
+            case kLongOptionIndexReport: {
+                report = optarg;
+                break;
+            }
+            case kLongOptionIndexBenchmark: {
+                benchmark.output = optarg;
+                break;
+            }
+            case kLongOptionIndexBenchIndex: {
+                benchmark.indexTypes = optarg;
+                break;
+            }
+            case kLongOptionIndexBenchTrees: {
+                benchmark.trees = optarg;
+                break;
+            }
+            case kLongOptionIndexBenchChecks: {
+                benchmark.checks = optarg;
+                break;
+            }
+            case kLongOptionIndexBenchRatio: {
+                benchmark.ratios = optarg;
+                break;
+            }
+            case kLongOptionIndexBenchMinPoint: {
+                benchmark.minPoints = optarg;
+                break;
+            }
+            case kLongOptionIndexGroundTruth: {
+                groundTruthInput = optarg;
+                break;
+            }
+            case kLongOptionIndexDecoders: {
+                decoders = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexPrefetch: {
+                prefetch = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexMaxSide: {
+                imageScale.maxSide = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexScale: {
+                imageScale.scale = atof(optarg);
+                break;
+            }
+            case kLongOptionIndexNprobe: {
+                nprobe = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexBatchSize: {
+                batchSize = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexBatchLatency: {
+                batchLatency = atof(optarg);
+                break;
+            }
+            case kLongOptionIndexAdaptive: {
+                adaptive = true;
+                break;
+            }
+            case kLongOptionIndexConfidence: {
+                confidence = atof(optarg);
+                break;
+            }
+            case kLongOptionIndexMinDescriptors: {
+                minDescriptors = atoi(optarg);
+                break;
+            }
             default:
                 break;
         }
     }
     
-    if (!directoryName) {
+    //stdout carries the responses when serving stdin, so messages go to stderr
+    if (serve && !socketPath) {
+        cout.rdbuf(cerr.rdbuf());
+    }
+    
+    if (!directoryName && !serve) {
         cout << "need input directory" << endl;
         return -1;
     }
@@ -121,6 +531,26 @@ int main(int argc, char * const *argv)
         input = INPUT_DEFAULT;
     }
     
+    if (!matchAlgorithm) {
+        cout << "use " << MATCH_ALGORITHMS[0] << " as matcher algorithm" << endl;
+        matchAlgorithm = MATCH_ALGORITHMS[0];
+    }
+    bool ivfpq = strcmp(matchAlgorithm, "IVFPQ")==0;
+    bool exact = strncmp(matchAlgorithm, "BruteForce", strlen("BruteForce"))==0;
+    if (!ivfpq && !exact && strcmp(matchAlgorithm, MATCH_ALGORITHMS[0])!=0) {
+        cout << "matcher " << matchAlgorithm << " is not supported, use " << MATCH_ALGORITHMS[0] << endl;
+        matchAlgorithm = MATCH_ALGORITHMS[0];
+    }
+    //the exact search compares like the FLANN indexes do, by the type of the descriptors
+    if (exact && strcmp(matchAlgorithm, "BruteForce")!=0 && strcmp(matchAlgorithm, "BruteForce-Hamming")!=0) {
+        cout << "matcher " << matchAlgorithm << " is not supported, use L2 for float and Hamming for binary descriptors" << endl;
+    }
+    
+    if (ivfpq && nprobe<=0) {
+        cout << "use " << IVFPQ_NPROBE_DEFAULT << " as number of probed IVF lists" << endl;
+        nprobe = IVFPQ_NPROBE_DEFAULT;
+    }
+    
     if (fabs(distanceRatio)<0.01f || distanceRatio<0) {
         cout << "use " << DISTANCE_RATIO_DEFAULT << " as distance ratio" << endl;
         distanceRatio = DISTANCE_RATIO_DEFAULT;
@@ -131,140 +561,1274 @@ int main(int argc, char * const *argv)
         minimunMatchedPoints = MINIMUN_MATCHED_POINTS_DEFAULT;
     }
     
-    DIR *dir;
-    dir = opendir(directoryName);
-    if (!dir) {
-        cout << "could not open directory " << directoryName << endl;
+    if (threads<=0) {
+        cout << "use " << THREADS_DEFAULT << " as number of threads" << endl;
+        threads = THREADS_DEFAULT;
+    }
+    
+    if (topK<=0) {
+        cout << "use " << TOP_K_DEFAULT << " as number of ranked candidates" << endl;
+        topK = TOP_K_DEFAULT;
+    }
+    
+    if (decoders<=0) {
+        cout << "use " << PIPELINE_DECODERS_DEFAULT << " as number of decoder threads" << endl;
+        decoders = PIPELINE_DECODERS_DEFAULT;
+    }
+    
+    if (prefetch<=0) {
+        cout << "use " << PIPELINE_PREFETCH_DEFAULT << " as number of prefetched images" << endl;
+        prefetch = PIPELINE_PREFETCH_DEFAULT;
+    }
+    
+    if (batchSize<=0) {
+        cout << "use " << BATCH_SIZE_DEFAULT << " as number of queries per search batch" << endl;
+        batchSize = BATCH_SIZE_DEFAULT;
+    }
+    
+    if (batchSize>1 && batchLatency<0) {
+        cout << "use " << BATCH_LATENCY_DEFAULT << " as search batch latency in miliseconds" << endl;
+        batchLatency = BATCH_LATENCY_DEFAULT;
+    }
+    
+    if (adaptive && confidence<=0) {
+        cout << "use " << CONFIDENCE_DEFAULT << " as confidence of the adaptive search" << endl;
+        confidence = CONFIDENCE_DEFAULT;
+    }
+    
+    if (adaptive && (confidence<=0.5 || confidence>=1)) {
+        cout << "confidence must be between 0.5 and 1" << endl;
+        return -1;
+    }
+    
+    if (adaptive && minDescriptors<=0) {
+        cout << "use " << MIN_DESCRIPTORS_DEFAULT << " as minimum number of searched descriptors" << endl;
+        minDescriptors = MIN_DESCRIPTORS_DEFAULT;
+    }
+    
+    //queries are batched across the matching threads, each of them has one query in flight; requests on stdin are
+    //served by one thread and never batched, and the adaptive search makes one small search per block
+    bool batch = batchSize>1 && threads>1 && !(serve && !socketPath) && !adaptive;
+    if (batchSize>1 && adaptive) {
+        cout << "adaptive search does not batch queries, search every query on its own" << endl;
+    }
+    else if (batchSize>1 && !batch) {
+        cout << "search batches need more than one matching thread, search every query on its own" << endl;
+    }
+    else if (batchSize>threads) {
+        cout << "search batches hold at most " << threads << " queries, one per thread" << endl;
+    }
+    
+    if (imageScale.maxSide<0 || imageScale.scale<0) {
+        cout << "max_side and scale must not be negative" << endl;
+        return -1;
+    }
+    
+    if (isImageScaled(imageScale)) {
+        cout << "shrink images to " << imageScaleString(imageScale) << endl;
+    }
+    
+    GroundTruth groundTruth;
+    if (groundTruthInput && !loadGroundTruth(groundTruthInput, groundTruth)) {
+        cout << "could not open ground truth file " << groundTruthInput << endl;
         return -1;
     }
     
+    //a server runs until it is stopped, so it keeps only recent samples for the percentiles
+    StageTimer timer(serve ? STAGE_TIMER_WINDOW_DEFAULT : 0);
+    int64 tick = getTickCount();
+    
     cout << "open input file...";
-    FileStorage fsInput(input, FileStorage::READ);
-    if (!fsInput.isOpened()) {
+    cv::vector<string> shardPaths;
+    if (!isFeatureShardList(input)) {
+        shardPaths.push_back(input);
+    }
+    else if (!loadFeatureShardList(input, shardPaths)) {
         cout << endl << "could not open input file " << input << endl;
         return -1;
     }
     
-    Mat features;
+    //shards are concatenated: their images and rows are numbered after those of the shards before them
+    cv::vector<Ptr<FeatureDatabase> > databases;
+    cv::vector<SearchShard> shards(shardPaths.size());
+    cv::vector<uint64_t> checksums(shardPaths.size());
     cv::vector<int> indexes;
     cv::vector<string> filenames;
+    cv::vector<unsigned char> flags;
+    size_t deletedCount = 0;
+    int rows = 0;
+    FeatureQuantization quantization;
+    quantization.method = FEATURE_QUANTIZATION_NONE;
+    quantization.scale = 1;
+    quantization.zero = 0;
     
-    fsInput["features"] >> features;
-    fsInput["filenames"] >> filenames;
-    fsInput["indexes"] >> indexes;
+    for (size_t i=0; i<shardPaths.size(); i++) {
+        const char *shardPath = shardPaths[i].c_str();
+        SearchShard &shard = shards[i];
+        shard.flannIndex = NULL;
+        shard.ivfpq = NULL;
+        shard.rowOffset = rows;
+        
+        if (isFeatureDatabase(shardPath)) {
+            Ptr<FeatureDatabase> database(new FeatureDatabase());
+            if (!database->open(shardPath, !ivfpq || benchmark.output)) {
+                cout << endl << "could not open input file " << shardPath << endl;
+                return -1;
+            }
+            if (i>0 && (database->quantization.method!=quantization.method || database->quantization.scale!=quantization.scale || database->quantization.zero!=quantization.zero)) {
+                cout << endl << "shard " << shardPath << " is quantized differently" << endl;
+                return -1;
+            }
+            databases.push_back(database);
+            shard.features = database->features;
+            checksums[i] = database->checksum;
+            deletedCount += database->deletedCount;
+            quantization = database->quantization;
+            for (size_t k=0; k<database->indexes.size(); k++) {
+                indexes.push_back(database->indexes[k] + rows);
+            }
+            filenames.insert(filenames.end(), database->filenames.begin(), database->filenames.end());
+            flags.insert(flags.end(), database->flags.begin(), database->flags.end());
+        }
+        else if (shardPaths.size()==1) {
+            FileStorage fsInput(shardPath, FileStorage::READ);
+            if (!fsInput.isOpened()) {
+                cout << endl << "could not open input file " << shardPath << endl;
+                return -1;
+            }
+            
+            fsInput["features"] >> shard.features;
+            fsInput["filenames"] >> filenames;
+            fsInput["indexes"] >> indexes;
+            fsInput.release();
+            flags.assign(indexes.size(), 0);
+            checksums[i] = featureChecksum(shard.features);
+        }
+        else {
+            cout << endl << "could not open input file " << shardPath << endl;
+            return -1;
+        }
+        rows += shard.features.rows;
+    }
+    timer.add("load", elapsedMiliseconds(tick));
     cout << "\tdone" << endl;
-    fsInput.release();
+    if (shards.size()>1) {
+        cout << "input file has " << shards.size() << " shards" << endl;
+    }
     
-    if(features.type()!=CV_32F) {
-        features.convertTo(features, CV_32F);
+    //queries have to be shrunk like the reference images were; every shard is generated with the same settings
+    FeatureManifest manifest;
+    if (loadFeatureManifest(featureManifestPath(shardPaths[0].c_str()).c_str(), manifest) && manifest.checksum==checksums[0] && !manifest.imageScale.empty() && manifest.imageScale!=imageScaleString(imageScale)) {
+        cout << "input file was generated with " << manifest.imageScale << ", queries use " << imageScaleString(imageScale) << endl;
     }
     
-    flann::KDTreeIndexParams indexParams(5);
-    //flann::LshIndexParams indexParams(20, 15, 2);
-    flann::Index kdtree(features, indexParams);
+    //FLANN needs float rows, so quantized rows are scanned as they are stored unless an IVF-PQ index is used;
+    //that scan is already exact, so a brute force matcher uses it as well
+    bool quantized = quantization.method!=FEATURE_QUANTIZATION_NONE;
+    SearchBackend backend = ivfpq ? kSearchBackendIvfPq : quantized ? kSearchBackendQuantizedScan : exact ? kSearchBackendExact : kSearchBackendFlann;
+    if (backend==kSearchBackendQuantizedScan) {
+        cout << "input file stores " << featureQuantizationName(quantization.method) << " descriptors, search them with a linear scan" << endl;
+    }
+    int featureType = -1;
+    for (size_t i=0; i<shards.size(); i++) {
+        if (!quantized)
+            prepareFeatures(shards[i].features);
+        if (shards[i].features.empty())
+            continue;
+        if (featureType>=0 && (shards[i].features.type()!=featureType || shards[i].features.cols!=shards[0].features.cols)) {
+            cout << "shard " << shardPaths[i] << " holds different descriptors" << endl;
+            return -1;
+        }
+        featureType = shards[i].features.type();
+    }
+    if (quantized)
+        featureType = CV_32F;
+    if (backend==kSearchBackendExact) {
+        cout << "search with an exact linear scan using " << exactSearchKernelName(featureType==CV_8U) << " kernels" << endl;
+    }
     
-    struct dirent *ep;
-    char *filename;
-    char path[1000];
-    struct stat buf;
+    //IVF-PQ indexes are built by fd_generate --ivfpq; the benchmark uses one when the input has it
+    cv::vector<Ptr<IvfPqIndex> > ivfPqIndexes;
+    for (size_t i=0; i<shards.size() && (ivfpq || (benchmark.output && shards.size()==1)); i++) {
+        SearchShard &shard = shards[i];
+        if (shard.features.empty())
+            continue;
+        string ivfPqPath = featureIvfPqPath(shardPaths[i].c_str());
+        ivfPqIndexes.push_back(Ptr<IvfPqIndex>(new IvfPqIndex()));
+        if (ivfPqIndexes.back()->load(ivfPqPath.c_str(), checksums[i]) && ivfPqIndexes.back()->dimension()==shard.features.cols && ivfPqIndexes.back()->size()==(uint64_t)shard.features.rows) {
+            shard.ivfpq = ivfPqIndexes.back();
+            if (ivfpq)
+                cout << "loaded IVF-PQ index " << ivfPqPath << endl;
+        }
+        else if (ivfpq) {
+            cout << "could not load IVF-PQ index " << ivfPqPath << ", run fd_generate --ivfpq" << endl;
+            return -1;
+        }
+    }
     
-    Ptr<FeatureDetector> detector = getDetector(detectorAdapter, detectorAlgorithm);
-    Ptr<DescriptorExtractor> extractor = getExtractor(extractorAdapter, extractorAlgorithm);
-    cv::vector<KeyPoint> keypoints;
-    Mat image;
-    Mat descriptors;
-    Mat indices;
-    Mat dists;
+    //the benchmark builds one index over all shards, and compares the scan with indexes over the restored descriptors
+    Mat features, quantizedFeatures;
+    if (benchmark.output) {
+        Mat stored = shards[0].features;
+        if (shards.size()>1) {
+            stored = Mat();
+            for (size_t i=0; i<shards.size(); i++) {
+                stored.push_back(shards[i].features);
+            }
+        }
+        if (quantized) {
+            quantizedFeatures = stored;
+            dequantizeFeatures(quantizedFeatures, quantization, features);
+        }
+        else {
+            features = stored;
+        }
+    }
+    
+    cv::vector<uint32_t> descriptorImages;
+    mapDescriptorImages(indexes, flags, rows, descriptorImages);
+    if (deletedCount) {
+        cout << deletedCount << " deleted images in input file, run fd_generate --compact to drop them" << endl;
+    }
+    
+    //every swept configuration of the benchmark builds its own index, quantized rows have none
+    cv::vector<Ptr<flann::Index> > flannIndexes;
+    for (size_t i=0; i<shards.size() && !benchmark.output && backend==kSearchBackendFlann; i++) {
+        SearchShard &shard = shards[i];
+        flannIndexes.push_back(Ptr<flann::Index>(new flann::Index()));
+        shard.flannIndex = flannIndexes.back();
+        if (shard.features.empty())
+            continue;
+        
+        string indexPath = indexInput ? string(indexInput) : featureIndexPath(input);
+        if (shards.size()>1)
+            indexPath = indexInput ? featureShardPath(indexInput, (int)i) : featureIndexPath(shardPaths[i].c_str());
+        if (loadFeatureIndex(*shard.flannIndex, indexPath, shard.features, checksums[i])) {
+            cout << "loaded index " << indexPath << endl;
+        }
+        else {
+            cout << "build index...";
+            buildFeatureIndex(*shard.flannIndex, shard.features);
+            cout << "\tdone" << endl;
+        }
+    }
+    timer.add("index", elapsedMiliseconds(tick));
+    
+    ShardSearchers searchers;
+    searchers.start(shards.size(), threads);
+    
+    MatchDatabase matchDatabase;
+    matchDatabase.shards = &shards;
+    matchDatabase.searchers = &searchers;
+    matchDatabase.backend = backend;
+    matchDatabase.quantization = quantization;
+    matchDatabase.nprobe = nprobe;
+    matchDatabase.featureType = featureType;
+    matchDatabase.descriptorImages = &descriptorImages;
+    matchDatabase.neighbors = deletedCount ? SEARCH_NEIGHBORS_DELETED : SEARCH_NEIGHBORS;
+    matchDatabase.filenames = &filenames;
+    matchDatabase.groundTruth = &groundTruth;
+    matchDatabase.topK = topK;
+    matchDatabase.distanceRatio = distanceRatio;
+    matchDatabase.minimunMatchedPoints = minimunMatchedPoints;
+    matchDatabase.imageScale = imageScale;
+    matchDatabase.adaptive = adaptive;
+    matchDatabase.leadThreshold = adaptive ? normalQuantile(confidence) : 0;
+    matchDatabase.minDescriptors = minDescriptors;
+    
+    MatchContext context;
+    context.pipeline = NULL;
+    context.trueMatch = 0;
+    context.totalFile = 0;
+    context.notFound = 0;
+    pthread_mutex_init(&context.mutex, NULL);
+    
+    SearchBatcher batcher;
+    batcher.batchSize = batchSize;
+    batcher.latency = batchLatency;
+    pthread_mutex_init(&batcher.mutex, NULL);
+    pthread_cond_init(&batcher.condition, NULL);
+    
+    cv::vector<MatchWorker> workers(threads);
+    for (int i=0; i<threads; i++) {
+        workers[i].database = &matchDatabase;
+        workers[i].context = &context;
+        workers[i].server = NULL;
+        workers[i].batcher = batch ? &batcher : NULL;
+        workers[i].timer = &timer;
+        workers[i].detector = getDetector(detectorAdapter, detectorAlgorithm);
+        workers[i].extractor = getExtractor(extractorAdapter, extractorAlgorithm);
+        workers[i].votes.reset(filenames.size());
+    }
+    
+    if (benchmark.output) {
+        char defaultRatio[32], defaultMinPoint[32];
+        snprintf(defaultRatio, sizeof(defaultRatio), "%g", distanceRatio);
+        snprintf(defaultMinPoint, sizeof(defaultMinPoint), "%d", minimunMatchedPoints);
+        if (!benchmark.indexTypes)
+            benchmark.indexTypes = ivfpq ? "ivfpq" : quantized ? "quantized,kdtree" : exact ? "exact" : isBinaryFeatures(features) ? "lsh" : "kdtree";
+        if (!benchmark.trees)
+            benchmark.trees = isBinaryFeatures(features) ? "12" : "5";
+        if (!benchmark.checks)
+            benchmark.checks = ivfpq ? "1,4,16,64" : "64";
+        if (!benchmark.ratios)
+            benchmark.ratios = defaultRatio;
+        if (!benchmark.minPoints)
+            benchmark.minPoints = defaultMinPoint;
+        return runBenchmark(benchmark, workers[0], features, quantizedFeatures, directoryName);
+    }
+    
+    if (serve && socketPath) {
+        return runServer(socketPath, workers, report);
+    }
+    else if (serve) {
+        cout << "serving requests on stdin" << endl;
+        serveRequests(workers[0], stdin, stdout);
+        timer.report(cout);
+        if (report && !timer.writeJSON(report)) {
+            cout << "could not write report file " << report << endl;
+        }
+        return 0;
+    }
+    
+    DIR *dir;
+    dir = opendir(directoryName);
+    if (!dir) {
+        cout << "could not open directory " << directoryName << endl;
+        return -1;
+    }
+    closedir(dir);
     
-    int trueMatch = 0;
-    int totalFile = 0;
-    int notFound = 0;
     double t;
     
     cout << "matching..." << endl;
     
     t = (double)getTickCount();
     
-    while ((ep = readdir(dir))) {
-    	filename = ep->d_name;
-        if(strlen(filename)==0 || filename[0]=='.')
-        	continue;
+    //scanning and decoding run ahead of the matching threads
+    ImagePipeline pipeline(decoders, prefetch, &timer);
+    context.pipeline = &pipeline;
+    pipeline.setImageScale(imageScale);
+    pipeline.start(directoryName);
+    
+    cv::vector<pthread_t> threadIds(threads);
+    for (int i=1; i<threads; i++) {
+        pthread_create(&threadIds[i], NULL, matchFeatures, &workers[i]);
+    }
+    matchFeatures(&workers[0]);
+    for (int i=1; i<threads; i++) {
+        pthread_join(threadIds[i], NULL);
+    }
+    pipeline.finish();
+    pthread_mutex_destroy(&context.mutex);
+    pthread_cond_destroy(&batcher.condition);
+    pthread_mutex_destroy(&batcher.mutex);
+    
+    int trueMatch = context.trueMatch;
+    int totalFile = context.totalFile;
+    int notFound = context.notFound;
+    
+    t = 1000 * (((double)getTickCount() - t) / getTickFrequency());
+	cout << endl << "Time passed in miliseconds: " << t << endl;
+    
+    cout.precision(2);
+    cout << endl << "correct rate: " << (100.0 * trueMatch / totalFile) << endl;
+    cout << endl << "not found rate: " << (100.0 * notFound / totalFile) << endl;
+    
+    timer.report(cout);
+    pipeline.report(cout);
+    if (report && !timer.writeJSON(report)) {
+        cout << "could not write report file " << report << endl;
+    }
+    
+    return 0;
+}
+
+void *matchFeatures(void *arg)
+{
+    MatchWorker *worker = (MatchWorker *)arg;
+    MatchContext *context = worker->context;
+    const cv::vector<string> &filenames = *worker->database->filenames;
+    
+    PipelineImage item;
+    MatchResult result;
+    
+    while (context->pipeline->next(item)) {
+        const Mat &image = item.image;
+        const string &filename = item.filename;
+        if (!image.data)
+            continue;
         
-        sprintf(path, "%s/%s", directoryName, filename);
+        //each query is logged as one line so output of concurrent queries does not interleave
+        ostringstream log;
+        bool trueMatch = false;
+        bool notFound = false;
         
-        lstat(path, &buf);
-        if (S_ISREG(buf.st_mode)) {
-        	image = imread(path, CV_LOAD_IMAGE_GRAYSCALE);
-        	if (image.data) {
-                totalFile++;
-                
-                cout << "File " << filename << "...";
-        		detector->detect(image, keypoints);
-        		extractor->compute(image, keypoints, descriptors);
-                
-                if(descriptors.type()!=CV_32F) {
-                    descriptors.convertTo(descriptors, CV_32F);
-                }
-                
-                kdtree.knnSearch(descriptors, indices, dists, 2, cv::flann::SearchParams(64));
-                
-                vector<int> matchPoints(indexes.size(), 0);
-                vector<int>::iterator begin = indexes.begin();
-                vector<int>::iterator end = indexes.end();
-                vector<int>::iterator iter;
-                
-                int i,j,k;
-                for (i=0; i<indices.rows; i++) {
-                    if (dists.at<float>(i, 0) < distanceRatio * dists.at<float>(i, 1)) {
-                        k = indices.at<int>(i, 0);
-                        iter = std::upper_bound(begin, end, k);
-                        if (iter!=end) {
-                            j = (int)(iter - begin) - 1;
-                            matchPoints[j]++;
-                        }
-                    }
+        log << "File " << filename << "...";
+        if (!matchImage(*worker, image, result)) {
+            log << result.error << "...skip";
+        }
+        else {
+            if (result.found) {
+                int j = result.ranking[0].second;
+                log << "matching image: " << filenames[j] << "; number of matched points: " << result.ranking[0].first;
+                if (isExpectedMatch(*worker->database->groundTruth, filename, filenames[j])) {
+                    trueMatch = true;
+                    log << "...true match";
                 }
-                
-                k = 0;
-                j = -1;
-                for (i=0; i<matchPoints.size(); i++) {
-                    if (matchPoints[i]>k) {
-                        k = matchPoints[i];
-                        j = i;
-                    }
+                else {
+                    log << "...false match";
                 }
-                
-                if (j>=0 && k>=minimunMatchedPoints) {
-                    cout << "matching image: " << filenames[j] << "; number of matched points: " << k;
-                    if (filenames[j].compare(filename)==0) {
-                        trueMatch++;
-                        cout << "...true match";
-                    }
-                    else {
-                        cout << "...false match";
+                if (result.ranking.size()>1) {
+                    log << "; candidates:";
+                    for (size_t i=0; i<result.ranking.size(); i++) {
+                        log << " " << filenames[result.ranking[i].second] << " (" << result.ranking[i].first << ")";
                     }
                 }
-                else {
-                    cout << "could find matched image";
-                    notFound++;
+            }
+            else {
+                log << "could find matched image";
+                notFound = true;
+            }
+            
+            if (worker->database->adaptive)
+                log << "; searched descriptors: " << result.searchedDescriptors << "/" << result.descriptors;
+            log << "...done";
+        }
+        
+        pthread_mutex_lock(&context->mutex);
+        context->totalFile++;
+        if (trueMatch)
+            context->trueMatch++;
+        if (notFound)
+            context->notFound++;
+        cout << log.str() << endl;
+        pthread_mutex_unlock(&context->mutex);
+    }
+    
+    return NULL;
+}
+
+//runs detect, extract, search and vote for one decoded image; decodeTime is left to the caller
+bool matchImage(MatchWorker &worker, const Mat &image, MatchResult &result)
+{
+    const MatchDatabase *database = worker.database;
+    int64 tick = getTickCount();
+    
+    result.ranking.clear();
+    result.found = false;
+    result.error.clear();
+    result.detectTime = result.extractTime = result.searchTime = result.voteTime = 0;
+    result.descriptors = result.searchedDescriptors = 0;
+    
+    worker.detector->detect(image, worker.keypoints);
+    result.detectTime = elapsedMiliseconds(tick);
+    worker.extractor->compute(image, worker.keypoints, worker.descriptors);
+    prepareFeatures(worker.descriptors);
+    result.extractTime = elapsedMiliseconds(tick);
+    worker.timer->add("detect", result.detectTime);
+    worker.timer->add("compute", result.extractTime);
+    
+    if (worker.descriptors.empty()) {
+        return true;
+    }
+    if (worker.descriptors.type()!=database->featureType) {
+        result.error = "descriptor type does not match input file";
+        return false;
+    }
+    result.descriptors = result.searchedDescriptors = worker.descriptors.rows;
+    
+    if (database->adaptive) {
+        adaptiveSearch(worker, result, tick);
+        worker.timer->add("search", result.searchTime);
+        worker.timer->add("vote", result.voteTime);
+        return true;
+    }
+    
+    if (worker.batcher)
+        batchSearch(worker, worker.descriptors);
+    else
+        searchDatabase(worker, worker.descriptors);
+    result.searchTime = elapsedMiliseconds(tick);
+    
+    voteDescriptors(worker.votes, worker.indices, worker.dists, *database->descriptorImages, database->distanceRatio);
+    worker.votes.rank(database->topK, result.ranking);
+    worker.votes.clear();
+    result.found = !result.ranking.empty() && result.ranking[0].first>=database->minimunMatchedPoints;
+    result.voteTime = elapsedMiliseconds(tick);
+    
+    worker.timer->add("search", result.searchTime);
+    worker.timer->add("vote", result.voteTime);
+    
+    return true;
+}
+
+//search and vote of matchImage in blocks of ADAPTIVE_BLOCK descriptors, strongest keypoint response first, until
+//every descriptor is searched or the leading image is decided
+void adaptiveSearch(MatchWorker &worker, MatchResult &result, int64 &tick)
+{
+    const MatchDatabase *database = worker.database;
+    const Mat &descriptors = worker.descriptors;
+    
+    worker.order.resize(descriptors.rows);
+    for (int i=0; i<descriptors.rows; i++) {
+        worker.order[i] = make_pair(-worker.keypoints[i].response, i);
+    }
+    std::stable_sort(worker.order.begin(), worker.order.end());
+    worker.orderedDescriptors.create(descriptors.rows, descriptors.cols, descriptors.type());
+    for (int i=0; i<descriptors.rows; i++) {
+        descriptors.row(worker.order[i].second).copyTo(worker.orderedDescriptors.row(i));
+    }
+    result.searchTime += elapsedMiliseconds(tick);
+    
+    int searched = 0;
+    while (searched<descriptors.rows) {
+        int last = std::min(descriptors.rows, searched + ADAPTIVE_BLOCK);
+        searchDatabase(worker, worker.orderedDescriptors.rowRange(searched, last));
+        result.searchTime += elapsedMiliseconds(tick);
+        
+        voteDescriptors(worker.votes, worker.indices, worker.dists, *database->descriptorImages, database->distanceRatio);
+        searched = last;
+        worker.votes.rank(2, result.ranking);
+        result.voteTime += elapsedMiliseconds(tick);
+        if (isLeadDecided(database, result.ranking, searched, descriptors.rows - searched))
+            break;
+    }
+    result.searchedDescriptors = searched;
+    
+    worker.votes.rank(database->topK, result.ranking);
+    worker.votes.clear();
+    result.found = !result.ranking.empty() && result.ranking[0].first>=database->minimunMatchedPoints;
+    result.voteTime += elapsedMiliseconds(tick);
+}
+
+//the leader can not be caught any more when its lead is larger than the descriptors left. Otherwise, once enough
+//descriptors are searched, votes that go to either of the two are taken as fair coin flips if both were equally good
+//matches, and the lead is decisive when it is that many standard deviations above zero. The leader also has to have
+//min_point votes, so stopping never turns a found image into a not found one
+bool isLeadDecided(const MatchDatabase *database, const cv::vector<pair<int, uint32_t> > &ranking, int searched, int remaining)
+{
+    if (ranking.empty() || ranking[0].first<database->minimunMatchedPoints)
+        return false;
+    int leader = ranking[0].first;
+    int runnerUp = ranking.size()>1 ? ranking[1].first : 0;
+    if (leader - runnerUp>remaining)
+        return true;
+    if (searched<database->minDescriptors)
+        return false;
+    return leader - runnerUp > database->leadThreshold * sqrt((double)(leader + runnerUp));
+}
+
+//z with P(Z < z) = probability for a standard normal Z, by bisection on erfc
+double normalQuantile(double probability)
+{
+    double low = -10, high = 10;
+    for (int i=0; i<100; i++) {
+        double middle = (low + high) / 2;
+        if (0.5 * erfc(-middle / sqrt(2.0))<probability)
+            low = middle;
+        else
+            high = middle;
+    }
+    return (low + high) / 2;
+}
+
+//k nearest neighbors of the descriptors over the whole database into worker.indices and worker.dists; shards are
+//searched by their shard threads while this thread searches the first one, and their neighbors merged, which gives
+//the same neighbors as one database when the search is exact, so the ratio test and the vote do not depend on the sharding
+void searchDatabase(MatchWorker &worker, const Mat &descriptors)
+{
+    const MatchDatabase *database = worker.database;
+    const cv::vector<SearchShard> &shards = *database->shards;
+    if (shards.size()==1) {
+        searchShard(database, shards[0], descriptors, worker.indices, worker.dists);
+        return;
+    }
+    
+    worker.shardIndices.resize(shards.size());
+    worker.shardDists.resize(shards.size());
+    ShardSearchGroup group;
+    group.remaining = (int)shards.size() - 1;
+    pthread_mutex_init(&group.mutex, NULL);
+    pthread_cond_init(&group.condition, NULL);
+    cv::vector<ShardSearch> searches(shards.size());
+    for (size_t i=0; i<shards.size(); i++) {
+        searches[i].database = database;
+        searches[i].shard = &shards[i];
+        searches[i].descriptors = &descriptors;
+        searches[i].indices = &worker.shardIndices[i];
+        searches[i].dists = &worker.shardDists[i];
+        searches[i].group = &group;
+    }
+    for (size_t i=1; i<shards.size(); i++) {
+        database->searchers->queues[i]->push(&searches[i]);
+    }
+    searchShard(database, shards[0], descriptors, worker.shardIndices[0], worker.shardDists[0]);
+    pthread_mutex_lock(&group.mutex);
+    while (group.remaining>0)
+        pthread_cond_wait(&group.condition, &group.mutex);
+    pthread_mutex_unlock(&group.mutex);
+    pthread_cond_destroy(&group.condition);
+    pthread_mutex_destroy(&group.mutex);
+    
+    mergeShardNeighbors(database, worker.shardIndices, worker.shardDists, worker.indices, worker.dists);
+}
+
+//searchDatabase through the batcher: the descriptors join the open batch, and the results are the rows of this query
+//in the results of the whole batch; time spent waiting for other queries or their search is "batch wait"
+void batchSearch(MatchWorker &worker, const Mat &descriptors)
+{
+    SearchBatcher *batcher = worker.batcher;
+    int64 tick = getTickCount();
+    
+    //the previous results are rows of an earlier batch that other threads may still be reading
+    worker.indices.release();
+    worker.dists.release();
+    
+    pthread_mutex_lock(&batcher->mutex);
+    if (batcher->open.empty()) {
+        batcher->open = new SearchBatch();
+        batcher->open->closed = false;
+        batcher->open->done = false;
+    }
+    Ptr<SearchBatch> batch = batcher->open;
+    size_t slot = batch->descriptors.size();
+    batch->descriptors.push_back(descriptors);
+    
+    bool leader = (int)batch->descriptors.size()>=batcher->batchSize;
+    if (!leader && slot==0) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        int64 deadline = (int64)now.tv_sec * 1000000 + now.tv_usec + (int64)(batcher->latency * 1000);
+        struct timespec timeout;
+        timeout.tv_sec = (time_t)(deadline / 1000000);
+        timeout.tv_nsec = (long)(deadline % 1000000) * 1000;
+        while (!batch->closed && pthread_cond_timedwait(&batcher->condition, &batcher->mutex, &timeout)!=ETIMEDOUT);
+        leader = !batch->closed;
+    }
+    if (leader) {
+        batch->closed = true;
+        batcher->open.release();
+        pthread_cond_broadcast(&batcher->condition);
+        pthread_mutex_unlock(&batcher->mutex);
+        
+        Mat all;
+        int rows = 0;
+        for (size_t i=0; i<batch->descriptors.size(); i++) {
+            batch->offsets.push_back(rows);
+            rows += batch->descriptors[i].rows;
+        }
+        vconcat(batch->descriptors, all);
+        worker.timer->add("batch wait", elapsedMiliseconds(tick));
+        searchDatabase(worker, all);
+        
+        pthread_mutex_lock(&batcher->mutex);
+        batch->indices = worker.indices;
+        batch->dists = worker.dists;
+        batch->done = true;
+        pthread_cond_broadcast(&batcher->condition);
+    }
+    else {
+        while (!batch->done)
+            pthread_cond_wait(&batcher->condition, &batcher->mutex);
+        worker.timer->add("batch wait", elapsedMiliseconds(tick));
+    }
+    pthread_mutex_unlock(&batcher->mutex);
+    
+    int first = batch->offsets[slot];
+    worker.indices = batch->indices.rowRange(first, first + descriptors.rows);
+    worker.dists = batch->dists.rowRange(first, first + descriptors.rows);
+}
+
+//indices are local to the shard; an empty shard returns no neighbors
+void searchShard(const MatchDatabase *database, const SearchShard &shard, const Mat &descriptors, Mat &indices, Mat &dists)
+{
+    if (shard.features.empty()) {
+        indices.create(descriptors.rows, database->neighbors, CV_32S);
+        indices.setTo(Scalar(-1));
+        dists.create(descriptors.rows, database->neighbors, CV_32F);
+        dists.setTo(Scalar(FLT_MAX));
+    }
+    else if (database->backend==kSearchBackendIvfPq) {
+        shard.ivfpq->knnSearch(descriptors, indices, dists, database->neighbors, database->nprobe);
+    }
+    else if (database->backend==kSearchBackendExact) {
+        exactKnnSearch(shard.features, descriptors, indices, dists, database->neighbors);
+    }
+    else if (database->backend==kSearchBackendQuantizedScan) {
+        quantizedKnnSearch(shard.features, database->quantization, descriptors, indices, dists, database->neighbors);
+    }
+    else {
+        shard.flannIndex->knnSearch(descriptors, indices, dists, database->neighbors, cv::flann::SearchParams(SEARCH_CHECKS_DEFAULT));
+    }
+}
+
+//the group may be gone once its last search is counted, so it is not touched after that
+void *runShardSearches(void *arg)
+{
+    BoundedQueue<ShardSearch *> *queue = (BoundedQueue<ShardSearch *> *)arg;
+    ShardSearch *search;
+    while (queue->pop(search)) {
+        searchShard(search->database, *search->shard, *search->descriptors, *search->indices, *search->dists);
+        ShardSearchGroup *group = search->group;
+        pthread_mutex_lock(&group->mutex);
+        if (--group->remaining==0)
+            pthread_cond_signal(&group->condition);
+        pthread_mutex_unlock(&group->mutex);
+    }
+    return NULL;
+}
+
+//k smallest distances over the neighbors of all shards, ties go to the lower row like in one database;
+//distances keep the type of the index (CV_32S under Hamming)
+void mergeShardNeighbors(const MatchDatabase *database, const cv::vector<Mat> &shardIndices, const cv::vector<Mat> &shardDists, Mat &indices, Mat &dists)
+{
+    const cv::vector<SearchShard> &shards = *database->shards;
+    int knn = database->neighbors;
+    int rows = shardIndices[0].rows;
+    int type = CV_32F;
+    for (size_t s=0; s<shards.size(); s++) {
+        if (!shards[s].features.empty()) {
+            type = shardDists[s].type();
+            break;
+        }
+    }
+    
+    indices.create(rows, knn, CV_32S);
+    dists.create(rows, knn, type);
+    cv::vector<pair<float, int> > candidates;
+    for (int i=0; i<rows; i++) {
+        candidates.clear();
+        for (size_t s=0; s<shards.size(); s++) {
+            for (int k=0; k<shardIndices[s].cols; k++) {
+                int index = shardIndices[s].at<int>(i, k);
+                if (index>=0)
+                    candidates.push_back(make_pair(featureDistance(shardDists[s], i, k), index + shards[s].rowOffset));
+            }
+        }
+        size_t count = std::min(candidates.size(), (size_t)knn);
+        std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end());
+        for (int k=0; k<knn; k++) {
+            bool found = k<(int)count;
+            indices.at<int>(i, k) = found ? candidates[k].second : -1;
+            if (type==CV_32S)
+                dists.at<int>(i, k) = found ? (int)candidates[k].first : INT_MAX;
+            else
+                dists.at<float>(i, k) = found ? candidates[k].first : FLT_MAX;
+        }
+    }
+}
+
+//one request line without its line break; a line longer than SERVER_MAX_LINE is read to its end and returned
+//cut short with tooLong set. False at the end of the input
+bool readRequestLine(FILE *in, string &line, bool &tooLong)
+{
+    line.clear();
+    tooLong = false;
+    int c;
+    while ((c = getc(in))!=EOF && c!='\n') {
+        if (line.size()<SERVER_MAX_LINE)
+            line.push_back((char)c);
+        else
+            tooLong = true;
+    }
+    if (c==EOF && line.empty())
+        return false;
+    if (!line.empty() && line[line.size() - 1]=='\r')
+        line.erase(line.size() - 1);
+    return true;
+}
+
+//line protocol, one request per line:
+//  PATH <image path>           match an image file readable by the server
+//  DATA <size>\n<size bytes>   match an encoded image sent inline
+//  QUIT                        close the connection
+//answer is "OK <n>" followed by n lines "<rank> <votes> <filename>" and a TIME line, or "ERROR <message>";
+//returns true when the client sent QUIT
+bool serveRequests(MatchWorker &worker, FILE *in, FILE *out)
+{
+    const cv::vector<string> &filenames = *worker.database->filenames;
+    string line;
+    bool tooLong;
+    cv::vector<uchar> buffer;
+    Mat image;
+    MatchResult result;
+    
+    while (readRequestLine(in, line, tooLong)) {
+        int64 tick = getTickCount();
+        
+        if (tooLong) {
+            fprintf(out, "ERROR request line too long\n");
+            fflush(out);
+            continue;
+        }
+        else if (line.compare(0, 5, "PATH ")==0) {
+            image = loadImage(line.c_str() + 5, CV_LOAD_IMAGE_GRAYSCALE, worker.database->imageScale);
+        }
+        else if (line.compare(0, 5, "DATA ")==0) {
+            size_t size = strtoul(line.c_str() + 5, NULL, 10);
+            if (size==0 || size>SERVER_MAX_REQUEST_SIZE) {
+                fprintf(out, "ERROR invalid data size\n");
+                fflush(out);
+                break;
+            }
+            buffer.resize(size);
+            if (fread(&buffer[0], 1, size, in)!=size) {
+                break;
+            }
+            image = decodeImage(Mat(buffer), CV_LOAD_IMAGE_GRAYSCALE, worker.database->imageScale);
+        }
+        else if (line=="QUIT") {
+            return true;
+        }
+        else {
+            fprintf(out, "ERROR unknown request\n");
+            fflush(out);
+            continue;
+        }
+        
+        if (!image.data) {
+            fprintf(out, "ERROR could not decode image\n");
+        }
+        else {
+            double decodeTime = elapsedMiliseconds(tick);
+            worker.timer->add("decode", decodeTime);
+            if (!matchImage(worker, image, result)) {
+                fprintf(out, "ERROR %s\n", result.error.c_str());
+            }
+            else {
+                size_t count = result.found ? result.ranking.size() : 0;
+                fprintf(out, "OK %zu\n", count);
+                for (size_t i=0; i<count; i++) {
+                    fprintf(out, "%zu %d %s\n", i + 1, result.ranking[i].first, filenames[result.ranking[i].second].c_str());
                 }
-                
-                cout << "...done" << endl;
+                fprintf(out, "TIME decode=%.3f detect=%.3f extract=%.3f search=%.3f vote=%.3f\n", decodeTime, result.detectTime, result.extractTime, result.searchTime, result.voteTime);
             }
         }
+        fflush(out);
+    }
+    return false;
+}
+
+//a client that sends QUIT gets the stage times so far printed by the server
+void *serveConnections(void *arg)
+{
+    MatchWorker *worker = (MatchWorker *)arg;
+    ServerContext *server = worker->server;
+    
+    while (true) {
+        pthread_mutex_lock(&server->mutex);
+        while (server->connections.empty() && !server->stopping) {
+            pthread_cond_wait(&server->condition, &server->mutex);
+        }
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->mutex);
+            break;
+        }
+        int connection = server->connections.front();
+        server->connections.erase(server->connections.begin());
+        server->served.push_back(connection);
+        pthread_mutex_unlock(&server->mutex);
+        
+        bool quit = false;
+        FILE *in = fdopen(connection, "r");
+        FILE *out = fdopen(dup(connection), "w");
+        if (in && out) {
+            quit = serveRequests(*worker, in, out);
+        }
+        
+        //the connection leaves served before it is closed, so runServer never shuts down a reused descriptor
+        pthread_mutex_lock(&server->mutex);
+        server->served.erase(std::find(server->served.begin(), server->served.end(), connection));
+        if (quit)
+            worker->timer->report(cout);
+        pthread_mutex_unlock(&server->mutex);
+        if (out)
+            fclose(out);
+        if (in)
+            fclose(in);
+        else
+            close(connection);
+    }
+    
+    return NULL;
+}
+
+//written by stopServer, wakes the accept loop
+static int serverStopPipe[2] = {-1, -1};
+
+void stopServer(int signal)
+{
+    //nothing can be done about a failed write in a signal handler, an earlier byte has woken the loop anyway
+    char byte = 0;
+    ssize_t ignored = write(serverStopPipe[1], &byte, 1);
+    (void)ignored;
+}
+
+//accepts clients on a Unix domain socket, each connection is served by one worker of the pool; SIGINT and SIGTERM
+//stop the server, which then prints the stage times and writes the report
+int runServer(const char *socketPath, cv::vector<MatchWorker> &workers, const char *report)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath)>=sizeof(address.sun_path)) {
+        cout << "socket path is too long " << socketPath << endl;
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+    
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (listener<0 || bind(listener, (struct sockaddr *)&address, sizeof(address))!=0 || listen(listener, SERVER_BACKLOG)!=0) {
+        cout << "could not listen on socket " << socketPath << endl;
+        return -1;
+    }
+    if (pipe(serverStopPipe)!=0) {
+        cout << "could not create stop pipe" << endl;
+        close(listener);
+        return -1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    
+    ServerContext server;
+    server.workers = workers.size();
+    server.stopping = false;
+    pthread_mutex_init(&server.mutex, NULL);
+    pthread_cond_init(&server.condition, NULL);
+    
+    cv::vector<pthread_t> threadIds(workers.size());
+    for (size_t i=0; i<workers.size(); i++) {
+        workers[i].server = &server;
+        pthread_create(&threadIds[i], NULL, serveConnections, &workers[i]);
+    }
+    
+    cout << "serving requests on " << socketPath << " with " << workers.size() << " threads" << endl;
+    
+    int result = 0;
+    struct pollfd fds[2];
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    fds[1].fd = serverStopPipe[0];
+    fds[1].events = POLLIN;
+    while (true) {
+        if (poll(fds, 2, -1)<0) {
+            if (errno==EINTR)
+                continue;
+            cout << "could not wait for connections on socket " << socketPath << endl;
+            result = -1;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (!fds[0].revents)
+            continue;
+        
+        int connection = accept(listener, NULL, NULL);
+        if (connection<0) {
+            if (errno==EINTR || errno==ECONNABORTED)
+                continue;
+            cout << "could not accept connection on socket " << socketPath << endl;
+            result = -1;
+            break;
+        }
+        pthread_mutex_lock(&server.mutex);
+        bool busy = server.connections.size() + server.served.size()>=server.workers;
+        if (!busy) {
+            server.connections.push_back(connection);
+            pthread_cond_signal(&server.condition);
+        }
+        pthread_mutex_unlock(&server.mutex);
+        if (busy) {
+            static const char refused[] = "ERROR server busy\n";
+            send(connection, refused, sizeof(refused) - 1, 0);
+            close(connection);
+        }
+    }
+    
+    //clients still connected see the end of their connection, waiting ones are dropped
+    cout << "stop serving requests on " << socketPath << endl;
+    close(listener);
+    unlink(socketPath);
+    pthread_mutex_lock(&server.mutex);
+    server.stopping = true;
+    for (size_t i=0; i<server.served.size(); i++) {
+        shutdown(server.served[i], SHUT_RDWR);
+    }
+    for (size_t i=0; i<server.connections.size(); i++) {
+        close(server.connections[i]);
+    }
+    server.connections.clear();
+    pthread_cond_broadcast(&server.condition);
+    pthread_mutex_unlock(&server.mutex);
+    for (size_t i=0; i<workers.size(); i++) {
+        pthread_join(threadIds[i], NULL);
+    }
+    pthread_cond_destroy(&server.condition);
+    pthread_mutex_destroy(&server.mutex);
+    close(serverStopPipe[0]);
+    close(serverStopPipe[1]);
+    
+    StageTimer *timer = workers[0].timer;
+    timer->report(cout);
+    if (report && !timer->writeJSON(report)) {
+        cout << "could not write report file " << report << endl;
+    }
+    
+    return result;
+}
+
+//flat descriptor row -> database image table, replaces a binary search over indexes per matched descriptor;
+//rows of deleted images map to DELETED_IMAGE
+void mapDescriptorImages(const cv::vector<int> &indexes, const cv::vector<unsigned char> &flags, int rows, cv::vector<uint32_t> &descriptorImages)
+{
+    descriptorImages.assign(rows, 0);
+    for (size_t i=0; i<indexes.size(); i++) {
+        int end = i+1<indexes.size() ? indexes[i+1] : rows;
+        uint32_t image = (flags[i] & FEATURE_IMAGE_DELETED) ? DELETED_IMAGE : (uint32_t)i;
+        for (int k=indexes[i]; k<end; k++) {
+            descriptorImages[k] = image;
+        }
+    }
+}
+
+//ratio test on the two nearest neighbors that do not belong to deleted images; a deleted image is usually an
+//older copy of a changed file, so letting it take part would make the ratio test reject the new copy
+void voteDescriptors(VoteAccumulator &votes, const Mat &indices, const Mat &dists, const cv::vector<uint32_t> &descriptorImages, float distanceRatio)
+{
+    for (int i=0; i<indices.rows; i++) {
+        int first = 0;
+        while (first<indices.cols && indices.at<int>(i, first)>=0 && descriptorImages[indices.at<int>(i, first)]==DELETED_IMAGE)
+            first++;
+        int second = first + 1;
+        while (second<indices.cols && indices.at<int>(i, second)>=0 && descriptorImages[indices.at<int>(i, second)]==DELETED_IMAGE)
+            second++;
+        if (second>=indices.cols)
+            continue;
+        
+        int k = indices.at<int>(i, first);
+        if (k>=0 && featureDistance(dists, i, first) < distanceRatio * featureDistance(dists, i, second)) {
+            votes.add(descriptorImages[k]);
+        }
+    }
+}
+
+//extracts the labeled query set once, then for every index type and tree count builds an index, and for every
+//checks value searches all queries; ratio and min_point only change the vote, so they reuse those results
+int runBenchmark(const BenchmarkOptions &options, MatchWorker &worker, const Mat &features, const Mat &quantizedFeatures, const char *directoryName)
+{
+    DIR *dir = opendir(directoryName);
+    if (!dir) {
+        cout << "could not open directory " << directoryName << endl;
+        return -1;
+    }
+    
+    FILE *out = fopen(options.output, "w");
+    if (!out) {
+        cout << "could not open benchmark output " << options.output << endl;
+        closedir(dir);
+        return -1;
+    }
+    
+    cv::vector<string> indexTypes = splitList(options.indexTypes);
+    cv::vector<string> trees = splitList(options.trees);
+    cv::vector<string> checks = splitList(options.checks);
+    cv::vector<string> ratios = splitList(options.ratios);
+    cv::vector<string> minPoints = splitList(options.minPoints);
+    
+    struct dirent *ep;
+    char path[1000];
+    struct stat buf;
+    cv::vector<string> queryNames;
+    cv::vector<Mat> queryDescriptors;
+    
+    cout << "extract query descriptors..." << endl;
+    while ((ep = readdir(dir))) {
+        if (strlen(ep->d_name)==0 || ep->d_name[0]=='.')
+            continue;
+        sprintf(path, "%s/%s", directoryName, ep->d_name);
+        lstat(path, &buf);
+        if (!S_ISREG(buf.st_mode))
+            continue;
+        Mat image = loadImage(path, CV_LOAD_IMAGE_GRAYSCALE, worker.database->imageScale);
+        if (!image.data)
+            continue;
+        Mat descriptors;
+        worker.detector->detect(image, worker.keypoints);
+        worker.extractor->compute(image, worker.keypoints, descriptors);
+        prepareFeatures(descriptors);
+        if (!descriptors.empty() && descriptors.type()!=features.type()) {
+            cout << "descriptor type does not match input file" << endl;
+            closedir(dir);
+            fclose(out);
+            return -1;
+        }
+        queryNames.push_back(ep->d_name);
+        queryDescriptors.push_back(descriptors);
     }
     closedir(dir);
     
-    t = 1000 * (((double)getTickCount() - t) / getTickFrequency());
-	cout << endl << "Time passed in miliseconds: " << t << endl;
+    if (queryNames.empty()) {
+        cout << "There is no image in directory" << endl;
+        fclose(out);
+        return -2;
+    }
     
-    cout.precision(2);
-    cout << endl << "correct rate: " << (100.0 * trueMatch / totalFile) << endl;
-    cout << endl << "not found rate: " << (100.0 * notFound / totalFile) << endl;
+    bool json = strlen(options.output)>=5 && strcasecmp(options.output + strlen(options.output) - 5, ".json")==0;
+    if (json)
+        fprintf(out, "[");
+    else
+        fprintf(out, "index,trees,checks,distance_ratio,min_point,correct_rate,not_found_rate,queries_per_sec,build_ms,index_memory_mb,features_memory_mb\n");
+    
+    const cv::vector<uint32_t> &descriptorImages = *worker.database->descriptorImages;
+    const cv::vector<string> &filenames = *worker.database->filenames;
+    double featuresMemory = (double)features.rows * features.cols * features.elemSize() / (1 << 20);
+    double quantizedMemory = (double)quantizedFeatures.rows * quantizedFeatures.cols * quantizedFeatures.elemSize() / (1 << 20);
+    cv::vector<Mat> indices(queryNames.size()), dists(queryNames.size());
+    cv::vector<pair<int, uint32_t> > ranking;
+    bool first = true;
+    
+    for (size_t a=0; a<indexTypes.size(); a++) {
+        for (size_t b=0; b<trees.size(); b++) {
+            //"quantized" is the linear scan over the stored rows of a quantized input file, "exact" the SIMD scan
+            //over the descriptors, and "ivfpq" the index written by fd_generate --ivfpq, which is searched with
+            //checks as nprobe and keeps no descriptors
+            bool scan = indexTypes[a]=="quantized";
+            bool exact = indexTypes[a]=="exact";
+            if (scan && quantizedFeatures.empty()) {
+                cout << "index quantized needs a quantized input file, skip" << endl;
+                break;
+            }
+            const IvfPqIndex *ivfpq = indexTypes[a]=="ivfpq" && worker.database->shards->size()==1 ? (*worker.database->shards)[0].ivfpq : NULL;
+            if (indexTypes[a]=="ivfpq" && !ivfpq) {
+                cout << "index ivfpq needs an unsharded input file with an IVF-PQ index, run fd_generate --ivfpq, skip" << endl;
+                break;
+            }
+            
+            size_t memoryBefore = residentMemory();
+            int64 tick = getTickCount();
+            flann::Index index;
+            if (!scan && !exact && !ivfpq && !buildFeatureIndex(index, features, indexTypes[a], atoi(trees[b].c_str()))) {
+                cout << "index " << indexTypes[a] << " does not apply to these descriptors, skip" << endl;
+                break;
+            }
+            double buildTime = elapsedMiliseconds(tick);
+            size_t memoryAfter = residentMemory();
+            double indexMemory = memoryAfter>memoryBefore ? (double)(memoryAfter - memoryBefore) / (1 << 20) : 0;
+            double descriptorMemory = scan ? quantizedMemory : featuresMemory;
+            if (ivfpq) {
+                indexMemory = (double)ivfpq->byteSize() / (1 << 20);
+                descriptorMemory = 0;
+            }
+            
+            for (size_t c=0; c<checks.size(); c++) {
+                tick = getTickCount();
+                for (size_t q=0; q<queryNames.size(); q++) {
+                    if (queryDescriptors[q].empty())
+                        continue;
+                    if (scan)
+                        quantizedKnnSearch(quantizedFeatures, worker.database->quantization, queryDescriptors[q], indices[q], dists[q], worker.database->neighbors);
+                    else if (exact)
+                        exactKnnSearch(features, queryDescriptors[q], indices[q], dists[q], worker.database->neighbors);
+                    else if (ivfpq)
+                        ivfpq->knnSearch(queryDescriptors[q], indices[q], dists[q], worker.database->neighbors, atoi(checks[c].c_str()));
+                    else
+                        index.knnSearch(queryDescriptors[q], indices[q], dists[q], worker.database->neighbors, cv::flann::SearchParams(atoi(checks[c].c_str())));
+                }
+                double searchTime = elapsedMiliseconds(tick);
+                
+                for (size_t d=0; d<ratios.size(); d++) {
+                    float ratio = (float)atof(ratios[d].c_str());
+                    for (size_t e=0; e<minPoints.size(); e++) {
+                        int minPoint = atoi(minPoints[e].c_str());
+                        int trueMatch = 0, notFound = 0;
+                        
+                        tick = getTickCount();
+                        for (size_t q=0; q<queryNames.size(); q++) {
+                            if (!queryDescriptors[q].empty())
+                                voteDescriptors(worker.votes, indices[q], dists[q], descriptorImages, ratio);
+                            worker.votes.rank(1, ranking);
+                            worker.votes.clear();
+                            if (ranking.empty() || ranking[0].first<minPoint)
+                                notFound++;
+                            else if (isExpectedMatch(*worker.database->groundTruth, queryNames[q], filenames[ranking[0].second]))
+                                trueMatch++;
+                        }
+                        double voteTime = elapsedMiliseconds(tick);
+                        
+                        double correctRate = 100.0 * trueMatch / queryNames.size();
+                        double notFoundRate = 100.0 * notFound / queryNames.size();
+                        double queriesPerSecond = 1000.0 * queryNames.size() / (searchTime + voteTime);
+                        
+                        if (json) {
+                            fprintf(out, "%s\n  {\"index\": \"%s\", \"trees\": %s, \"checks\": %s, \"distance_ratio\": %s, \"min_point\": %s, \"correct_rate\": %.2f, \"not_found_rate\": %.2f, \"queries_per_sec\": %.2f, \"build_ms\": %.1f, \"index_memory_mb\": %.1f, \"features_memory_mb\": %.1f}", first ? "" : ",", indexTypes[a].c_str(), trees[b].c_str(), checks[c].c_str(), ratios[d].c_str(), minPoints[e].c_str(), correctRate, notFoundRate, queriesPerSecond, buildTime, indexMemory, descriptorMemory);
+                        }
+                        else {
+                            fprintf(out, "%s,%s,%s,%s,%s,%.2f,%.2f,%.2f,%.1f,%.1f,%.1f\n", indexTypes[a].c_str(), trees[b].c_str(), checks[c].c_str(), ratios[d].c_str(), minPoints[e].c_str(), correctRate, notFoundRate, queriesPerSecond, buildTime, indexMemory, descriptorMemory);
+                        }
+                        first = false;
+                        
+                        cout << indexTypes[a] << " trees=" << trees[b] << " checks=" << checks[c] << " ratio=" << ratios[d] << " min_point=" << minPoints[e] << ": correct rate " << correctRate << ", not found rate " << notFoundRate << ", " << queriesPerSecond << " queries/sec" << endl;
+                    }
+                }
+            }
+            
+            //the tree count has no effect on a linear index
+            if (indexTypes[a]=="linear" || scan || exact || ivfpq)
+                break;
+        }
+    }
+    
+    if (json)
+        fprintf(out, "\n]\n");
+    fclose(out);
     
     return 0;
 }
 
+cv::vector<string> splitList(const char *list)
+{
+    cv::vector<string> result;
+    string item;
+    for (const char *p=list; ; p++) {
+        if (*p==',' || *p==0) {
+            if (!item.empty())
+                result.push_back(item);
+            item.clear();
+            if (*p==0)
+                break;
+        }
+        else if (*p!=' ') {
+            item += *p;
+        }
+    }
+    return result;
+}
+
+//resident set size in bytes
+size_t residentMemory()
+{
+#ifdef __APPLE__
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count)!=KERN_SUCCESS)
+        return 0;
+    return info.resident_size;
+#else
+    long pages = 0, resident = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return 0;
+    if (fscanf(file, "%ld %ld", &pages, &resident)!=2)
+        resident = 0;
+    fclose(file);
+    return (size_t)resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
 const Ptr<FeatureDetector> getDetector(const char *detectorAdapter, const char *detectorAlgorithm)
 {
     string detectorType = detectorAlgorithm;
@@ -0,0 +1,302 @@
+//
+//  main.cpp
+//  query_generate
+//
+//  Writes a perturbed copy of every image of a reference directory as a query set,
+//  plus a ground truth file mapping each query to its reference, for fd_match and bow_match.
+//  Output only depends on the seed, the options and the reference images.
+//
+
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include <algorithm>
+
+#include "opencv2/opencv.hpp"
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "../../common/ground_truth.h"
+
+using namespace std;
+using namespace cv;
+
+typedef enum {kLongOptionIndexNone, kLongOptionIndexDirectory, kLongOptionIndexOutput, kLongOptionIndexGroundTruth, kLongOptionIndexSeed, kLongOptionIndexCopies, kLongOptionIndexScale, kLongOptionIndexRotation, kLongOptionIndexCrop, kLongOptionIndexBlur, kLongOptionIndexJpegQuality, kLongOptionIndexBrightness} LongOptionIndex;
+
+static const char* GROUND_TRUTH_DEFAULT = "ground_truth.yml";
+static const unsigned SEED_DEFAULT = 1;
+static const int COPIES_DEFAULT = 1;
+static const float SCALE_MIN_DEFAULT = 0.5f;
+static const float SCALE_MAX_DEFAULT = 1.0f;
+static const float ROTATION_DEFAULT = 10.0f;
+static const float CROP_DEFAULT = 0.1f;
+static const float BLUR_DEFAULT = 1.0f;
+static const int JPEG_QUALITY_MIN_DEFAULT = 60;
+static const int JPEG_QUALITY_MAX_DEFAULT = 95;
+static const float BRIGHTNESS_DEFAULT = 20.0f;
+
+//maximum amount of every transformation, each query draws a value in the allowed range
+struct Transformation {
+    float scaleMin, scaleMax;
+    float rotation;
+    float crop;
+    float blur;
+    int jpegQualityMin, jpegQualityMax;
+    float brightness;
+};
+
+Mat transformImage(const Mat &image, const Transformation &transformation, RNG &rng, int &jpegQuality);
+uint64 seedForFile(unsigned seed, const string &filename, int copy);
+
+int main(int argc, char * const *argv)
+{
+    const char *directoryName, *outputName, *groundTruthOutput;
+    directoryName = outputName = groundTruthOutput = NULL;
+    unsigned seed = SEED_DEFAULT;
+    int copies = COPIES_DEFAULT;
+    
+    Transformation transformation;
+    transformation.scaleMin = SCALE_MIN_DEFAULT;
+    transformation.scaleMax = SCALE_MAX_DEFAULT;
+    transformation.rotation = ROTATION_DEFAULT;
+    transformation.crop = CROP_DEFAULT;
+    transformation.blur = BLUR_DEFAULT;
+    transformation.jpegQualityMin = JPEG_QUALITY_MIN_DEFAULT;
+    transformation.jpegQualityMax = JPEG_QUALITY_MAX_DEFAULT;
+    transformation.brightness = BRIGHTNESS_DEFAULT;
+    
+    struct option longOptions[] = {
+        {"directory", required_argument, 0, kLongOptionIndexDirectory},
+        {"output", required_argument, 0, kLongOptionIndexOutput},
+        {"ground_truth", required_argument, 0, kLongOptionIndexGroundTruth},
+        {"seed", required_argument, 0, kLongOptionIndexSeed},
+        {"copies", required_argument, 0, kLongOptionIndexCopies},
+        {"scale", required_argument, 0, kLongOptionIndexScale},
+        {"rotation", required_argument, 0, kLongOptionIndexRotation},
+        {"crop", required_argument, 0, kLongOptionIndexCrop},
+        {"blur", required_argument, 0, kLongOptionIndexBlur},
+        {"jpeg_quality", required_argument, 0, kLongOptionIndexJpegQuality},
+        {"brightness", required_argument, 0, kLongOptionIndexBrightness},
+        {0, 0, 0, 0}
+    };
+    
+    int c, optionIndex;
+    while ((c=getopt_long(argc, argv, "", longOptions, &optionIndex))!=-1) {
+        switch (c) {
+            case kLongOptionIndexDirectory: {
+                directoryName = optarg;
+                break;
+            }
+            case kLongOptionIndexOutput: {
+                outputName = optarg;
+                break;
+            }
+            case kLongOptionIndexGroundTruth: {
+                groundTruthOutput = optarg;
+                break;
+            }
+            case kLongOptionIndexSeed: {
+                seed = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            }
+            case kLongOptionIndexCopies: {
+                copies = atoi(optarg);
+                break;
+            }
+            case kLongOptionIndexScale: {
+                //either "factor" or "min,max"
+                if (sscanf(optarg, "%f,%f", &transformation.scaleMin, &transformation.scaleMax)==1) {
+                    transformation.scaleMax = transformation.scaleMin;
+                }
+                break;
+            }
+            case kLongOptionIndexRotation: {
+                transformation.rotation = atof(optarg);
+                break;
+            }
+            case kLongOptionIndexCrop: {
+                transformation.crop = atof(optarg);
+                break;
+            }
+            case kLongOptionIndexBlur: {
+                transformation.blur = atof(optarg);
+                break;
+            }
+            case kLongOptionIndexJpegQuality: {
+                if (sscanf(optarg, "%d,%d", &transformation.jpegQualityMin, &transformation.jpegQualityMax)==1) {
+                    transformation.jpegQualityMax = transformation.jpegQualityMin;
+                }
+                break;
+            }
+            case kLongOptionIndexBrightness: {
+                transformation.brightness = atof(optarg);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    
+    if (!directoryName) {
+        cout << "need input directory" << endl;
+        return -1;
+    }
+    
+    if (!outputName) {
+        cout << "need output directory" << endl;
+        return -1;
+    }
+    
+    if (!groundTruthOutput) {
+        cout << "use " << GROUND_TRUTH_DEFAULT << " as ground truth file" << endl;
+        groundTruthOutput = GROUND_TRUTH_DEFAULT;
+    }
+    
+    if (copies<=0) {
+        cout << "use " << COPIES_DEFAULT << " as number of queries per image" << endl;
+        copies = COPIES_DEFAULT;
+    }
+    
+    if (transformation.scaleMin<=0 || transformation.scaleMax<transformation.scaleMin) {
+        cout << "use " << SCALE_MIN_DEFAULT << "," << SCALE_MAX_DEFAULT << " as scale range" << endl;
+        transformation.scaleMin = SCALE_MIN_DEFAULT;
+        transformation.scaleMax = SCALE_MAX_DEFAULT;
+    }
+    
+    if (transformation.crop<0 || transformation.crop>=0.5f) {
+        cout << "use " << CROP_DEFAULT << " as crop fraction" << endl;
+        transformation.crop = CROP_DEFAULT;
+    }
+    
+    transformation.jpegQualityMin = std::max(1, std::min(100, transformation.jpegQualityMin));
+    transformation.jpegQualityMax = std::max(transformation.jpegQualityMin, std::min(100, transformation.jpegQualityMax));
+    
+    DIR *dir;
+    dir = opendir(directoryName);
+    if (!dir) {
+        cout << "could not open directory " << directoryName << endl;
+        return -1;
+    }
+    
+    mkdir(outputName, 0755);
+    
+    struct dirent *ep;
+    char *filename;
+    char path[1000];
+    struct stat buf;
+    cv::vector<string> candidates;
+    
+    while ((ep = readdir(dir))) {
+    	filename = ep->d_name;
+        if(strlen(filename)==0 || filename[0]=='.')
+        	continue;
+        
+        sprintf(path, "%s/%s", directoryName, filename);
+        
+        lstat(path, &buf);
+        if (S_ISREG(buf.st_mode)) {
+            candidates.push_back(filename);
+        }
+    }
+    closedir(dir);
+    
+    //readdir order depends on the file system, sort so the query set is the same everywhere
+    std::sort(candidates.begin(), candidates.end());
+    
+    cv::vector<string> queries;
+    cv::vector<string> references;
+    cv::vector<int> parameters(2);
+    parameters[0] = CV_IMWRITE_JPEG_QUALITY;
+    
+    cout << "generating..." << endl;
+    
+    for (size_t i=0; i<candidates.size(); i++) {
+        sprintf(path, "%s/%s", directoryName, candidates[i].c_str());
+        Mat image = imread(path);
+        if (!image.data)
+            continue;
+        
+        //named after the whole reference filename, so references that only differ in extension get their own queries
+        for (int copy=0; copy<copies; copy++) {
+            RNG rng(seedForFile(seed, candidates[i], copy));
+            Mat query = transformImage(image, transformation, rng, parameters[1]);
+            
+            char queryName[1000];
+            snprintf(queryName, sizeof(queryName), "%s_q%d.jpg", candidates[i].c_str(), copy);
+            sprintf(path, "%s/%s", outputName, queryName);
+            
+            cout << "File " << candidates[i] << " -> " << queryName << "...";
+            if (!imwrite(path, query, parameters)) {
+                cout << "could not write" << endl;
+                continue;
+            }
+            cout << " done" << endl;
+            
+            queries.push_back(queryName);
+            references.push_back(candidates[i]);
+        }
+    }
+    
+    cout << "write ground truth to file " << groundTruthOutput << "...";
+    if (!writeGroundTruth(groundTruthOutput, queries, references)) {
+        cout << endl << "could not write ground truth file " << groundTruthOutput << endl;
+        return -1;
+    }
+    cout << "\tdone" << endl;
+    
+    return 0;
+}
+
+//crop, rotate, scale, blur and change brightness, in that order; jpegQuality receives the quality to encode with
+Mat transformImage(const Mat &image, const Transformation &transformation, RNG &rng, int &jpegQuality)
+{
+    int left = (int)(image.cols * rng.uniform(0.0, (double)transformation.crop));
+    int right = (int)(image.cols * rng.uniform(0.0, (double)transformation.crop));
+    int top = (int)(image.rows * rng.uniform(0.0, (double)transformation.crop));
+    int bottom = (int)(image.rows * rng.uniform(0.0, (double)transformation.crop));
+    Mat result = image(Rect(left, top, image.cols - left - right, image.rows - top - bottom)).clone();
+    
+    double angle = rng.uniform(-(double)transformation.rotation, (double)transformation.rotation);
+    if (angle!=0) {
+        Mat rotation = getRotationMatrix2D(Point2f(result.cols / 2.0f, result.rows / 2.0f), angle, 1.0);
+        warpAffine(result, result, rotation, result.size(), INTER_LINEAR, BORDER_REPLICATE);
+    }
+    
+    double scale = rng.uniform((double)transformation.scaleMin, (double)transformation.scaleMax);
+    if (scale!=1) {
+        Size size(std::max(1, (int)(result.cols * scale + 0.5)), std::max(1, (int)(result.rows * scale + 0.5)));
+        resize(result, result, size, 0, 0, scale<1 ? INTER_AREA : INTER_LINEAR);
+    }
+    
+    double sigma = rng.uniform(0.0, (double)transformation.blur);
+    if (sigma>0.1) {
+        GaussianBlur(result, result, Size(0, 0), sigma);
+    }
+    
+    double brightness = rng.uniform(-(double)transformation.brightness, (double)transformation.brightness);
+    if (brightness!=0) {
+        result.convertTo(result, -1, 1.0, brightness);
+    }
+    
+    jpegQuality = rng.uniform(transformation.jpegQualityMin, transformation.jpegQualityMax + 1);
+    
+    return result;
+}
+
+//one generator per query, so adding or removing reference images does not change the other queries
+uint64 seedForFile(unsigned seed, const string &filename, int copy)
+{
+    uint64 hash = 14695981039346656037ULL ^ seed;
+    for (size_t i=0; i<filename.size(); i++) {
+        hash ^= (unsigned char)filename[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= (uint64)copy;
+    hash *= 1099511628211ULL;
+    return hash ? hash : 1;
+}